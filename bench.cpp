@@ -0,0 +1,860 @@
+#include "minibson.hpp"
+#include "microbson.hpp"
+#include "microbson_blocks.hpp"
+#include "microbson_dictionary.hpp"
+#include "minibson_json.hpp"
+#include "microbson_parallel.hpp"
+#include "microbson_schema.hpp"
+#include "minibson_parallel.hpp"
+#include "microbson_struct.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/time.h>
+#else
+#include <ctime>
+#endif
+
+// Counts every allocation made through operator new, so benchmarks can
+// report allocations per operation. Build with make bench_pool, make
+// bench_resource or make bench_interned to see the same numbers with
+// MINIBSON_NODE_POOL, MINIBSON_MEMORY_RESOURCE or MINIBSON_INTERNED_KEYS.
+static size_t allocations = 0;
+
+#if defined(__GNUC__)
+__attribute__((noinline))
+#endif
+void* operator new(size_t size) throw (std::bad_alloc)
+{
+    void* result = std::malloc((size > 0) ? size : 1);
+
+    if (result == NULL)
+        throw std::bad_alloc();
+
+#if defined(__GNUC__)
+    __sync_fetch_and_add(&allocations, 1);
+#else
+    allocations++;
+#endif
+    return result;
+}
+
+#if defined(__GNUC__)
+__attribute__((noinline))
+#endif
+void operator delete(void* pointer) throw ()
+{
+    std::free(pointer);
+}
+
+double now();
+void report(const char* name, double seconds, size_t bytes, size_t count);
+void bench_json_reader();
+void bench_object_id();
+minibson::document large_document(size_t sections);
+void bench_serialize_parallel();
+void bench_deserialize_parallel();
+void bench_request_loop();
+void bench_assign_loop();
+void bench_arena_loop();
+void bench_struct_binding();
+void bench_schema();
+void bench_keys();
+void bench_key_memory();
+void bench_key_dictionary();
+void bench_block_compression();
+
+int main()
+{
+    bench_json_reader();
+    bench_object_id();
+    bench_serialize_parallel();
+    bench_deserialize_parallel();
+    bench_request_loop();
+    bench_assign_loop();
+    bench_arena_loop();
+    bench_struct_binding();
+    bench_schema();
+    bench_keys();
+    bench_key_memory();
+    bench_key_dictionary();
+    bench_block_compression();
+    return 0;
+}
+
+double now()
+{
+#if defined(__unix__) || defined(__APPLE__)
+    timeval value;
+
+    gettimeofday(&value, NULL);
+    return value.tv_sec + value.tv_usec * 1e-6;
+#else
+    return static_cast<double>(std::clock()) / CLOCKS_PER_SEC;
+#endif
+}
+
+void report(const char* name, double seconds, size_t bytes, size_t count)
+{
+    std::printf(
+        "%-40s %10.1f MB/s %12.0f ops/s\n",
+        name,
+        bytes / seconds / 1e6,
+        count / seconds
+    );
+}
+
+void bench_json_reader()
+{
+    using namespace std;
+
+    const int count = 200000;
+    vector<string> texts;
+    size_t bytes = 0;
+    size_t check = 0;
+
+    for (int i = 0; i < count; i++)
+    {
+        char text[256];
+
+        sprintf(
+            text,
+            "{\"id\": %d, \"user\": \"user-%d\", \"score\": %d.%d, "
+            "\"active\": %s, \"time\": %lld, "
+            "\"address\": {\"city\": \"Springfield\", \"zip\": \"%05d\"}}",
+            i, i % 1000, i % 100, i % 7, (i % 2) ? "true" : "false",
+            1600000000000LL + i, i % 99999
+        );
+        texts.push_back(text);
+        bytes += texts.back().length();
+    }
+
+    minibson::json_reader reader;
+    double start = now();
+
+    for (int i = 0; i < count; i++)
+    {
+        reader.parse(texts[i]);
+        check += reader.size();
+    }
+
+    report("json -> bson bytes", now() - start, bytes, count);
+
+    // What converting through a tree costs: the same parse, then a
+    // minibson::document built from it and serialized again.
+    vector<char> output;
+
+    start = now();
+
+    for (int i = 0; i < count; i++)
+    {
+        reader.parse(texts[i]);
+
+        minibson::document d(reader.data(), reader.size());
+
+        output.resize(d.get_serialized_size());
+        d.serialize(&output[0], output.size());
+        check += output.size();
+    }
+
+    report("json -> minibson::document -> bson", now() - start, bytes, count);
+
+    if (check == 0)
+        std::printf("unexpected empty output\n");
+}
+
+// Every thread runs its own generator, as they are meant to be used
+struct object_id_task
+{
+    size_t count;
+    std::vector<unsigned char> checks;
+
+    void operator()(size_t index)
+    {
+        minibson::object_id_generator generator;
+        unsigned char check = 0;
+
+        for (size_t i = 0; i < count; i++)
+            check ^= generator.next().bytes[11];
+
+        checks[index] = check;
+    }
+};
+
+void bench_object_id()
+{
+    const size_t count = 20000000;
+    const size_t threads = microbson::hardware_threads();
+    object_id_task task;
+    double start;
+
+    task.count = count;
+    task.checks.resize(threads);
+
+    start = now();
+    task(0);
+    report("object_id_generator, 1 thread", now() - start, count * 12, count);
+
+    start = now();
+    microbson::parallel_for(threads, task, threads);
+
+    char name[64];
+
+    std::sprintf(name, "object_id_generator, %lu threads", static_cast<unsigned long>(threads));
+    report(name, now() - start, threads * count * 12, threads * count);
+}
+
+// Nested sections of 1000 short strings and numbers, about 1.1 MB each
+minibson::document large_document(size_t sections)
+{
+    minibson::document result;
+    const std::string text(1000, 'x');
+
+    for (size_t i = 0; i < sections; i++)
+    {
+        minibson::document section;
+        char name[32];
+
+        for (int j = 0; j < 1000; j++)
+        {
+            minibson::document entry;
+
+            entry.set("id", j).set("value", j * 0.5).set("text", text);
+            std::sprintf(name, "entry%d", j);
+            section.set(name, entry);
+        }
+
+        std::sprintf(name, "section%lu", static_cast<unsigned long>(i));
+        result.set(name, section);
+    }
+
+    return result;
+}
+
+void bench_serialize_parallel()
+{
+    const minibson::document d = large_document(96);
+    const size_t size = d.get_serialized_size();
+    std::vector<char> buffer(size);
+    std::vector<char> parallel(size);
+    char name[64];
+    double start;
+
+    start = now();
+    d.serialize(&buffer[0], size);
+    report("document::serialize", now() - start, size, 1);
+
+    start = now();
+    minibson::serialize_parallel(d, &parallel[0], size);
+    std::sprintf(
+        name,
+        "serialize_parallel, %lu threads",
+        static_cast<unsigned long>(microbson::hardware_threads())
+    );
+    report(name, now() - start, size, 1);
+
+    if (buffer != parallel)
+        std::printf("serialize_parallel output differs\n");
+}
+
+void bench_deserialize_parallel()
+{
+    std::vector<char> buffer;
+    char name[64];
+    double start;
+
+    {
+        const minibson::document d = large_document(96);
+
+        buffer.resize(d.get_serialized_size());
+        d.serialize(&buffer[0], buffer.size());
+    }
+
+    start = now();
+    {
+        minibson::document d(&buffer[0], buffer.size());
+
+        report("document(buffer, count)", now() - start, buffer.size(), 1);
+    }
+
+    start = now();
+    {
+        minibson::document d;
+
+        minibson::deserialize_parallel(&buffer[0], buffer.size(), d);
+        std::sprintf(
+            name,
+            "deserialize_parallel, %lu threads",
+            static_cast<unsigned long>(microbson::hardware_threads())
+        );
+        report(name, now() - start, buffer.size(), 1);
+    }
+}
+
+// Parse, read and destroy the same shape of message over and over
+void bench_request_loop()
+{
+    minibson::document message;
+    std::vector<char> buffer;
+    const int count = 200000;
+    long long check = 0;
+    size_t before;
+    double start;
+
+    message.set("id", 1).set("user", "someone").set("score", 0.5);
+    message.set("flags", minibson::document().set("admin", false).set("active", true));
+    buffer.resize(message.get_serialized_size());
+    message.serialize(&buffer[0], buffer.size());
+
+    // Warm up the pool, if any
+    minibson::document(&buffer[0], buffer.size());
+
+    before = allocations;
+    start = now();
+
+    for (int i = 0; i < count; i++)
+    {
+        minibson::document d(&buffer[0], buffer.size());
+
+        check += d.get("id", 0);
+    }
+
+    report("request loop (parse, read, destroy)", now() - start, buffer.size() * count, count);
+    std::printf(
+        "%-40s %10.2f allocations per request\n",
+        "",
+        static_cast<double>(allocations - before) / count
+    );
+
+    if (check != count)
+        std::printf("unexpected sum\n");
+}
+
+void bench_assign_loop()
+{
+    const int count = 200000;
+    const int variants = 16;
+    std::vector<std::vector<char> > buffers(variants);
+    minibson::document d;
+    long long check = 0;
+    size_t bytes = 0;
+    size_t before;
+    double start;
+
+    for (int i = 0; i < variants; i++)
+    {
+        minibson::document message;
+        char user[32];
+
+        std::sprintf(user, "user-%d", i * 37);
+        message.set("id", i).set("user", std::string(user)).set("score", i * 0.5);
+        message.set("last_login_timestamp", static_cast<long long>(i) * 1000);
+        message.set("flags", minibson::document().set("admin", i % 2 == 0).set("active", true).set("email_notifications_enabled", false));
+        buffers[i].resize(message.get_serialized_size());
+        message.serialize(&buffers[i][0], buffers[i].size());
+    }
+
+    // Size the nodes and strings for the longest values
+    for (int i = 0; i < variants; i++)
+        d.assign_from(&buffers[i][0], buffers[i].size());
+
+    before = allocations;
+    start = now();
+
+    for (int i = 0; i < count; i++)
+    {
+        const std::vector<char>& buffer = buffers[i % variants];
+
+        d.assign_from(&buffer[0], buffer.size());
+        check += d.get("id", 0);
+        bytes += buffer.size();
+    }
+
+    report("request loop (assign_from, read)", now() - start, bytes, count);
+    std::printf(
+        "%-40s %10.2f allocations per request\n",
+        "",
+        static_cast<double>(allocations - before) / count
+    );
+
+    if (check != static_cast<long long>(count / variants) * (variants - 1) * variants / 2)
+        std::printf("unexpected sum\n");
+}
+
+void bench_arena_loop()
+{
+    minibson::document message;
+    std::vector<char> buffer;
+    const int count = 200000;
+    long long check = 0;
+    size_t before;
+    double start;
+
+    message.set("id", 1).set("user", "someone").set("score", 0.5);
+    message.set("flags", minibson::document().set("admin", false).set("active", true));
+    buffer.resize(message.get_serialized_size());
+    message.serialize(&buffer[0], buffer.size());
+
+    before = allocations;
+    start = now();
+
+    // A monotonic arena per request, on the stack; it only takes effect
+    // with MINIBSON_MEMORY_RESOURCE
+    for (int i = 0; i < count; i++)
+    {
+        char storage[4096];
+        minibson::monotonic_resource arena(storage, sizeof(storage));
+        minibson::scoped_memory_resource scope(arena);
+        minibson::document d(&buffer[0], buffer.size());
+
+        check += d.get("id", 0);
+    }
+
+    report("request loop (monotonic arena)", now() - start, buffer.size() * count, count);
+    std::printf(
+        "%-40s %10.2f allocations per request\n",
+        "",
+        static_cast<double>(allocations - before) / count
+    );
+
+    if (check != count)
+        std::printf("unexpected sum\n");
+}
+
+struct bench_order
+{
+    int id;
+    std::string customer;
+    double total;
+    bool paid;
+    long long created;
+};
+
+MICROBSON_BINDING(bench_order)
+    MICROBSON_FIELD(id)
+    MICROBSON_FIELD(customer)
+    MICROBSON_FIELD(total)
+    MICROBSON_FIELD(paid)
+    MICROBSON_FIELD(created)
+MICROBSON_BINDING_END
+
+// A fixed struct to BSON and back, through a tree and through a binding
+void bench_struct_binding()
+{
+    const int count = 200000;
+    std::vector<char> buffer(256);
+    bench_order order;
+    long long check = 0;
+    size_t bytes = 0;
+    size_t before;
+    double start;
+
+    order.id = 1;
+    order.customer = "someone";
+    order.total = 12.5;
+    order.paid = true;
+    order.created = 1600000000000LL;
+
+    before = allocations;
+    start = now();
+
+    for (int i = 0; i < count; i++)
+    {
+        minibson::document d;
+
+        order.id = i;
+        d.set("id", order.id).set("customer", order.customer).set("total", order.total);
+        d.set("paid", order.paid).set("created", order.created);
+        d.serialize(&buffer[0], buffer.size());
+        bytes += d.get_serialized_size();
+    }
+
+    report("struct to BSON (document)", now() - start, bytes, count);
+    std::printf(
+        "%-40s %10.2f allocations per struct\n",
+        "",
+        static_cast<double>(allocations - before) / count
+    );
+
+    bytes = 0;
+    before = allocations;
+    start = now();
+
+    for (int i = 0; i < count; i++)
+    {
+        order.id = i;
+        bytes += microbson::encode(order, &buffer[0], buffer.size());
+    }
+
+    report("struct to BSON (binding)", now() - start, bytes, count);
+    std::printf(
+        "%-40s %10.2f allocations per struct\n",
+        "",
+        static_cast<double>(allocations - before) / count
+    );
+
+    const size_t size = microbson::encoded_size(order);
+
+    start = now();
+
+    for (int i = 0; i < count; i++)
+    {
+        minibson::document d(&buffer[0], size);
+
+        order.id = d.get("id", 0);
+        order.customer = d.get("customer", "");
+        order.total = d.get("total", 0.0);
+        order.paid = d.get("paid", false);
+        order.created = d.get("created", 0LL);
+        check += order.id;
+    }
+
+    report("BSON to struct (document)", now() - start, size * count, count);
+    start = now();
+
+    for (int i = 0; i < count; i++)
+    {
+        microbson::decode(microbson::document(&buffer[0], size), order);
+        check -= order.id;
+    }
+
+    report("BSON to struct (binding)", now() - start, size * count, count);
+
+    if (check != 0)
+        std::printf("unexpected sum\n");
+}
+
+// Reading every field of a fixed shape document, by name and by schema
+void bench_schema()
+{
+    const int count = 500000;
+    const char* names[] = { "active", "city", "country", "created", "email", "id", "score", "user" };
+    const size_t fields = sizeof(names) / sizeof(names[0]);
+    minibson::document message;
+    microbson::schema expected;
+    microbson::schema_record record;
+    std::vector<char> buffer;
+    long long check = 0;
+    double start;
+
+    for (size_t i = 0; i < fields; i++)
+    {
+        message.set(names[i], static_cast<int>(i));
+        expected.add(names[i], microbson::int32_node);
+    }
+
+    buffer.resize(message.get_serialized_size());
+    message.serialize(&buffer[0], buffer.size());
+
+    const microbson::document d(&buffer[0], buffer.size());
+
+    start = now();
+
+    for (int i = 0; i < count; i++)
+        for (size_t j = 0; j < fields; j++)
+            check += d.get(names[j], 0);
+
+    report("read all fields (by name)", now() - start, buffer.size() * count, count);
+    start = now();
+
+    for (int i = 0; i < count; i++)
+    {
+        expected.decode(d, record);
+
+        for (size_t j = 0; j < fields; j++)
+            check -= record.get_field(j, 0);
+    }
+
+    report("read all fields (schema)", now() - start, buffer.size() * count, count);
+    std::printf(
+        "%-40s %10lu hits %10lu misses\n",
+        "",
+        static_cast<unsigned long>(expected.get_hits()),
+        static_cast<unsigned long>(expected.get_misses())
+    );
+
+    if (check != 0)
+        std::printf("unexpected sum\n");
+}
+
+// Lookups of a long name, by string literal and by key
+void bench_keys()
+{
+    const int count = 1000000;
+    const microbson::key name("customer_billing_address_line_1");
+    minibson::document d;
+    std::vector<char> buffer;
+    long long check = 0;
+    size_t before;
+    double start;
+
+    for (int i = 0; i < 16; i++)
+    {
+        char field[32];
+
+        std::sprintf(field, "customer_field_%d", i);
+        d.set(std::string(field), i);
+    }
+
+    d.set("customer_billing_address_line_1", 1);
+    buffer.resize(d.get_serialized_size());
+    d.serialize(&buffer[0], buffer.size());
+
+    const microbson::document m(&buffer[0], buffer.size());
+
+    before = allocations;
+    start = now();
+
+    for (int i = 0; i < count; i++)
+        check += d.get("customer_billing_address_line_1", 0);
+
+    report("minibson get (string)", now() - start, 0, count);
+    std::printf("%-40s %10.2f allocations per lookup\n", "", static_cast<double>(allocations - before) / count);
+    before = allocations;
+    start = now();
+
+    for (int i = 0; i < count; i++)
+        check -= d.get(name, 0);
+
+    report("minibson get (key)", now() - start, 0, count);
+    std::printf("%-40s %10.2f allocations per lookup\n", "", static_cast<double>(allocations - before) / count);
+    before = allocations;
+    start = now();
+
+    for (int i = 0; i < count; i++)
+        check += m.get("customer_billing_address_line_1", 0);
+
+    report("microbson get (string)", now() - start, 0, count);
+    std::printf("%-40s %10.2f allocations per lookup\n", "", static_cast<double>(allocations - before) / count);
+    before = allocations;
+    start = now();
+
+    for (int i = 0; i < count; i++)
+        check -= m.get(name, 0);
+
+    report("microbson get (key)", now() - start, 0, count);
+    std::printf("%-40s %10.2f allocations per lookup\n", "", static_cast<double>(allocations - before) / count);
+
+    if (check != 0)
+        std::printf("unexpected sum\n");
+}
+
+// A batch of documents of the same shape, with long names, kept in memory
+void bench_key_memory()
+{
+    const int count = 20000;
+    minibson::document message;
+    minibson::key_table table;
+    std::vector<minibson::document*> batch;
+    std::vector<char> buffer;
+    size_t before;
+    double start;
+
+    for (int i = 0; i < 30; i++)
+    {
+        char name[64];
+
+        std::sprintf(name, "customer_billing_address_line_%d", i);
+        message.set(std::string(name), i);
+    }
+
+    buffer.resize(message.get_serialized_size());
+    message.serialize(&buffer[0], buffer.size());
+
+    before = allocations;
+    start = now();
+
+    {
+        minibson::scoped_key_table scope(table);
+
+        for (int i = 0; i < count; i++)
+            batch.push_back(new minibson::document(&buffer[0], buffer.size()));
+    }
+
+    report("batch of documents (parse)", now() - start, buffer.size() * count, count);
+    std::printf(
+        "%-40s %10.2f allocations, %lu bytes per document\n",
+        "",
+        static_cast<double>(allocations - before) / count,
+        static_cast<unsigned long>(batch[0]->memory_usage().get_total())
+    );
+
+    for (size_t i = 0; i < batch.size(); i++)
+        delete batch[i];
+}
+
+// Customer records with long names, compressed with a key dictionary
+void bench_key_dictionary()
+{
+    const int count = 200000;
+    const char* names[] = {
+        "customer_identifier", "customer_display_name", "customer_email_address",
+        "customer_billing_address_line_1", "customer_billing_address_line_2",
+        "customer_billing_postal_code", "customer_shipping_address_line_1",
+        "customer_shipping_address_line_2", "customer_shipping_postal_code",
+        "order_line_items", "order_line_item_sku", "order_line_item_quantity"
+    };
+    microbson::key_dictionary dictionary;
+    minibson::document message;
+    minibson::array items;
+    std::vector<char> original;
+    std::vector<char> compressed;
+    std::vector<char> expanded;
+    long long check = 0;
+    size_t before;
+    double start;
+
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+        dictionary.add(names[i]);
+
+    for (int i = 0; i < 4; i++)
+        items.push_back(
+            minibson::document()
+                .set("order_line_item_sku", "SKU-000042")
+                .set("order_line_item_quantity", i + 1)
+        );
+
+    message.set("customer_identifier", 123456789LL);
+    message.set("customer_display_name", "Jane Doe");
+    message.set("customer_email_address", "jane@example.com");
+    message.set("customer_billing_address_line_1", "1 Main Street");
+    message.set("customer_billing_address_line_2", "Springfield");
+    message.set("customer_billing_postal_code", "12345");
+    message.set("customer_shipping_address_line_1", "1 Main Street");
+    message.set("customer_shipping_address_line_2", "Springfield");
+    message.set("customer_shipping_postal_code", "12345");
+    message.set("order_line_items", items);
+
+    original.resize(message.get_serialized_size());
+    message.serialize(&original[0], original.size());
+
+    const microbson::document source(&original[0], original.size());
+
+    compressed.resize(microbson::get_compressed_size(dictionary, source));
+    expanded.resize(original.size());
+    before = allocations;
+    start = now();
+
+    for (int i = 0; i < count; i++)
+        check += microbson::compress_keys(dictionary, source, &compressed[0], compressed.size())
+            - compressed.size();
+
+    report("compress keys", now() - start, original.size() * count, count);
+    std::printf(
+        "%-40s %10lu -> %lu bytes (%.0f%% saved), %.2f allocations\n",
+        "",
+        static_cast<unsigned long>(original.size()),
+        static_cast<unsigned long>(compressed.size()),
+        100.0 - 100.0 * compressed.size() / original.size(),
+        static_cast<double>(allocations - before) / count
+    );
+
+    const microbson::document packed(&compressed[0], compressed.size());
+
+    before = allocations;
+    start = now();
+
+    for (int i = 0; i < count; i++)
+        check += microbson::expand_keys(dictionary, packed, &expanded[0], expanded.size())
+            - expanded.size();
+
+    report("expand keys", now() - start, compressed.size() * count, count);
+    std::printf(
+        "%-40s %10.2f allocations\n",
+        "",
+        static_cast<double>(allocations - before) / count
+    );
+
+    const microbson::key plain("customer_shipping_postal_code");
+    const microbson::key code = dictionary.get_key("customer_shipping_postal_code");
+
+    start = now();
+
+    for (int i = 0; i < count; i++)
+        check += source.get(plain, std::string()).length();
+
+    report("microbson get (original)", now() - start, 0, count);
+    start = now();
+
+    for (int i = 0; i < count; i++)
+        check -= packed.get(code, std::string()).length();
+
+    report("microbson get (compressed)", now() - start, 0, count);
+
+    if (check != 0)
+        std::printf("unexpected sum\n");
+}
+
+// An archive of log-like documents, framed in blocks
+void bench_block_compression()
+{
+    const int count = 200000;
+    const size_t threads = microbson::hardware_threads();
+    microbson::block_writer writer;
+    std::vector<char> archive;
+    std::vector<microbson::byte> output;
+    std::vector<microbson::document> documents;
+    double start;
+
+    for (int i = 0; i < count; i++)
+    {
+        minibson::document d;
+        char user[32];
+        size_t offset = archive.size();
+
+        std::sprintf(user, "user-%d", i % 1000);
+        d.set("id", i);
+        d.set("user", std::string(user));
+        d.set("score", (i % 100) / 10.0);
+        d.set("active", i % 3 != 0);
+        d.set("time", 1600000000000LL + i * 1000LL);
+        d.set("address", minibson::document().set("city", "Springfield").set("zip", "12345"));
+
+        archive.resize(offset + d.get_serialized_size());
+        d.serialize(&archive[offset], d.get_serialized_size());
+    }
+
+    const microbson::document_sequence sequence(&archive[0], archive.size());
+
+    start = now();
+
+    for (
+        microbson::document_sequence::const_iterator i = sequence.begin();
+        i != sequence.end();
+        ++i
+    )
+        writer.add(*i);
+
+    writer.flush();
+    report("compress blocks", now() - start, archive.size(), writer.get_block_count());
+    std::printf(
+        "%-40s %10lu -> %lu bytes (%.1fx), %lu blocks\n",
+        "",
+        static_cast<unsigned long>(archive.size()),
+        static_cast<unsigned long>(writer.get_output().size()),
+        static_cast<double>(archive.size()) / writer.get_output().size(),
+        static_cast<unsigned long>(writer.get_block_count())
+    );
+
+    const microbson::block_stream blocks(
+        &writer.get_output()[0],
+        writer.get_output().size()
+    );
+
+    start = now();
+    blocks.decompress(output, documents, 1);
+    report("decompress blocks (1 thread)", now() - start, archive.size(), blocks.get_block_count());
+
+    documents.clear();
+    start = now();
+    blocks.decompress(output, documents, threads);
+    report("decompress blocks (all threads)", now() - start, archive.size(), blocks.get_block_count());
+
+    if ((documents.size() != static_cast<size_t>(count))
+        || (memcmp(&output[0], &archive[0], archive.size()) != 0))
+        std::printf("unexpected output\n");
+}
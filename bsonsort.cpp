@@ -0,0 +1,64 @@
+#include "microbson_sort.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+// Usage: bsonsort [-m megabytes] [-j threads] [-f fan-in] input output key[:desc]...
+
+int main(int argc, char** argv)
+{
+    size_t megabytes = 64U;
+    size_t threads = 0U;
+    size_t fan_in = 64U;
+    int i = 1;
+
+    for (; (i + 1 < argc) && (argv[i][0] == '-'); i += 2)
+    {
+        if (std::strcmp(argv[i], "-m") == 0)
+            megabytes = std::strtoul(argv[i + 1], NULL, 10);
+        else if (std::strcmp(argv[i], "-j") == 0)
+            threads = std::strtoul(argv[i + 1], NULL, 10);
+        else if (std::strcmp(argv[i], "-f") == 0)
+            fan_in = std::strtoul(argv[i + 1], NULL, 10);
+        else
+            break;
+    }
+
+    if (argc - i < 3)
+    {
+        std::fprintf(
+            stderr,
+            "usage: %s [-m megabytes] [-j threads] [-f fan-in] input output key[:desc]...\n",
+            argv[0]
+        );
+        return 2;
+    }
+
+    microbson::external_sort sorter(megabytes << 20, threads);
+
+    sorter.set_max_fan_in(fan_in);
+
+    for (int j = i + 2; j < argc; j++)
+    {
+        std::string key(argv[j]);
+        size_t colon = key.rfind(':');
+        bool ascending = true;
+
+        if ((colon != std::string::npos) && (key.substr(colon) == ":desc"))
+        {
+            key.erase(colon);
+            ascending = false;
+        }
+
+        sorter.add_key(key, ascending);
+    }
+
+    if (!sorter.run(argv[i], argv[i + 1]))
+    {
+        std::fprintf(stderr, "%s: sorting %s failed\n", argv[0], argv[i]);
+        return 1;
+    }
+
+    return 0;
+}
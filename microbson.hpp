@@ -6,6 +6,10 @@
 #include <utility>
 #include <iterator>
 #include <iomanip>
+#include <ostream>
+#include <vector>
+
+#include "microbson_key.hpp"
 
 namespace microbson
 {
@@ -15,15 +19,66 @@ namespace microbson
         double_node = 0x01,
         string_node = 0x02,
         document_node = 0x03,
+        array_node = 0x04,
         binary_node = 0x05,
+        undefined_node = 0x06,
+        objectid_node = 0x07,
         boolean_node = 0x08,
+        datetime_node = 0x09,
         null_node = 0x0A,
+        regex_node = 0x0B,
+        dbpointer_node = 0x0C,
+        javascript_node = 0x0D,
+        symbol_node = 0x0E,
+        javascript_scope_node = 0x0F,
         int32_node = 0x10,
+        timestamp_node = 0x11,
         int64_node = 0x12,
+        decimal128_node = 0x13,
+        max_key_node = 0x7F,
+        min_key_node = 0xFF,
         unknown_node = 0xFF
     };
 
+    namespace detail
+    {
+        enum value_size {
+            invalid_size = -1,
+            prefixed_size = -2,     // int32 total length (documents, arrays)
+            string_size = -3,       // int32 length + bytes
+            binary_size = -4,       // int32 length + subtype + bytes
+            regex_size = -5,        // two cstrings
+            dbpointer_size = -6     // string + 12-byte ObjectId
+        };
+
+        // Size of the value of every BSON type, or how to compute it
+        inline const signed char* value_sizes()
+        {
+            static const signed char table[256] = {
+                -1,  8, -3, -2, -2, -4,  0, 12,  1,  8,  0, -5, -6, -3, -3, -2,
+                 4,  8,  8, 16, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,  0,
+                -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,  0
+            };
+
+            return table;
+        }
+    }
+
     class document;
+    class array;
 
     template<typename T> struct type_converter { };
 
@@ -42,6 +97,11 @@ namespace microbson
         enum { node_type_code = document_node };
     };
 
+    template<> struct type_converter<array>
+    {
+        enum { node_type_code = array_node };
+    };
+
     template<> struct type_converter<void*>
     {
         enum { node_type_code = binary_node };
@@ -62,6 +122,27 @@ namespace microbson
         enum { node_type_code = int64_node };
     };
 
+    struct object_id
+    {
+        byte bytes[12];
+    };
+
+    template<> struct type_converter<object_id>
+    {
+        enum { node_type_code = objectid_node };
+    };
+
+    // Milliseconds since the epoch, UTC
+    struct utc_datetime
+    {
+        long long milliseconds;
+    };
+
+    template<> struct type_converter<utc_datetime>
+    {
+        enum { node_type_code = datetime_node };
+    };
+
     struct node
     {
         byte* bytes;
@@ -77,42 +158,54 @@ namespace microbson
             return reinterpret_cast<const char*>( bytes + 1 );
         }
 
+        // Size of the whole element (type, name and value), 0 if the type
+        // is not a BSON type
         size_t get_size() const
         {
             size_t result = 1U + strlen(get_name()) + 1U;
+            byte* value = bytes + result;
 
-            switch (get_type())
-            {
-                case double_node:
-                    result += sizeof(double);
-                    break;
-                case document_node:
-                    result += *reinterpret_cast<int*>(bytes + result);
-                    break;
-                case binary_node:
-                    result += 1U;
-                case string_node:
-                    result += (
-                        sizeof(int) 
-                            + *reinterpret_cast<int*>(bytes + result)
-                    );
-                    break;
-                case boolean_node:
-                    result += 1U;
-                case null_node:
-                    break;
-                case int32_node:
-                    result += sizeof(int);
-                    break;
-                case int64_node:
-                    result += sizeof(long long);
-                    break;
+            switch (detail::value_sizes()[bytes[0]])
+            {
+                case detail::invalid_size:
+                    return 0U;
+                case detail::prefixed_size:
+                    return result + *reinterpret_cast<int*>(value);
+                case detail::string_size:
+                    return result + sizeof(int) + *reinterpret_cast<int*>(value);
+                case detail::binary_size:
+                    return result
+                        + sizeof(int)
+                        + 1U
+                        + *reinterpret_cast<int*>(value);
+                case detail::regex_size:
+                    {
+                        size_t pattern = strlen(reinterpret_cast<char*>(value)) + 1U;
+
+                        return result
+                            + pattern
+                            + strlen(reinterpret_cast<char*>(value + pattern))
+                            + 1U;
+                    }
+                case detail::dbpointer_size:
+                    return result
+                        + sizeof(int)
+                        + *reinterpret_cast<int*>(value)
+                        + 12U;
                 default:
-                    result = 0U;
-                    break;
+                    return result + detail::value_sizes()[bytes[0]];
             }
+        }
+
+        // Size of the value alone
+        size_t get_data_size() const
+        {
+            size_t result = get_size();
 
-            return result;
+            return (result > 0U)
+                ? result - (static_cast<byte*>(get_data()) - bytes)
+                : 0U
+            ;
         }
 
         void* get_data() const
@@ -122,13 +215,16 @@ namespace microbson
 
         bool valid(size_t size) const
         {
-            return (size >= 2) && (get_size() <= size);
+            return (size >= 2)
+                && (get_type() != 0)
+                && (get_size() != 0U)
+                && (get_size() <= size);
         }
     };
 
     class document
     {
-        private:
+        protected:
             byte* bytes;
             size_t size;
 
@@ -158,6 +254,18 @@ namespace microbson
                 return found;
             }
 
+            bool lookup(const key& name, node& result) const
+            {
+                for (const_iterator i = begin(); i != end(); ++i)
+                    if (name.matches(i->get_name()))
+                    {
+                        result = *i;
+                        return true;
+                    }
+
+                return false;
+            }
+
             template<typename T, typename W>
                 T get(node _node) const
                 {
@@ -186,6 +294,17 @@ namespace microbson
                     ;
                 }
 
+            template<typename T, typename W>
+                T get(const key& name, T _default) const
+                {
+                    node _node;
+
+                    return lookup(name, _node)
+                        ? get<T, W>(_node)
+                        : _default
+                    ;
+                }
+
             void dump(const node& _node, std::ostream& _stream) const
             {
                 switch(_node.get_type())
@@ -230,12 +349,78 @@ namespace microbson
                     case int64_node:
                         _stream << get<long long, long long>(_node);
                         break;
+                    case objectid_node:
+                        {
+                            object_id value = get<object_id, object_id>(_node);
+                            std::ios::fmtflags flags( _stream.flags() );
+
+                            _stream << std::hex << std::setfill('0');
+
+                            for (size_t i = 0; i < sizeof(value.bytes); i++)
+                                _stream << std::setw(2) << int(value.bytes[i]);
+
+                            _stream.flags(flags);
+                            break;
+                        }
+                    case datetime_node:
+                        _stream << get<long long, long long>(_node);
+                        break;
                     default:
                         break;
                 }
             }
 
         public:
+            class const_iterator
+            {
+                private:
+                    node current;
+                    size_t left;
+
+                    void check()
+                    {
+                        if (!current.valid(left))
+                        {
+                            current = node();
+                            left = 0U;
+                        }
+                    }
+
+                public:
+                    const_iterator() : current(), left(0U) { }
+
+                    const_iterator(byte* bytes, size_t count)
+                        : current(bytes), left(count)
+                    {
+                        check();
+                    }
+
+                    const node& operator*() const { return current; }
+
+                    const node* operator->() const { return &current; }
+
+                    const_iterator& operator++()
+                    {
+                        size_t step = current.get_size();
+
+                        current = node(current.bytes + step);
+                        left -= step;
+                        check();
+
+                        return *this;
+                    }
+
+                    bool operator==(const const_iterator& other) const
+                    {
+                        return current.bytes == other.current.bytes;
+                    }
+
+                    bool operator!=(const const_iterator& other) const
+                    {
+                        return current.bytes != other.current.bytes;
+                    }
+            };
+
             document() : bytes(NULL), size(0U) { }
 
             document(void* bytes, size_t count)
@@ -243,6 +428,50 @@ namespace microbson
             {
             }
 
+            const_iterator begin() const
+            {
+                return (size > sizeof(int))
+                    ? const_iterator(bytes + sizeof(int), size - sizeof(int))
+                    : const_iterator()
+                ;
+            }
+
+            const_iterator end() const { return const_iterator(); }
+
+            void* get_bytes() const { return bytes; }
+
+            size_t get_size() const { return size; }
+
+            // Resolves a dotted path ("a.b.c") through nested documents.
+            bool find(const char* path, node& result) const
+            {
+                const char* dot = strchr(path, '.');
+                size_t length = (dot != NULL) ? dot - path : strlen(path);
+
+                for (const_iterator i = begin(); i != end(); ++i)
+                {
+                    if ((strncmp(i->get_name(), path, length) != 0)
+                        || (i->get_name()[length] != '\0'))
+                        continue;
+
+                    if (dot == NULL)
+                    {
+                        result = *i;
+                        return true;
+                    }
+
+                    if (i->get_type() != document_node)
+                        return false;
+
+                    return document(
+                        i->get_data(),
+                        *reinterpret_cast<int*>(i->get_data())
+                    ).find(dot + 1, result);
+                }
+
+                return false;
+            }
+
             bool valid() const
             {
                 return (size >= 7U) && (bytes[size -1] == 0);
@@ -278,7 +507,28 @@ namespace microbson
                 document result(_default);
 
                 if (found)
-                    result = document(_node.get_data(), _node.get_size());
+                    result = document(
+                        _node.get_data(),
+                        *reinterpret_cast<int*>(_node.get_data())
+                    );
+
+                return result;
+            }
+
+            array get(const std::string& name, const array& _default) const;
+
+            // Raw value bytes of any element, whether or not its type can
+            // be decoded here
+            std::pair<void*, size_t> get_raw(const std::string& name) const
+            {
+                node _node;
+                std::pair<void*, size_t> result(NULL, 0U);
+
+                if (lookup(name.c_str(), _node))
+                {
+                    result.first = _node.get_data();
+                    result.second = _node.get_data_size();
+                }
 
                 return result;
             }
@@ -312,6 +562,19 @@ namespace microbson
                 return get<long long, long long>(name, _default);
             }
 
+            object_id get(const std::string& name, const object_id& _default) const
+            {
+                return get<object_id, object_id>(name, _default);
+            }
+
+            utc_datetime get(
+                const std::string& name,
+                const utc_datetime& _default
+            ) const
+            {
+                return get<utc_datetime, utc_datetime>(name, _default);
+            }
+
             void dump(std::ostream& _stream) const
             {
                 byte* iterator = bytes + sizeof(int);
@@ -324,7 +587,8 @@ namespace microbson
                 {
                     _stream << _node.get_name() << " : ";
 
-                    if (_node.get_type() == document_node)
+                    if ((_node.get_type() == document_node)
+                        || (_node.get_type() == array_node))
                         document(
                                 _node.get_data(), 
                                 *static_cast<int*>(_node.get_data())
@@ -351,6 +615,81 @@ namespace microbson
                 return lookup(name.c_str(), _node);
             }
 
+            bool contains(const key& name) const
+            {
+                node _node;
+
+                return lookup(name, _node);
+            }
+
+            template<typename T>
+            bool contains(const key& name) const
+            {
+                node _node;
+
+                return lookup(name, _node)
+                    && (_node.get_type() == static_cast<node_type>(type_converter<T>::node_type_code));
+            }
+
+            // Lookups by key: see microbson_key.hpp
+
+            double get(const key& name, double _default) const
+            {
+                return get<double, double>(name, _default);
+            }
+
+            std::string get(const key& name, const std::string& _default) const
+            {
+                node _node;
+
+                return lookup(name, _node) ? get_string(_node) : _default;
+            }
+
+            std::string get(const key& name, const char* _default) const
+            {
+                return get(name, std::string(_default));
+            }
+
+            document get(const key& name, const document& _default) const
+            {
+                node _node;
+
+                return lookup(name, _node)
+                    ? document(
+                        _node.get_data(),
+                        *reinterpret_cast<int*>(_node.get_data())
+                    )
+                    : _default
+                ;
+            }
+
+            array get(const key& name, const array& _default) const;
+
+            bool get(const key& name, bool _default) const
+            {
+                return get<bool, byte>(name, _default);
+            }
+
+            int get(const key& name, int _default) const
+            {
+                return get<int, int>(name, _default);
+            }
+
+            long long get(const key& name, long long _default) const
+            {
+                return get<long long, long long>(name, _default);
+            }
+
+            object_id get(const key& name, const object_id& _default) const
+            {
+                return get<object_id, object_id>(name, _default);
+            }
+
+            utc_datetime get(const key& name, const utc_datetime& _default) const
+            {
+                return get<utc_datetime, utc_datetime>(name, _default);
+            }
+
             template<typename T>
             bool contains(const std::string& name)
             {
@@ -363,4 +702,349 @@ namespace microbson
                 );
             }
     };
+
+    // Arrays are documents keyed "0", "1", ...; elements are reached by
+    // position, walking the datastream once per access.
+    class array : public document
+    {
+        private:
+            bool lookup(size_t index, node& result) const
+            {
+                const_iterator i = begin();
+
+                for (; (i != end()) && (index > 0); ++i)
+                    index--;
+
+                if (i == end())
+                    return false;
+
+                result = *i;
+                return true;
+            }
+
+            template<typename T, typename W>
+                T get_at(size_t index, T _default) const
+                {
+                    node _node;
+
+                    return lookup(index, _node)
+                        ? document::get<T, W>(_node)
+                        : _default
+                    ;
+                }
+
+        public:
+            using document::get;
+            using document::contains;
+
+            array() { }
+
+            array(void* bytes, size_t count) : document(bytes, count) { }
+
+            size_t size() const
+            {
+                size_t result = 0;
+
+                for (const_iterator i = begin(); i != end(); ++i)
+                    result++;
+
+                return result;
+            }
+
+            double get(size_t index, double _default) const
+            {
+                return get_at<double, double>(index, _default);
+            }
+
+            std::string get(size_t index, const std::string& _default) const
+            {
+                node _node;
+
+                return lookup(index, _node) ? get_string(_node) : _default;
+            }
+
+            document get(size_t index, const document& _default) const
+            {
+                node _node;
+
+                return lookup(index, _node)
+                    ? document(
+                        _node.get_data(),
+                        *reinterpret_cast<int*>(_node.get_data())
+                    )
+                    : _default
+                ;
+            }
+
+            array get(size_t index, const array& _default) const
+            {
+                node _node;
+
+                return lookup(index, _node)
+                    ? array(
+                        _node.get_data(),
+                        *reinterpret_cast<int*>(_node.get_data())
+                    )
+                    : _default
+                ;
+            }
+
+            bool get(size_t index, bool _default) const
+            {
+                return get_at<bool, byte>(index, _default);
+            }
+
+            int get(size_t index, int _default) const
+            {
+                return get_at<int, int>(index, _default);
+            }
+
+            long long get(size_t index, long long _default) const
+            {
+                return get_at<long long, long long>(index, _default);
+            }
+
+            object_id get(size_t index, const object_id& _default) const
+            {
+                return get_at<object_id, object_id>(index, _default);
+            }
+
+            utc_datetime get(size_t index, const utc_datetime& _default) const
+            {
+                return get_at<utc_datetime, utc_datetime>(index, _default);
+            }
+
+            bool contains(size_t index) const
+            {
+                node _node;
+
+                return lookup(index, _node);
+            }
+
+            template<typename T>
+            bool contains(size_t index) const
+            {
+                node _node;
+
+                return lookup(index, _node)
+                    && (_node.get_type() == static_cast<node_type>(
+                        type_converter<T>::node_type_code
+                    ));
+            }
+    };
+
+    inline array document::get(
+        const std::string& name,
+        const array& _default
+    ) const
+    {
+        node _node;
+
+        return lookup(name.c_str(), _node)
+            ? array(
+                _node.get_data(),
+                *reinterpret_cast<int*>(_node.get_data())
+            )
+            : _default
+        ;
+    }
+
+    inline array document::get(const key& name, const array& _default) const
+    {
+        node _node;
+
+        return lookup(name, _node)
+            ? array(
+                _node.get_data(),
+                *reinterpret_cast<int*>(_node.get_data())
+            )
+            : _default
+        ;
+    }
+
+    // Field paths
+
+    // A set of dotted field paths ("a.b.c") stored as a tree of name
+    // segments, so that a document can be matched against all of them in a
+    // single walk. Entries are referred to by index; top-level entries have
+    // root as their parent.
+    class field_tree
+    {
+        private:
+            struct entry
+            {
+                std::string name;
+                size_t parent;
+                bool leaf;
+            };
+
+            std::vector<entry> entries;
+
+        public:
+            static const size_t root = static_cast<size_t>(-1);
+
+            // Returns the index of the entry for the last path segment.
+            size_t add(const std::string& path)
+            {
+                size_t parent = root;
+                size_t start = 0;
+
+                while (true)
+                {
+                    size_t dot = path.find('.', start);
+                    std::string name = path.substr(start, dot - start);
+                    size_t position = find(parent, name.c_str());
+
+                    if (position == root)
+                    {
+                        entry _entry;
+
+                        _entry.name = name;
+                        _entry.parent = parent;
+                        _entry.leaf = false;
+                        entries.push_back(_entry);
+                        position = entries.size() - 1;
+                    }
+
+                    parent = position;
+
+                    if (dot == std::string::npos)
+                        break;
+
+                    start = dot + 1;
+                }
+
+                entries[parent].leaf = true;
+
+                return parent;
+            }
+
+            size_t find(size_t parent, const char* name) const
+            {
+                for (size_t i = 0; i < entries.size(); i++)
+                    if ((entries[i].parent == parent)
+                        && (entries[i].name == name))
+                        return i;
+
+                return root;
+            }
+
+            bool leaf(size_t index) const { return entries[index].leaf; }
+
+            size_t size() const { return entries.size(); }
+    };
+
+    // Projection
+
+    // Copies a subset of a document's fields into a new BSON datastream.
+    // Fields are given as dotted paths ("a.b.c") and are either the only
+    // ones kept (inclusion) or the ones dropped (exclusion). Elements are
+    // copied verbatim; only the length prefixes of the emitted documents are
+    // rewritten. The result is never larger than the source document, so a
+    // buffer of source.get_size() bytes is always enough.
+    class projection
+    {
+        private:
+            field_tree fields;
+            bool include;
+
+            size_t write(
+                const document& source,
+                size_t parent,
+                byte* buffer,
+                size_t count
+            ) const
+            {
+                size_t position = sizeof(int);
+
+                if (count < sizeof(int) + 1U)
+                    return 0U;
+
+                for (
+                    document::const_iterator i = source.begin();
+                    i != source.end();
+                    ++i
+                )
+                {
+                    size_t match = fields.find(parent, i->get_name());
+                    bool copy = !include;
+
+                    if (match != field_tree::root)
+                    {
+                        if (fields.leaf(match))
+                            copy = include;
+                        else if (i->get_type() == document_node)
+                        {
+                            size_t header = static_cast<byte*>(i->get_data())
+                                - i->bytes;
+                            size_t written;
+
+                            if (position + header > count)
+                                return 0U;
+
+                            std::memcpy(buffer + position, i->bytes, header);
+                            written = write(
+                                document(
+                                    i->get_data(),
+                                    *reinterpret_cast<int*>(i->get_data())
+                                ),
+                                match,
+                                buffer + position + header,
+                                count - position - header
+                            );
+
+                            if (written == 0U)
+                                return 0U;
+
+                            position += header + written;
+                            continue;
+                        }
+                    }
+
+                    if (copy)
+                    {
+                        size_t _size = i->get_size();
+
+                        if (position + _size > count)
+                            return 0U;
+
+                        std::memcpy(buffer + position, i->bytes, _size);
+                        position += _size;
+                    }
+                }
+
+                if (position + 1U > count)
+                    return 0U;
+
+                buffer[position++] = 0;
+                *reinterpret_cast<int*>(buffer) = static_cast<int>(position);
+
+                return position;
+            }
+
+        public:
+            projection(
+                const std::vector<std::string>& paths,
+                bool include = true
+            ) : include(include)
+            {
+                for (size_t i = 0; i < paths.size(); i++)
+                    fields.add(paths[i]);
+            }
+
+            // Returns the number of bytes written, or 0 if count is too small.
+            size_t apply(
+                const document& source,
+                void* buffer,
+                size_t count
+            ) const
+            {
+                return write(
+                    source,
+                    field_tree::root,
+                    static_cast<byte*>(buffer),
+                    count
+                );
+            }
+    };
 }
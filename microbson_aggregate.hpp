@@ -0,0 +1,246 @@
+#pragma once
+
+#include "microbson.hpp"
+
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <limits>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace microbson
+{
+    // Reduction kernels
+
+    // Each kernel works on four lanes at a time (two SSE2 registers when
+    // available, four independent accumulators otherwise) and folds the
+    // lanes at the end.
+
+    inline double reduce_sum(const double* values, size_t count)
+    {
+        size_t i = 0;
+        double result;
+
+#if defined(__SSE2__)
+        __m128d a = _mm_setzero_pd();
+        __m128d b = _mm_setzero_pd();
+
+        for (; i + 4 <= count; i += 4)
+        {
+            a = _mm_add_pd(a, _mm_loadu_pd(values + i));
+            b = _mm_add_pd(b, _mm_loadu_pd(values + i + 2));
+        }
+
+        double lanes[2];
+
+        _mm_storeu_pd(lanes, _mm_add_pd(a, b));
+        result = lanes[0] + lanes[1];
+#else
+        double lanes[4] = { 0.0, 0.0, 0.0, 0.0 };
+
+        for (; i + 4 <= count; i += 4)
+            for (size_t j = 0; j < 4; j++)
+                lanes[j] += values[i + j];
+
+        result = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+#endif
+
+        for (; i < count; i++)
+            result += values[i];
+
+        return result;
+    }
+
+    inline double reduce_min(const double* values, size_t count)
+    {
+        size_t i = 0;
+        double result = std::numeric_limits<double>::infinity();
+
+#if defined(__SSE2__)
+        __m128d a = _mm_set1_pd(result);
+        __m128d b = a;
+
+        for (; i + 4 <= count; i += 4)
+        {
+            a = _mm_min_pd(a, _mm_loadu_pd(values + i));
+            b = _mm_min_pd(b, _mm_loadu_pd(values + i + 2));
+        }
+
+        double lanes[2];
+
+        _mm_storeu_pd(lanes, _mm_min_pd(a, b));
+        result = (lanes[0] < lanes[1]) ? lanes[0] : lanes[1];
+#else
+        double lanes[4] = { result, result, result, result };
+
+        for (; i + 4 <= count; i += 4)
+            for (size_t j = 0; j < 4; j++)
+                lanes[j] = (values[i + j] < lanes[j]) ? values[i + j] : lanes[j];
+
+        for (size_t j = 0; j < 4; j++)
+            result = (lanes[j] < result) ? lanes[j] : result;
+#endif
+
+        for (; i < count; i++)
+            result = (values[i] < result) ? values[i] : result;
+
+        return result;
+    }
+
+    inline double reduce_max(const double* values, size_t count)
+    {
+        size_t i = 0;
+        double result = -std::numeric_limits<double>::infinity();
+
+#if defined(__SSE2__)
+        __m128d a = _mm_set1_pd(result);
+        __m128d b = a;
+
+        for (; i + 4 <= count; i += 4)
+        {
+            a = _mm_max_pd(a, _mm_loadu_pd(values + i));
+            b = _mm_max_pd(b, _mm_loadu_pd(values + i + 2));
+        }
+
+        double lanes[2];
+
+        _mm_storeu_pd(lanes, _mm_max_pd(a, b));
+        result = (lanes[0] > lanes[1]) ? lanes[0] : lanes[1];
+#else
+        double lanes[4] = { result, result, result, result };
+
+        for (; i + 4 <= count; i += 4)
+            for (size_t j = 0; j < 4; j++)
+                lanes[j] = (values[i + j] > lanes[j]) ? values[i + j] : lanes[j];
+
+        for (size_t j = 0; j < 4; j++)
+            result = (lanes[j] > result) ? lanes[j] : result;
+#endif
+
+        for (; i < count; i++)
+            result = (values[i] > result) ? values[i] : result;
+
+        return result;
+    }
+
+    // Aggregation
+
+    struct aggregate_result
+    {
+        size_t count;
+        double sum;
+        double min;
+        double max;
+
+        // Per-type breakdown of the documents in the batch
+        size_t int32_count;
+        size_t int64_count;
+        size_t double_count;
+        size_t null_count;
+        size_t missing_count;
+        size_t other_count;
+
+        aggregate_result()
+            : count(0U), sum(0.0), min(0.0), max(0.0),
+            int32_count(0U), int64_count(0U), double_count(0U),
+            null_count(0U), missing_count(0U), other_count(0U)
+        {
+        }
+
+        double mean() const
+        {
+            return (count > 0U) ? sum / count : 0.0;
+        }
+    };
+
+    // Computes count/sum/min/max/mean of one numeric field over a batch of
+    // documents. Values are first gathered into a contiguous buffer (int32
+    // and int64 are promoted to double, so int64 values beyond 2^53 lose
+    // precision) and then reduced. The buffer is kept between runs, so a
+    // long-lived aggregator does not allocate once it has reached the size
+    // of the largest batch.
+    class aggregator
+    {
+        private:
+            std::vector<double> values;
+
+        public:
+            aggregate_result run(
+                const document* documents,
+                size_t count,
+                const std::string& path
+            )
+            {
+                aggregate_result result;
+
+                values.resize(count);
+
+                for (size_t i = 0; i < count; i++)
+                {
+                    node _node;
+
+                    if (!documents[i].find(path.c_str(), _node))
+                    {
+                        result.missing_count++;
+                        continue;
+                    }
+
+                    switch (_node.get_type())
+                    {
+                        case int32_node:
+                            values[result.count++] = *reinterpret_cast<int*>(
+                                _node.get_data()
+                            );
+                            result.int32_count++;
+                            break;
+                        case int64_node:
+                            values[result.count++] = static_cast<double>(
+                                *reinterpret_cast<long long*>(_node.get_data())
+                            );
+                            result.int64_count++;
+                            break;
+                        case double_node:
+                            values[result.count++] = *reinterpret_cast<double*>(
+                                _node.get_data()
+                            );
+                            result.double_count++;
+                            break;
+                        case null_node:
+                            result.null_count++;
+                            break;
+                        default:
+                            result.other_count++;
+                            break;
+                    }
+                }
+
+                values.resize(result.count);
+
+                if (result.count > 0U)
+                {
+                    result.sum = reduce_sum(&values[0], result.count);
+                    result.min = reduce_min(&values[0], result.count);
+                    result.max = reduce_max(&values[0], result.count);
+                }
+
+                return result;
+            }
+
+            aggregate_result run(
+                const std::vector<document>& documents,
+                const std::string& path
+            )
+            {
+                return documents.empty()
+                    ? aggregate_result()
+                    : run(&documents[0], documents.size(), path)
+                ;
+            }
+
+            // Values gathered by the last run, in document order
+            const std::vector<double>& get_values() const { return values; }
+    };
+}
@@ -0,0 +1,543 @@
+#pragma once
+
+#include "microbson.hpp"
+#include "microbson_dump.hpp"
+#include "microbson_parallel.hpp"
+
+#include <cstddef>
+#include <cstring>
+#include <vector>
+
+namespace microbson
+{
+    // Block compression
+
+    // LZ77 codec in the style of LZ4. A compressed block is a series of
+    // sequences, each a token byte (literal count in the high nibble, match
+    // length minus 4 in the low one, 15 meaning that more length bytes
+    // follow, 255 at a time), the literals, and a 2-byte little-endian
+    // offset back into the output for the match. The last sequence only
+    // has literals. Matches are found through a hash of the next 4 bytes.
+    namespace detail
+    {
+        enum {
+            lz_min_match = 4,
+            lz_hash_bits = 12,
+            lz_max_offset = 65535,
+            lz_last_literals = 5,
+            lz_match_margin = 12,
+            // Each length byte adds at most 255 bytes of output
+            lz_max_expansion = 255
+        };
+
+        inline unsigned int lz_hash(const byte* position)
+        {
+            unsigned int value;
+
+            memcpy(&value, position, sizeof(value));
+            return (value * 2654435761U) >> (32 - lz_hash_bits);
+        }
+
+        // Writes a length past the 15 that fits in a nibble
+        inline byte* lz_write_length(size_t length, byte* output)
+        {
+            for (; length >= 255U; length -= 255U)
+                *output++ = 255;
+
+            *output++ = static_cast<byte>(length);
+            return output;
+        }
+
+        inline bool lz_read_length(
+            const byte*& input,
+            const byte* end,
+            size_t& length
+        )
+        {
+            byte next;
+
+            do
+            {
+                if (input == end)
+                    return false;
+
+                next = *input++;
+                length += next;
+            }
+            while (next == 255);
+
+            return true;
+        }
+
+        // Writes a sequence, or returns NULL if it doesn't fit before limit
+        inline byte* lz_write_sequence(
+            const byte* literals,
+            size_t literal_count,
+            size_t offset,
+            size_t match_length,
+            byte* output,
+            const byte* limit
+        )
+        {
+            const size_t extra = (match_length > 0U) ? match_length - lz_min_match : 0U;
+            byte* token = output;
+
+            if (static_cast<size_t>(limit - output)
+                < 1U + literal_count / 255U + 1U + literal_count + 2U + extra / 255U + 1U)
+                return NULL;
+
+            output++;
+
+            *token = static_cast<byte>(
+                ((literal_count < 15U) ? literal_count : 15U) << 4
+            );
+
+            if (literal_count >= 15U)
+                output = lz_write_length(literal_count - 15U, output);
+
+            memcpy(output, literals, literal_count);
+            output += literal_count;
+
+            if (match_length == 0U)
+                return output;
+
+            *output++ = static_cast<byte>(offset & 0xFF);
+            *output++ = static_cast<byte>(offset >> 8);
+            *token |= static_cast<byte>((extra < 15U) ? extra : 15U);
+
+            if (extra >= 15U)
+                output = lz_write_length(extra - 15U, output);
+
+            return output;
+        }
+    }
+
+    // Largest size compress_block() can produce for the given input
+    inline size_t compress_bound(size_t size)
+    {
+        return size + size / 255U + 16U;
+    }
+
+    // Compresses size bytes from source into buffer. Returns the compressed
+    // size, or 0 if it doesn't fit in count bytes (compress_bound(size)
+    // bytes are always enough).
+    inline size_t compress_block(
+        const void* source,
+        size_t size,
+        void* buffer,
+        size_t count
+    )
+    {
+        const byte* input = static_cast<const byte*>(source);
+        const byte* anchor = input;
+        const byte* position = input;
+        const byte* end = input + size;
+        byte* output = static_cast<byte*>(buffer);
+        byte* limit = output + count;
+        int table[1 << detail::lz_hash_bits];
+
+        if (count == 0U)
+            return 0U;
+
+        memset(table, 0xFF, sizeof(table));
+
+        if (size > static_cast<size_t>(detail::lz_match_margin))
+        {
+            const byte* match_limit = end - detail::lz_last_literals;
+            const byte* search_limit = end - detail::lz_match_margin;
+
+            while (position < search_limit)
+            {
+                const unsigned int hash = detail::lz_hash(position);
+                const int candidate = table[hash];
+                const byte* match;
+                size_t length;
+
+                table[hash] = static_cast<int>(position - input);
+
+                if ((candidate < 0)
+                    || (position - input - candidate > detail::lz_max_offset)
+                    || (memcmp(input + candidate, position, detail::lz_min_match) != 0))
+                {
+                    // Skips faster through input that doesn't compress
+                    position += 1 + ((position - anchor) >> 6);
+                    continue;
+                }
+
+                match = input + candidate;
+                length = detail::lz_min_match;
+
+                while ((position + length < match_limit)
+                    && (match[length] == position[length]))
+                    length++;
+
+                output = detail::lz_write_sequence(
+                    anchor,
+                    position - anchor,
+                    position - match,
+                    length,
+                    output,
+                    limit
+                );
+
+                if (output == NULL)
+                    return 0U;
+
+                position += length;
+                anchor = position;
+
+                if (position - 2 < search_limit)
+                    table[detail::lz_hash(position - 2)] =
+                        static_cast<int>(position - 2 - input);
+            }
+        }
+
+        output = detail::lz_write_sequence(anchor, end - anchor, 0U, 0U, output, limit);
+
+        return (output != NULL)
+            ? output - static_cast<byte*>(buffer)
+            : 0U
+        ;
+    }
+
+    // Decompresses a block into exactly count bytes. Returns false if the
+    // block is malformed or doesn't decompress to that size.
+    inline bool decompress_block(
+        const void* source,
+        size_t size,
+        void* buffer,
+        size_t count
+    )
+    {
+        const byte* input = static_cast<const byte*>(source);
+        const byte* end = input + size;
+        byte* output = static_cast<byte*>(buffer);
+        byte* limit = output + count;
+
+        while (input < end)
+        {
+            const byte token = *input++;
+            size_t literal_count = token >> 4;
+            size_t offset;
+            size_t length = token & 0x0F;
+
+            if ((literal_count == 15U)
+                && !detail::lz_read_length(input, end, literal_count))
+                return false;
+
+            if ((static_cast<size_t>(end - input) < literal_count)
+                || (static_cast<size_t>(limit - output) < literal_count))
+                return false;
+
+            memcpy(output, input, literal_count);
+            input += literal_count;
+            output += literal_count;
+
+            if (input == end)
+                break;
+
+            if (end - input < 2)
+                return false;
+
+            offset = input[0] | (input[1] << 8);
+            input += 2;
+
+            if ((length == 15U) && !detail::lz_read_length(input, end, length))
+                return false;
+
+            length += detail::lz_min_match;
+
+            if ((offset == 0U)
+                || (offset > static_cast<size_t>(output - static_cast<byte*>(buffer)))
+                || (static_cast<size_t>(limit - output) < length))
+                return false;
+
+            // Matches may overlap what they write
+            if (offset >= length)
+                memcpy(output, output - offset, length);
+            else
+                for (size_t i = 0; i < length; i++)
+                    output[i] = output[i - offset];
+
+            output += length;
+        }
+
+        return output == limit;
+    }
+
+    // Block streams
+    //
+    // A stream of serialized documents cut into blocks that decompress on
+    // their own. Each block starts with a 9-byte header: its decompressed
+    // size and its stored size (4 bytes each, little-endian as the rest of
+    // BSON), then its method, 0 when stored as it is and 1 for the codec
+    // above. Documents are never split across blocks, so a decompressed
+    // block is a document_sequence. Streams can be concatenated.
+
+    enum block_method {
+        stored_block = 0,
+        lz_block = 1
+    };
+
+    enum { block_header_size = 9 };
+
+    // Collects serialized documents into blocks of about block_size bytes
+    // and compresses each as it fills. A document larger than block_size
+    // gets a block of its own.
+    class block_writer
+    {
+        private:
+            size_t block_size;
+            std::vector<byte> pending;
+            std::vector<byte> scratch;
+            std::vector<byte> output;
+            size_t blocks;
+
+        public:
+            explicit block_writer(size_t block_size = 65536U)
+                : block_size(block_size), blocks(0U)
+            {
+            }
+
+            void add(const void* bytes, size_t count)
+            {
+                if (!pending.empty() && (pending.size() + count > block_size))
+                    flush();
+
+                pending.insert(
+                    pending.end(),
+                    static_cast<const byte*>(bytes),
+                    static_cast<const byte*>(bytes) + count
+                );
+
+                if (pending.size() >= block_size)
+                    flush();
+            }
+
+            void add(const document& source)
+            {
+                add(source.get_bytes(), source.get_size());
+            }
+
+            // Writes what has been added since the last block as a block
+            void flush()
+            {
+                const unsigned int raw_size = static_cast<unsigned int>(pending.size());
+                unsigned int stored_size;
+                byte method = lz_block;
+                size_t start = output.size();
+
+                if (pending.empty())
+                    return;
+
+                scratch.resize(compress_bound(pending.size()));
+                stored_size = static_cast<unsigned int>(
+                    compress_block(&pending[0], pending.size(), &scratch[0], scratch.size())
+                );
+
+                // Blocks that don't compress are kept as they are
+                if ((stored_size == 0U) || (stored_size >= raw_size))
+                {
+                    method = stored_block;
+                    stored_size = raw_size;
+                }
+
+                output.resize(start + block_header_size + stored_size);
+                memcpy(&output[start], &raw_size, 4U);
+                memcpy(&output[start + 4U], &stored_size, 4U);
+                output[start + 8U] = method;
+                memcpy(
+                    &output[start + block_header_size],
+                    (method == lz_block) ? &scratch[0] : &pending[0],
+                    stored_size
+                );
+
+                pending.clear();
+                blocks++;
+            }
+
+            // The blocks written so far; call flush() first for the last one
+            const std::vector<byte>& get_output() const { return output; }
+
+            size_t get_block_count() const { return blocks; }
+
+            void clear()
+            {
+                pending.clear();
+                output.clear();
+                blocks = 0U;
+            }
+    };
+
+    // Reads the blocks of a stream. The headers are read up front; blocks
+    // are only decompressed on demand, one at a time or all in parallel.
+    class block_stream
+    {
+        private:
+            struct block
+            {
+                const byte* bytes;
+                size_t stored_size;
+                size_t raw_size;
+                byte method;
+            };
+
+            std::vector<block> blocks;
+            size_t raw_size;
+            bool valid;
+
+            void scan(const byte* bytes, size_t count)
+            {
+                size_t offset = 0U;
+
+                raw_size = 0U;
+                valid = true;
+
+                while (offset < count)
+                {
+                    unsigned int sizes[2];
+                    block _block;
+
+                    if (count - offset < block_header_size)
+                    {
+                        valid = false;
+                        return;
+                    }
+
+                    memcpy(sizes, bytes + offset, sizeof(sizes));
+                    _block.raw_size = sizes[0];
+                    _block.stored_size = sizes[1];
+                    _block.method = bytes[offset + 8U];
+                    _block.bytes = bytes + offset + block_header_size;
+                    offset += block_header_size;
+
+                    // Raw sizes are bounded before anything is allocated
+                    // for them
+                    if ((_block.stored_size > count - offset)
+                        || (_block.method > lz_block)
+                        || ((_block.method == stored_block)
+                            && (_block.stored_size != _block.raw_size))
+                        || (_block.raw_size / detail::lz_max_expansion > _block.stored_size))
+                    {
+                        valid = false;
+                        return;
+                    }
+
+                    offset += _block.stored_size;
+                    raw_size += _block.raw_size;
+                    blocks.push_back(_block);
+                }
+            }
+
+            struct decompress_task
+            {
+                const block_stream* owner;
+                byte* output;
+                std::vector<size_t> offsets;
+                std::vector<char> results;
+
+                void operator()(size_t index)
+                {
+                    results[index] = owner->decompress(
+                        index,
+                        output + offsets[index],
+                        owner->get_raw_size(index)
+                    );
+                }
+            };
+
+        public:
+            block_stream(const void* bytes, size_t count)
+            {
+                scan(static_cast<const byte*>(bytes), count);
+            }
+
+            explicit block_stream(const mapped_file& file)
+            {
+                scan(file.get_bytes(), file.get_size());
+            }
+
+            // Whether the whole input is made of well-formed block headers.
+            // The blocks before the first bad one can still be read.
+            bool is_valid() const { return valid; }
+
+            size_t get_block_count() const { return blocks.size(); }
+
+            size_t get_raw_size(size_t index) const
+            {
+                return blocks[index].raw_size;
+            }
+
+            // Size of all the blocks decompressed
+            size_t get_raw_size() const { return raw_size; }
+
+            // Decompresses a block into count bytes, which must be its raw
+            // size. Returns false if the block is corrupt.
+            bool decompress(size_t index, void* buffer, size_t count) const
+            {
+                const block& _block = blocks[index];
+
+                if (count != _block.raw_size)
+                    return false;
+
+                if (_block.method == stored_block)
+                {
+                    memcpy(buffer, _block.bytes, count);
+                    return true;
+                }
+
+                return decompress_block(_block.bytes, _block.stored_size, buffer, count);
+            }
+
+            // Decompresses every block into output, spreading them over up
+            // to the given number of threads (all the cores when 0), and
+            // appends views of the documents to documents, in order. The
+            // views point into output, which must then be left alone.
+            // Returns false if any block is corrupt.
+            bool decompress(
+                std::vector<byte>& output,
+                std::vector<document>& documents,
+                size_t threads = 0U
+            ) const
+            {
+                decompress_task task;
+                size_t offset = 0U;
+
+                output.resize(raw_size);
+
+                if (blocks.empty())
+                    return true;
+
+                for (size_t i = 0; i < blocks.size(); i++)
+                {
+                    task.offsets.push_back(offset);
+                    offset += blocks[i].raw_size;
+                }
+
+                task.owner = this;
+                task.output = output.empty() ? NULL : &output[0];
+                task.results.assign(blocks.size(), 0);
+                parallel_for(blocks.size(), task, threads);
+
+                for (size_t i = 0; i < blocks.size(); i++)
+                {
+                    if (!task.results[i])
+                        return false;
+
+                    const document_sequence sequence(
+                        task.output + task.offsets[i],
+                        blocks[i].raw_size
+                    );
+
+                    for (
+                        document_sequence::const_iterator j = sequence.begin();
+                        j != sequence.end();
+                        ++j
+                    )
+                        documents.push_back(*j);
+                }
+
+                return true;
+            }
+    };
+}
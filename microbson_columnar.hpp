@@ -0,0 +1,642 @@
+#pragma once
+
+#include "minibson.hpp"
+#include "microbson.hpp"
+#include "microbson_columns.hpp"
+#include "microbson_dump.hpp"
+
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace microbson
+{
+    // Columnar files
+
+    // Every field path of a dump is stored in its own file
+    // (<prefix><path>.col), laid out so that it can be mapped and read in
+    // place:
+    //
+    //   header
+    //   blocks       validity bitmap + fixed-width values, block_rows each
+    //   statistics   one column_stats per block
+    //   dictionary   string columns only: count, count + 1 offsets, chars
+    //
+    // Values are int32, int64, double, one byte per boolean, or an int32
+    // dictionary code per string. Every block holds block_rows rows (the
+    // last one is padded), so a row's location is a simple computation.
+
+    struct column_header
+    {
+        char magic[8];
+        int type;
+        int block_rows;
+        long long rows;
+        long long stats_offset;
+        long long dictionary_offset;
+    };
+
+    // Per-block statistics. Integer and boolean columns fill the integer
+    // bounds, double columns the floating-point ones; string columns only
+    // count nulls.
+    struct column_stats
+    {
+        long long min_int;
+        long long max_int;
+        double min_double;
+        double max_double;
+        long long null_count;
+    };
+
+    static const char column_magic[8] = { 'B', 'S', 'O', 'N', 'C', 'O', 'L', '1' };
+
+    inline size_t column_width(node_type type)
+    {
+        switch (type)
+        {
+            case int32_node: return sizeof(int);
+            case int64_node: return sizeof(long long);
+            case double_node: return sizeof(double);
+            case boolean_node: return 1U;
+            case string_node: return sizeof(int);
+            default: return 0U;
+        }
+    }
+
+    // Converts dumps into columnar files. Documents are transposed one
+    // block at a time, so memory use is bounded by the block size (plus the
+    // string dictionaries).
+    class columnar_writer
+    {
+        private:
+            struct output
+            {
+                FILE* file;
+                std::vector<column_stats> stats;
+                std::map<std::string, int> codes;
+                std::vector<std::string> dictionary;
+            };
+
+            std::string prefix;
+            size_t block_rows;
+            long long rows;
+            transposer columns;
+            std::vector<output> outputs;
+            std::vector<document> pending;
+            std::vector<byte> block;
+            bool failed;
+
+            columnar_writer(const columnar_writer&);
+            columnar_writer& operator=(const columnar_writer&);
+
+            void flush()
+            {
+                size_t count = pending.size();
+
+                if (count == 0U)
+                    return;
+
+                columns.run(pending);
+
+                for (size_t i = 0; i < outputs.size(); i++)
+                    write_block(columns.get_column(i), outputs[i], count);
+
+                rows += count;
+                pending.clear();
+            }
+
+            template<typename T>
+            void write_values(
+                const std::vector<T>& values,
+                const column& _column,
+                size_t count,
+                column_stats& stats,
+                bool integer
+            )
+            {
+                std::memcpy(
+                    &block[block_rows / 8U], &values[0], count * sizeof(T)
+                );
+
+                for (size_t i = 0; i < count; i++)
+                {
+                    if (!_column.valid(i))
+                        continue;
+
+                    if (integer)
+                    {
+                        long long value = static_cast<long long>(values[i]);
+
+                        if (value < stats.min_int) stats.min_int = value;
+                        if (value > stats.max_int) stats.max_int = value;
+                    }
+                    else
+                    {
+                        double value = static_cast<double>(values[i]);
+
+                        if (value < stats.min_double) stats.min_double = value;
+                        if (value > stats.max_double) stats.max_double = value;
+                    }
+                }
+            }
+
+            void write_block(const column& _column, output& _output, size_t count)
+            {
+                column_stats stats;
+
+                stats.min_int = std::numeric_limits<long long>::max();
+                stats.max_int = std::numeric_limits<long long>::min();
+                stats.min_double = std::numeric_limits<double>::infinity();
+                stats.max_double = -std::numeric_limits<double>::infinity();
+                stats.null_count = _column.null_count;
+
+                block.assign(
+                    block_rows / 8U + block_rows * column_width(_column.type),
+                    0
+                );
+                std::memcpy(&block[0], &_column.validity[0], _column.validity.size());
+
+                switch (_column.type)
+                {
+                    case int32_node:
+                        write_values(_column.int32_values, _column, count, stats, true);
+                        break;
+                    case int64_node:
+                        write_values(_column.int64_values, _column, count, stats, true);
+                        break;
+                    case double_node:
+                        write_values(_column.double_values, _column, count, stats, false);
+                        break;
+                    case boolean_node:
+                        write_values(_column.boolean_values, _column, count, stats, true);
+                        break;
+                    case string_node:
+                        {
+                            int* codes = reinterpret_cast<int*>(&block[block_rows / 8U]);
+
+                            for (size_t i = 0; i < count; i++)
+                            {
+                                if (!_column.valid(i))
+                                    continue;
+
+                                std::string value = _column.get_string(i);
+                                std::map<std::string, int>::iterator position =
+                                    _output.codes.find(value);
+
+                                if (position == _output.codes.end())
+                                {
+                                    position = _output.codes.insert(
+                                        std::make_pair(value, static_cast<int>(_output.dictionary.size()))
+                                    ).first;
+                                    _output.dictionary.push_back(value);
+                                }
+
+                                codes[i] = position->second;
+                            }
+                            break;
+                        }
+                    default:
+                        break;
+                }
+
+                _output.stats.push_back(stats);
+
+                if (fwrite(&block[0], 1, block.size(), _output.file) != block.size())
+                    failed = true;
+            }
+
+            bool finish(const column& _column, output& _output)
+            {
+                column_header header;
+                long long position = ftell(_output.file);
+                bool result;
+
+                std::memcpy(header.magic, column_magic, sizeof(header.magic));
+                header.type = _column.type;
+                header.block_rows = static_cast<int>(block_rows);
+                header.rows = rows;
+                header.stats_offset = position;
+                header.dictionary_offset = 0;
+
+                result = (position >= 0);
+
+                if (!_output.stats.empty())
+                    result &= (fwrite(
+                        &_output.stats[0],
+                        sizeof(column_stats),
+                        _output.stats.size(),
+                        _output.file
+                    ) == _output.stats.size());
+
+                if (_column.type == string_node)
+                {
+                    int count = static_cast<int>(_output.dictionary.size());
+                    unsigned int offset = 0U;
+
+                    header.dictionary_offset = ftell(_output.file);
+                    result &= (header.dictionary_offset > 0);
+                    result &= (fwrite(&count, sizeof(int), 1, _output.file) == 1);
+
+                    for (size_t i = 0; i <= _output.dictionary.size(); i++)
+                    {
+                        result &= (fwrite(&offset, sizeof(unsigned int), 1, _output.file) == 1);
+
+                        if (i < _output.dictionary.size())
+                            offset += _output.dictionary[i].length();
+                    }
+
+                    for (size_t i = 0; i < _output.dictionary.size(); i++)
+                        result &= (fwrite(
+                            _output.dictionary[i].data(),
+                            1,
+                            _output.dictionary[i].length(),
+                            _output.file
+                        ) == _output.dictionary[i].length());
+                }
+
+                result &= (fseek(_output.file, 0, SEEK_SET) == 0);
+                result &= (fwrite(&header, sizeof(header), 1, _output.file) == 1);
+
+                return (fclose(_output.file) == 0) && result;
+            }
+
+        public:
+            // Block sizes are rounded up to a multiple of 64 rows, which keeps
+            // every block's values 8-byte aligned.
+            columnar_writer(const std::string& prefix, size_t block_rows = 65536U)
+                : prefix(prefix),
+                block_rows((block_rows + 63U) / 64U * 64U),
+                rows(0),
+                failed(false)
+            {
+            }
+
+            ~columnar_writer()
+            {
+                for (size_t i = 0; i < outputs.size(); i++)
+                    if (outputs[i].file != NULL)
+                        fclose(outputs[i].file);
+            }
+
+            // Adds a column; must be called before any document is written.
+            // Returns false if the column file cannot be created.
+            bool add(const std::string& path, node_type type)
+            {
+                column_header header;
+                output _output;
+
+                if ((column_width(type) == 0U)
+                    || (columns.add(path, type) != outputs.size()))
+                    return false;
+
+                std::memset(&header, 0, sizeof(header));
+                _output.file = fopen((prefix + path + ".col").c_str(), "wb");
+                outputs.push_back(_output);
+
+                return (_output.file != NULL)
+                    && (fwrite(&header, sizeof(header), 1, _output.file) == 1);
+            }
+
+            void write(const document& source)
+            {
+                pending.push_back(source);
+
+                if (pending.size() == block_rows)
+                    flush();
+            }
+
+            void write(const document_sequence& sequence)
+            {
+                for (
+                    document_sequence::const_iterator i = sequence.begin();
+                    i != sequence.end();
+                    ++i
+                )
+                    write(*i);
+            }
+
+            // Writes the pending block, the statistics and the dictionaries,
+            // and closes all the files. Returns false if any write failed.
+            bool close()
+            {
+                bool result;
+
+                flush();
+                result = !failed;
+
+                for (size_t i = 0; i < outputs.size(); i++)
+                {
+                    if (outputs[i].file == NULL)
+                        result = false;
+                    else
+                        result &= finish(columns.get_column(i), outputs[i]);
+
+                    outputs[i].file = NULL;
+                }
+
+                return result;
+            }
+    };
+
+    // Reads a single column file in place.
+    class column_reader
+    {
+        private:
+            mapped_file file;
+            const column_header* header;
+            size_t block_size;
+            size_t dictionary_count;
+            const unsigned int* dictionary_offsets;
+            const char* dictionary_data;
+
+            const byte* get_block(size_t row) const
+            {
+                return file.get_bytes() + sizeof(column_header)
+                    + (row / header->block_rows) * block_size;
+            }
+
+            const void* get_value(size_t row) const
+            {
+                return get_block(row) + header->block_rows / 8
+                    + (row % header->block_rows) * column_width(get_type());
+            }
+
+        public:
+            column_reader()
+                : header(NULL), block_size(0U), dictionary_count(0U),
+                dictionary_offsets(NULL), dictionary_data(NULL)
+            {
+            }
+
+            // Returns false if the file can't be mapped, or if its header
+            // doesn't match its size: every section it points to must lie
+            // within the file.
+            bool open(const std::string& path)
+            {
+                header = NULL;
+                dictionary_count = 0U;
+                dictionary_offsets = NULL;
+                dictionary_data = NULL;
+
+                if (!file.open(path) || (file.get_size() < sizeof(column_header)))
+                    return false;
+
+                const column_header* candidate =
+                    reinterpret_cast<const column_header*>(file.get_bytes());
+                const unsigned long long size = file.get_size();
+                const size_t width = column_width(static_cast<node_type>(candidate->type));
+                unsigned long long blocks;
+                unsigned long long length;
+
+                if ((std::memcmp(candidate->magic, column_magic, sizeof(column_magic)) != 0)
+                    || (width == 0U)
+                    || (candidate->block_rows <= 0)
+                    || (candidate->block_rows % 64 != 0)
+                    || (candidate->rows < 0))
+                    return false;
+
+                // Blocks, then statistics, then the dictionary
+                length = candidate->block_rows / 8 + candidate->block_rows * static_cast<unsigned long long>(width);
+                blocks = candidate->rows / candidate->block_rows
+                    + ((candidate->rows % candidate->block_rows != 0) ? 1 : 0);
+
+                if ((blocks > (size - sizeof(column_header)) / length)
+                    || (candidate->stats_offset < 0)
+                    || (static_cast<unsigned long long>(candidate->stats_offset) > size)
+                    || (static_cast<unsigned long long>(candidate->stats_offset) < sizeof(column_header) + blocks * length)
+                    || (candidate->stats_offset % sizeof(long long) != 0)
+                    || (blocks > (size - candidate->stats_offset) / sizeof(column_stats)))
+                    return false;
+
+                if (candidate->type != string_node)
+                {
+                    if (candidate->dictionary_offset != 0)
+                        return false;
+                }
+                else
+                {
+                    const unsigned long long start = candidate->dictionary_offset;
+                    const byte* dictionary = file.get_bytes() + start;
+                    const unsigned int* offsets;
+                    int count;
+
+                    if ((candidate->dictionary_offset < candidate->stats_offset + static_cast<long long>(blocks * sizeof(column_stats)))
+                        || (start % sizeof(int) != 0)
+                        || (start > size)
+                        || (size - start < sizeof(int)))
+                        return false;
+
+                    count = *reinterpret_cast<const int*>(dictionary);
+
+                    if ((count < 0)
+                        || ((size - start - sizeof(int)) / sizeof(unsigned int) < static_cast<unsigned long long>(count) + 1U))
+                        return false;
+
+                    offsets = reinterpret_cast<const unsigned int*>(dictionary + sizeof(int));
+                    length = size - start - sizeof(int) - (count + 1U) * sizeof(unsigned int);
+
+                    for (int i = 0; i < count; i++)
+                        if (offsets[i] > offsets[i + 1])
+                            return false;
+
+                    if ((offsets[0] != 0U) || (offsets[count] > length))
+                        return false;
+
+                    dictionary_count = count;
+                    dictionary_offsets = offsets;
+                    dictionary_data = reinterpret_cast<const char*>(offsets + count + 1);
+                }
+
+                header = candidate;
+                block_size = static_cast<size_t>(
+                    header->block_rows / 8 + header->block_rows * width
+                );
+
+                return true;
+            }
+
+            node_type get_type() const
+            {
+                return static_cast<node_type>(header->type);
+            }
+
+            size_t get_rows() const { return static_cast<size_t>(header->rows); }
+
+            size_t get_block_rows() const { return header->block_rows; }
+
+            size_t get_block_count() const
+            {
+                return (get_rows() + header->block_rows - 1) / header->block_rows;
+            }
+
+            const column_stats& get_stats(size_t block) const
+            {
+                return reinterpret_cast<const column_stats*>(
+                    file.get_bytes() + header->stats_offset
+                )[block];
+            }
+
+            bool valid(size_t row) const
+            {
+                size_t index = row % header->block_rows;
+
+                return (get_block(row)[index / 8] & (1U << (index % 8))) != 0;
+            }
+
+            // Contiguous values of the block starting at the given row
+            const void* get_values(size_t block) const
+            {
+                return get_value(block * header->block_rows);
+            }
+
+            int get_int32(size_t row) const
+            {
+                return *static_cast<const int*>(get_value(row));
+            }
+
+            long long get_int64(size_t row) const
+            {
+                return *static_cast<const long long*>(get_value(row));
+            }
+
+            double get_double(size_t row) const
+            {
+                return *static_cast<const double*>(get_value(row));
+            }
+
+            bool get_boolean(size_t row) const
+            {
+                return *static_cast<const byte*>(get_value(row)) != 0;
+            }
+
+            // Dictionary code of a string row
+            int get_code(size_t row) const
+            {
+                return *static_cast<const int*>(get_value(row));
+            }
+
+            size_t get_dictionary_size() const { return dictionary_count; }
+
+            // Empty for codes outside the dictionary
+            std::string get_dictionary_entry(int code) const
+            {
+                if ((code < 0) || (static_cast<size_t>(code) >= dictionary_count))
+                    return std::string();
+
+                return std::string(
+                    dictionary_data + dictionary_offsets[code],
+                    dictionary_offsets[code + 1] - dictionary_offsets[code]
+                );
+            }
+
+            std::string get_string(size_t row) const
+            {
+                return get_dictionary_entry(get_code(row));
+            }
+    };
+
+    // Reads a set of column files written under the same prefix.
+    class columnar_reader
+    {
+        private:
+            std::vector<std::string> paths;
+            std::vector<column_reader*> readers;
+
+            columnar_reader(const columnar_reader&);
+            columnar_reader& operator=(const columnar_reader&);
+
+            static void set(
+                minibson::document& target,
+                const std::string& path,
+                const column_reader& reader,
+                size_t row
+            )
+            {
+                size_t dot = path.find('.');
+
+                if (dot != std::string::npos)
+                {
+                    std::string name = path.substr(0, dot);
+                    minibson::document child(
+                        target.get(name, minibson::document())
+                    );
+
+                    set(child, path.substr(dot + 1), reader, row);
+                    target.set(name, child);
+                    return;
+                }
+
+                switch (reader.get_type())
+                {
+                    case int32_node:
+                        target.set(path, reader.get_int32(row));
+                        break;
+                    case int64_node:
+                        target.set(path, reader.get_int64(row));
+                        break;
+                    case double_node:
+                        target.set(path, reader.get_double(row));
+                        break;
+                    case boolean_node:
+                        target.set(path, reader.get_boolean(row));
+                        break;
+                    case string_node:
+                        target.set(path, reader.get_string(row));
+                        break;
+                    default:
+                        break;
+                }
+            }
+
+        public:
+            columnar_reader() { }
+
+            ~columnar_reader()
+            {
+                for (size_t i = 0; i < readers.size(); i++)
+                    delete readers[i];
+            }
+
+            bool add(const std::string& prefix, const std::string& path)
+            {
+                column_reader* reader = new column_reader();
+
+                if (!reader->open(prefix + path + ".col"))
+                {
+                    delete reader;
+                    return false;
+                }
+
+                paths.push_back(path);
+                readers.push_back(reader);
+
+                return true;
+            }
+
+            const column_reader& get_column(size_t index) const
+            {
+                return *readers[index];
+            }
+
+            size_t get_rows() const
+            {
+                return readers.empty() ? 0U : readers[0]->get_rows();
+            }
+
+            // Reassembles a row; null values are left out.
+            minibson::document get_row(size_t row) const
+            {
+                minibson::document result;
+
+                for (size_t i = 0; i < readers.size(); i++)
+                    if (readers[i]->valid(row))
+                        set(result, paths[i], *readers[i], row);
+
+                return result;
+            }
+    };
+}
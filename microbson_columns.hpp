@@ -0,0 +1,258 @@
+#pragma once
+
+#include "microbson.hpp"
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+namespace microbson
+{
+    // Columns
+
+    // Values of one field across a batch of documents. Only the vector
+    // matching the column type is filled; string columns keep rows + 1
+    // offsets into a shared character buffer (strings are not terminated).
+    // Rows where the field is missing, null or of an incompatible type are
+    // cleared in the validity bitmap (bit i of byte i / 8, least significant
+    // first) and hold a zero value or an empty string.
+    struct column
+    {
+        std::string path;
+        node_type type;
+        size_t null_count;
+
+        std::vector<byte> validity;
+        std::vector<int> int32_values;
+        std::vector<long long> int64_values;
+        std::vector<double> double_values;
+        std::vector<byte> boolean_values;
+        std::vector<unsigned int> offsets;
+        std::vector<char> data;
+
+        column(const std::string& path, node_type type)
+            : path(path), type(type), null_count(0U)
+        {
+        }
+
+        bool valid(size_t row) const
+        {
+            return (validity[row / 8U] & (1U << (row % 8U))) != 0;
+        }
+
+        std::string get_string(size_t row) const
+        {
+            return (offsets[row + 1] > offsets[row])
+                ? std::string(
+                    &data[offsets[row]],
+                    offsets[row + 1] - offsets[row]
+                )
+                : std::string()
+            ;
+        }
+    };
+
+    // Transposes a batch of documents into one column per requested field.
+    // Each document is walked once, matching its elements against all the
+    // requested paths at the same time. Numeric values are widened to the
+    // column type (int32 into int64 or double columns, int64 into double
+    // columns). Column storage is reused between runs.
+    class transposer
+    {
+        private:
+            field_tree fields;
+            std::vector<size_t> targets;
+            std::vector<column> columns;
+            size_t rows;
+
+            void clear(column& _column, size_t count)
+            {
+                _column.null_count = count;
+                _column.validity.assign((count + 7U) / 8U, 0);
+
+                switch (_column.type)
+                {
+                    case int32_node:
+                        _column.int32_values.assign(count, 0);
+                        break;
+                    case int64_node:
+                        _column.int64_values.assign(count, 0LL);
+                        break;
+                    case double_node:
+                        _column.double_values.assign(count, 0.0);
+                        break;
+                    case boolean_node:
+                        _column.boolean_values.assign(count, 0);
+                        break;
+                    case string_node:
+                        _column.offsets.assign(count + 1U, 0U);
+                        _column.data.clear();
+                        break;
+                    default:
+                        break;
+                }
+            }
+
+            bool store(column& _column, const node& _node, size_t row)
+            {
+                void* data = _node.get_data();
+                node_type type = _node.get_type();
+
+                switch (_column.type)
+                {
+                    case int32_node:
+                        if (type != int32_node)
+                            return false;
+
+                        _column.int32_values[row] = *reinterpret_cast<int*>(
+                            data
+                        );
+                        break;
+                    case int64_node:
+                        if (type == int32_node)
+                            _column.int64_values[row] = *reinterpret_cast<int*>(
+                                data
+                            );
+                        else if (type == int64_node)
+                            _column.int64_values[row] =
+                                *reinterpret_cast<long long*>(data);
+                        else
+                            return false;
+                        break;
+                    case double_node:
+                        if (type == int32_node)
+                            _column.double_values[row] =
+                                *reinterpret_cast<int*>(data);
+                        else if (type == int64_node)
+                            _column.double_values[row] = static_cast<double>(
+                                *reinterpret_cast<long long*>(data)
+                            );
+                        else if (type == double_node)
+                            _column.double_values[row] =
+                                *reinterpret_cast<double*>(data);
+                        else
+                            return false;
+                        break;
+                    case boolean_node:
+                        if (type != boolean_node)
+                            return false;
+
+                        _column.boolean_values[row] =
+                            *reinterpret_cast<byte*>(data) ? 1 : 0;
+                        break;
+                    case string_node:
+                        {
+                            if (type != string_node)
+                                return false;
+
+                            const char* value = reinterpret_cast<char*>(data)
+                                + sizeof(int);
+
+                            _column.data.insert(
+                                _column.data.end(),
+                                value,
+                                value + *reinterpret_cast<int*>(data) - 1
+                            );
+                            break;
+                        }
+                    default:
+                        return false;
+                }
+
+                return true;
+            }
+
+            void walk(const document& source, size_t parent, size_t row)
+            {
+                for (
+                    document::const_iterator i = source.begin();
+                    i != source.end();
+                    ++i
+                )
+                {
+                    size_t match = fields.find(parent, i->get_name());
+
+                    if (match == field_tree::root)
+                        continue;
+
+                    if (fields.leaf(match))
+                    {
+                        column& _column = columns[targets[match]];
+
+                        if (!_column.valid(row) && store(_column, *i, row))
+                        {
+                            _column.validity[row / 8U] |= (1U << (row % 8U));
+                            _column.null_count--;
+                        }
+                    }
+
+                    if (i->get_type() == document_node)
+                        walk(
+                            document(
+                                i->get_data(),
+                                *reinterpret_cast<int*>(i->get_data())
+                            ),
+                            match,
+                            row
+                        );
+                }
+            }
+
+        public:
+            transposer() : rows(0U) { }
+
+            // Returns the index of the column for the given path. Supported
+            // types are int32, int64, double, boolean and string.
+            size_t add(const std::string& path, node_type type)
+            {
+                size_t entry = fields.add(path);
+                // Copied, as resize() would bind a reference to the member,
+                // which has no definition
+                const size_t none = field_tree::root;
+
+                targets.resize(fields.size(), none);
+
+                if (targets[entry] == field_tree::root)
+                {
+                    targets[entry] = columns.size();
+                    columns.push_back(column(path, type));
+                }
+
+                return targets[entry];
+            }
+
+            void run(const document* documents, size_t count)
+            {
+                rows = count;
+
+                for (size_t i = 0; i < columns.size(); i++)
+                    clear(columns[i], count);
+
+                for (size_t row = 0; row < count; row++)
+                {
+                    walk(documents[row], field_tree::root, row);
+
+                    for (size_t i = 0; i < columns.size(); i++)
+                        if (columns[i].type == string_node)
+                            columns[i].offsets[row + 1] = columns[i].data.size();
+                }
+            }
+
+            void run(const std::vector<document>& documents)
+            {
+                if (documents.empty())
+                    run(NULL, 0U);
+                else
+                    run(&documents[0], documents.size());
+            }
+
+            size_t get_rows() const { return rows; }
+
+            size_t get_column_count() const { return columns.size(); }
+
+            const column& get_column(size_t index) const
+            {
+                return columns[index];
+            }
+    };
+}
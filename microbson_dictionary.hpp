@@ -0,0 +1,393 @@
+#pragma once
+
+#include "microbson.hpp"
+
+#include <cstddef>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace microbson
+{
+    // Key dictionaries
+
+    // Element names shared by the producers and consumers of documents,
+    // each given a short code by its position. compress_keys() writes a
+    // document with its names replaced by their codes, and expand_keys()
+    // turns it back into standard BSON. Compressed documents are still
+    // valid BSON, so microbson can query them directly through the keys
+    // get_key() returns. Names are only ever appended: a dictionary that
+    // only grew can read what an older version of it wrote.
+    //
+    // A code is a 0x01 byte followed by the position in base 255, least
+    // significant digit first, each digit stored plus one so that codes
+    // never contain a NUL. Compressed documents start with an int32 named
+    // "\x01" that holds the version of the dictionary that wrote them.
+    class key_dictionary
+    {
+        private:
+            int version;
+            std::vector<std::string> names;
+            std::vector<std::string> codes;
+            std::map<std::string, size_t> positions;
+
+            static std::string make_code(size_t position)
+            {
+                std::string result(1U, '\x01');
+
+                do
+                {
+                    result += static_cast<char>(position % 255U + 1U);
+                    position /= 255U;
+                }
+                while (position > 0U);
+
+                return result;
+            }
+
+        public:
+            explicit key_dictionary(int version = 1) : version(version) { }
+
+            // Appends a name, returning its position. Names already there
+            // keep theirs.
+            size_t add(const std::string& name)
+            {
+                std::map<std::string, size_t>::const_iterator found =
+                    positions.find(name);
+
+                if (found != positions.end())
+                    return found->second;
+
+                positions[name] = names.size();
+                names.push_back(name);
+                codes.push_back(make_code(names.size() - 1U));
+
+                return names.size() - 1U;
+            }
+
+            int get_version() const { return version; }
+
+            void set_version(int value) { version = value; }
+
+            size_t size() const { return names.size(); }
+
+            // Code written in compressed documents instead of a name, or
+            // NULL when the name isn't in the dictionary or is no longer
+            // than its code and is written as it is
+            const std::string* find_code(const std::string& name) const
+            {
+                std::map<std::string, size_t>::const_iterator found =
+                    positions.find(name);
+
+                return (found != positions.end())
+                    && (codes[found->second].length() < name.length())
+                    ? &codes[found->second]
+                    : NULL
+                ;
+            }
+
+            const std::string& compress(const std::string& name) const
+            {
+                const std::string* code = find_code(name);
+
+                return (code != NULL) ? *code : name;
+            }
+
+            // Name a compressed one stands for, or NULL if it is a code
+            // this dictionary doesn't have
+            const std::string* expand(const char* name, std::string& scratch) const
+            {
+                size_t position = 0U;
+                size_t scale = 1U;
+
+                if (name[0] != '\x01')
+                {
+                    scratch = name;
+                    return &scratch;
+                }
+
+                for (const byte* digit = reinterpret_cast<const byte*>(name + 1);
+                    *digit != 0; digit++)
+                {
+                    position += (*digit - 1U) * scale;
+                    scale *= 255U;
+                }
+
+                return ((name[1] != '\0') && (position < names.size()))
+                    ? &names[position]
+                    : NULL
+                ;
+            }
+
+            // Key to look a name up in compressed documents. Names written
+            // as they are are looked up through the given string, which
+            // must then outlive the key.
+            key get_key(const std::string& name) const
+            {
+                return key(compress(name));
+            }
+
+            template<size_t N>
+            key get_key(const char (&name)[N]) const
+            {
+                const std::string* code = find_code(std::string(name, N - 1U));
+
+                return (code != NULL) ? key(*code) : key(name);
+            }
+    };
+
+    // Version of the dictionary that compressed a document, or -1 if it
+    // wasn't written by compress_keys()
+    inline int get_dictionary_version(const document& source)
+    {
+        document::const_iterator first = source.begin();
+
+        if ((first == source.end())
+            || (first->get_type() != int32_node)
+            || (strcmp(first->get_name(), "\x01") != 0))
+            return -1;
+
+        return *static_cast<int*>(first->get_data());
+    }
+
+    namespace detail
+    {
+        // Output of the dictionary rewrites; only counts with no buffer
+        class key_writer
+        {
+            private:
+                byte* buffer;
+                size_t count;
+                size_t size;
+
+            public:
+                // Names being rewritten, shared through nested documents
+                std::string scratch;
+                bool failed;
+
+                key_writer(void* buffer, size_t count)
+                    : buffer(static_cast<byte*>(buffer)),
+                    count(count),
+                    size(0U),
+                    failed(false)
+                {
+                }
+
+                size_t get_size() const { return size; }
+
+                // Size written, or 0 if it failed or didn't fit
+                size_t result() const
+                {
+                    return (failed || ((buffer != NULL) && (size > count)))
+                        ? 0U
+                        : size
+                    ;
+                }
+
+                void write(const void* data, size_t length)
+                {
+                    if ((buffer != NULL) && (size + length <= count))
+                        memcpy(buffer + size, data, length);
+
+                    size += length;
+                }
+
+                void write_name(const std::string& name)
+                {
+                    write(name.c_str(), name.length() + 1U);
+                }
+
+                // Sets the length prefix written at start to the size of
+                // what followed it
+                void finish(size_t start)
+                {
+                    const int length = static_cast<int>(size + 1U - start);
+
+                    write("", 1U);
+
+                    if ((buffer != NULL) && (size <= count))
+                        memcpy(buffer + start, &length, sizeof(int));
+                }
+        };
+
+        inline void rewrite_document(
+            const key_dictionary& dictionary,
+            document::const_iterator begin,
+            bool compress,
+            bool is_array,
+            key_writer& output
+        );
+
+        inline void rewrite_elements(
+            const key_dictionary& dictionary,
+            document::const_iterator begin,
+            bool compress,
+            bool is_array,
+            key_writer& output
+        )
+        {
+            std::string& scratch = output.scratch;
+
+            for (document::const_iterator i = begin; i != document::const_iterator(); ++i)
+            {
+                const byte type = i->get_type();
+                const std::string* name = &scratch;
+
+                output.write(&type, 1U);
+
+                if (is_array)
+                    scratch = i->get_name();
+                else if (compress)
+                {
+                    // Names that would read as codes can't be kept as they are
+                    if (i->get_name()[0] == '\x01')
+                        name = NULL;
+                    else
+                    {
+                        scratch = i->get_name();
+                        name = &dictionary.compress(scratch);
+                    }
+                }
+                else
+                    name = dictionary.expand(i->get_name(), scratch);
+
+                if (name == NULL)
+                {
+                    output.failed = true;
+                    return;
+                }
+
+                output.write_name(*name);
+
+                if ((type == document_node) || (type == array_node))
+                {
+                    const document nested(
+                        i->get_data(),
+                        *static_cast<int*>(i->get_data())
+                    );
+
+                    rewrite_document(
+                        dictionary,
+                        nested.begin(),
+                        compress,
+                        type == array_node,
+                        output
+                    );
+                }
+                else
+                    output.write(i->get_data(), i->get_data_size());
+
+                if (output.failed)
+                    return;
+            }
+        }
+
+        inline void rewrite_document(
+            const key_dictionary& dictionary,
+            document::const_iterator begin,
+            bool compress,
+            bool is_array,
+            key_writer& output
+        )
+        {
+            const size_t start = output.get_size();
+            const int placeholder = 0;
+
+            output.write(&placeholder, sizeof(int));
+            rewrite_elements(dictionary, begin, compress, is_array, output);
+            output.finish(start);
+        }
+
+        inline size_t compress_keys(
+            const key_dictionary& dictionary,
+            const document& source,
+            key_writer& output
+        )
+        {
+            const int placeholder = 0;
+            const int version = dictionary.get_version();
+            const byte type = int32_node;
+
+            output.write(&placeholder, sizeof(int));
+            output.write(&type, 1U);
+            output.write_name("\x01");
+            output.write(&version, sizeof(int));
+            rewrite_elements(dictionary, source.begin(), true, false, output);
+            output.finish(0U);
+
+            return output.result();
+        }
+
+        inline size_t expand_keys(
+            const key_dictionary& dictionary,
+            const document& source,
+            key_writer& output
+        )
+        {
+            document::const_iterator first = source.begin();
+            const int version = get_dictionary_version(source);
+
+            if ((version < 0) || (version > dictionary.get_version()))
+                return 0U;
+
+            rewrite_document(dictionary, ++first, false, false, output);
+
+            return output.result();
+        }
+    }
+
+    // Size of source with its names compressed, or 0 if it can't be: names
+    // that start with 0x01 would read as codes
+    inline size_t get_compressed_size(
+        const key_dictionary& dictionary,
+        const document& source
+    )
+    {
+        detail::key_writer output(NULL, 0U);
+
+        return detail::compress_keys(dictionary, source, output);
+    }
+
+    // Writes source with the names in the dictionary replaced by their
+    // codes. Returns the size written, or 0 if the buffer is too small or
+    // source can't be compressed.
+    inline size_t compress_keys(
+        const key_dictionary& dictionary,
+        const document& source,
+        void* buffer,
+        size_t count
+    )
+    {
+        detail::key_writer output(buffer, count);
+
+        return detail::compress_keys(dictionary, source, output);
+    }
+
+    // Size of the standard BSON a compressed document stands for, or 0 if
+    // it wasn't written with this dictionary or an older version of it
+    inline size_t get_expanded_size(
+        const key_dictionary& dictionary,
+        const document& source
+    )
+    {
+        detail::key_writer output(NULL, 0U);
+
+        return detail::expand_keys(dictionary, source, output);
+    }
+
+    // Writes a compressed document back as standard BSON. Returns the size
+    // written, or 0 if the buffer is too small or the document can't be
+    // read with this dictionary.
+    inline size_t expand_keys(
+        const key_dictionary& dictionary,
+        const document& source,
+        void* buffer,
+        size_t count
+    )
+    {
+        detail::key_writer output(buffer, count);
+
+        return detail::expand_keys(dictionary, source, output);
+    }
+}
@@ -0,0 +1,233 @@
+#pragma once
+
+#include "microbson.hpp"
+
+#include <cstddef>
+#include <cstdio>
+#include <string>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define MICROBSON_MMAP
+#endif
+
+namespace microbson
+{
+    // Files
+
+    // Read-only view of a whole file. The file is memory-mapped where the
+    // platform allows it, and read into a heap buffer otherwise.
+    class mapped_file
+    {
+        private:
+            byte* bytes;
+            size_t size;
+            bool mapped;
+
+            mapped_file(const mapped_file&);
+            mapped_file& operator=(const mapped_file&);
+
+        public:
+            mapped_file() : bytes(NULL), size(0U), mapped(false) { }
+
+            explicit mapped_file(const std::string& path)
+                : bytes(NULL), size(0U), mapped(false)
+            {
+                open(path);
+            }
+
+            ~mapped_file() { close(); }
+
+            bool open(const std::string& path)
+            {
+                close();
+
+#if defined(MICROBSON_MMAP)
+                int descriptor = ::open(path.c_str(), O_RDONLY);
+                struct stat status;
+                bool result = false;
+
+                if (descriptor < 0)
+                    return false;
+
+                if (fstat(descriptor, &status) == 0)
+                {
+                    size = static_cast<size_t>(status.st_size);
+                    result = (size == 0U);
+
+                    if (size > 0U)
+                    {
+                        void* address = mmap(
+                            NULL, size, PROT_READ, MAP_SHARED, descriptor, 0
+                        );
+
+                        if (address != MAP_FAILED)
+                        {
+                            bytes = static_cast<byte*>(address);
+                            mapped = true;
+                            result = true;
+                        }
+                        else
+                            size = 0U;
+                    }
+                }
+
+                ::close(descriptor);
+
+                return result;
+#else
+                FILE* file = fopen(path.c_str(), "rb");
+                long length;
+
+                if (file == NULL)
+                    return false;
+
+                fseek(file, 0, SEEK_END);
+                length = ftell(file);
+                fseek(file, 0, SEEK_SET);
+
+                if (length > 0)
+                {
+                    bytes = new byte[length];
+                    size = fread(bytes, 1, length, file);
+                }
+
+                fclose(file);
+
+                return true;
+#endif
+            }
+
+            void close()
+            {
+#if defined(MICROBSON_MMAP)
+                if (mapped)
+                    munmap(bytes, size);
+#else
+                delete[] bytes;
+#endif
+                bytes = NULL;
+                size = 0U;
+                mapped = false;
+            }
+
+            byte* get_bytes() const { return bytes; }
+
+            size_t get_size() const { return size; }
+    };
+
+    // Dumps
+
+    // A sequence of BSON documents stored back to back, as written by
+    // mongodump and friends. Iteration stops at the first truncated or
+    // malformed document.
+    class document_sequence
+    {
+        private:
+            byte* bytes;
+            size_t size;
+
+        public:
+            class const_iterator
+            {
+                private:
+                    byte* bytes;
+                    size_t size;
+                    size_t offset;
+                    size_t length;
+
+                    void check()
+                    {
+                        length = 0U;
+
+                        if (offset + sizeof(int) <= size)
+                        {
+                            int value = *reinterpret_cast<int*>(bytes + offset);
+
+                            if ((value >= 5)
+                                && (offset + value <= size)
+                                && (bytes[offset + value - 1] == 0))
+                                length = value;
+                        }
+
+                        if (length == 0U)
+                            offset = size;
+                    }
+
+                public:
+                    const_iterator()
+                        : bytes(NULL), size(0U), offset(0U), length(0U)
+                    {
+                    }
+
+                    const_iterator(byte* bytes, size_t size, size_t offset)
+                        : bytes(bytes), size(size), offset(offset), length(0U)
+                    {
+                        check();
+                    }
+
+                    document operator*() const
+                    {
+                        return document(bytes + offset, length);
+                    }
+
+                    // Position of the current document within the sequence
+                    size_t get_offset() const { return offset; }
+
+                    const_iterator& operator++()
+                    {
+                        offset += length;
+                        check();
+
+                        return *this;
+                    }
+
+                    bool operator==(const const_iterator& other) const
+                    {
+                        return offset == other.offset;
+                    }
+
+                    bool operator!=(const const_iterator& other) const
+                    {
+                        return offset != other.offset;
+                    }
+            };
+
+            document_sequence() : bytes(NULL), size(0U) { }
+
+            document_sequence(void* bytes, size_t count)
+                : bytes(reinterpret_cast<byte*>(bytes)), size(count)
+            {
+            }
+
+            explicit document_sequence(const mapped_file& file)
+                : bytes(file.get_bytes()), size(file.get_size())
+            {
+            }
+
+            const_iterator begin() const
+            {
+                return const_iterator(bytes, size, 0U);
+            }
+
+            const_iterator end() const
+            {
+                return const_iterator(bytes, size, size);
+            }
+
+            // Iterator positioned at the given offset, as returned by
+            // const_iterator::get_offset().
+            const_iterator seek(size_t offset) const
+            {
+                return const_iterator(bytes, size, offset);
+            }
+
+            document at(size_t offset) const
+            {
+                return *seek(offset);
+            }
+    };
+}
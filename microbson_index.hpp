@@ -0,0 +1,450 @@
+#pragma once
+
+#include "microbson.hpp"
+#include "microbson_dump.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace microbson
+{
+    // Indexes
+
+    // Sorted (value, offset) pairs for one field of a dump, stored so that
+    // the file can be mapped and searched in place:
+    //
+    //   header
+    //   entries    count index_entry, sorted by value then offset
+    //   strings    string indexes only: int32 length + characters
+    //
+    // Integer indexes (int32_node or int64_node) accept both integer types
+    // and keep them as int64; double indexes also accept integers, and
+    // sort NaN after +infinity; string indexes point each entry into the
+    // strings area. Documents whose field is missing or of another type are
+    // not indexed.
+
+    struct index_header
+    {
+        char magic[8];
+        int type;
+        int reserved;
+        long long count;
+        long long strings_offset;
+    };
+
+    struct index_entry
+    {
+        long long key;
+        long long offset;
+    };
+
+    static const char index_magic[8] = { 'B', 'S', 'O', 'N', 'I', 'D', 'X', '1' };
+
+    namespace detail
+    {
+        inline long long double_key(double value)
+        {
+            long long result;
+
+            std::memcpy(&result, &value, sizeof(result));
+            return result;
+        }
+
+        inline double key_double(long long key)
+        {
+            double result;
+
+            std::memcpy(&result, &key, sizeof(result));
+            return result;
+        }
+
+        // Compares two length-prefixed BSON strings.
+        inline int compare_strings(const byte* a, const byte* b)
+        {
+            size_t left = *reinterpret_cast<const int*>(a) - 1;
+            size_t right = *reinterpret_cast<const int*>(b) - 1;
+            int result = std::memcmp(
+                a + sizeof(int), b + sizeof(int), std::min(left, right)
+            );
+
+            if (result == 0)
+                result = (left < right) ? -1 : ((left > right) ? 1 : 0);
+
+            return result;
+        }
+
+        struct entry_order
+        {
+            node_type type;
+            const byte* strings;
+
+            entry_order(node_type type, const byte* strings)
+                : type(type), strings(strings)
+            {
+            }
+
+            int compare(long long a, long long b) const
+            {
+                if (type == string_node)
+                    return compare_strings(strings + a, strings + b);
+
+                if (type == double_node)
+                {
+                    double left = key_double(a);
+                    double right = key_double(b);
+
+                    // NaN after everything else, so the order stays strict
+                    // and weak
+                    if ((left != left) || (right != right))
+                        return (left != left) - (right != right);
+
+                    return (left < right) ? -1 : ((left > right) ? 1 : 0);
+                }
+
+                return (a < b) ? -1 : ((a > b) ? 1 : 0);
+            }
+
+            bool operator()(const index_entry& a, const index_entry& b) const
+            {
+                int result = compare(a.key, b.key);
+
+                return (result < 0) || ((result == 0) && (a.offset < b.offset));
+            }
+        };
+    }
+
+    // Builds an index over one field (a name or a dotted path) of a dump.
+    // Returns false if the type is not indexable or the file can't be
+    // written.
+    inline bool build_index(
+        const document_sequence& sequence,
+        const std::string& path,
+        node_type type,
+        const std::string& index_path
+    )
+    {
+        std::vector<index_entry> entries;
+        byte* base = NULL;
+        index_header header;
+        FILE* file;
+        bool result;
+
+        if ((type != int32_node) && (type != int64_node)
+            && (type != double_node) && (type != string_node))
+            return false;
+
+        for (
+            document_sequence::const_iterator i = sequence.begin();
+            i != sequence.end();
+            ++i
+        )
+        {
+            document source = *i;
+            node _node;
+            index_entry entry;
+
+            if (base == NULL)
+                base = static_cast<byte*>(source.get_bytes()) - i.get_offset();
+
+            if (!source.find(path.c_str(), _node))
+                continue;
+
+            entry.offset = i.get_offset();
+
+            switch (_node.get_type())
+            {
+                case int32_node:
+                    if (type == string_node)
+                        continue;
+
+                    entry.key = *reinterpret_cast<int*>(_node.get_data());
+
+                    if (type == double_node)
+                        entry.key = detail::double_key(static_cast<double>(entry.key));
+                    break;
+                case int64_node:
+                    if (type == string_node)
+                        continue;
+
+                    entry.key = *reinterpret_cast<long long*>(_node.get_data());
+
+                    if (type == double_node)
+                        entry.key = detail::double_key(static_cast<double>(entry.key));
+                    break;
+                case double_node:
+                    if (type != double_node)
+                        continue;
+
+                    entry.key = detail::double_key(
+                        *reinterpret_cast<double*>(_node.get_data())
+                    );
+                    break;
+                case string_node:
+                    if (type != string_node)
+                        continue;
+
+                    // Position of the string within the dump for now
+                    entry.key = static_cast<byte*>(_node.get_data()) - base;
+                    break;
+                default:
+                    continue;
+            }
+
+            entries.push_back(entry);
+        }
+
+        std::sort(entries.begin(), entries.end(), detail::entry_order(type, base));
+
+        if ((file = fopen(index_path.c_str(), "wb")) == NULL)
+            return false;
+
+        std::memcpy(header.magic, index_magic, sizeof(header.magic));
+        header.type = type;
+        header.reserved = 0;
+        header.count = entries.size();
+        header.strings_offset = (type == string_node)
+            ? sizeof(header) + entries.size() * sizeof(index_entry)
+            : 0
+        ;
+
+        result = (fwrite(&header, sizeof(header), 1, file) == 1);
+
+        if (type == string_node)
+        {
+            // Store every distinct string once; equal strings are adjacent.
+            std::vector<index_entry> strings(entries);
+            long long position = 0;
+
+            for (size_t i = 0; i < entries.size(); i++)
+            {
+                if ((i > 0) && (detail::compare_strings(
+                        base + strings[i - 1].key, base + strings[i].key
+                    ) == 0))
+                {
+                    entries[i].key = entries[i - 1].key;
+                    continue;
+                }
+
+                entries[i].key = position;
+                position += sizeof(int) + *reinterpret_cast<int*>(base + strings[i].key) - 1;
+            }
+
+            if (!entries.empty())
+                result &= (fwrite(&entries[0], sizeof(index_entry), entries.size(), file) == entries.size());
+
+            for (size_t i = 0; i < strings.size(); i++)
+            {
+                if ((i > 0) && (entries[i].key == entries[i - 1].key))
+                    continue;
+
+                int length = *reinterpret_cast<int*>(base + strings[i].key) - 1;
+
+                result &= (fwrite(&length, sizeof(int), 1, file) == 1);
+                result &= (fwrite(base + strings[i].key + sizeof(int), 1, length, file) == static_cast<size_t>(length));
+            }
+        }
+        else if (!entries.empty())
+            result &= (fwrite(&entries[0], sizeof(index_entry), entries.size(), file) == entries.size());
+
+        return (fclose(file) == 0) && result;
+    }
+
+    // Searches an index file in place. Lookups return the [first, last)
+    // range of matching entries in O(log n); the matching documents are
+    // then read from the dump in value order.
+    class field_index
+    {
+        private:
+            mapped_file file;
+            const index_header* header;
+            const index_entry* entries;
+
+            // Orders an entry against a probe key, without materializing the
+            // stored string.
+            int compare(const index_entry& entry, long long probe, const std::string* text) const
+            {
+                if (text != NULL)
+                {
+                    const byte* stored = file.get_bytes() + header->strings_offset + entry.key;
+                    size_t length = *reinterpret_cast<const int*>(stored);
+                    int result = std::memcmp(
+                        stored + sizeof(int),
+                        text->data(),
+                        std::min(length, text->length())
+                    );
+
+                    if (result == 0)
+                        result = (length < text->length()) ? -1 : ((length > text->length()) ? 1 : 0);
+
+                    return result;
+                }
+
+                return detail::entry_order(get_type(), NULL).compare(entry.key, probe);
+            }
+
+            // First entry not ordered before the probe (or, if after is set,
+            // the first entry ordered after it)
+            size_t bound(long long probe, const std::string* text, bool after) const
+            {
+                size_t first = 0U;
+                size_t count = get_count();
+
+                while (count > 0U)
+                {
+                    size_t step = count / 2U;
+                    int result = compare(entries[first + step], probe, text);
+
+                    if ((result < 0) || (after && (result == 0)))
+                    {
+                        first += step + 1U;
+                        count -= step + 1U;
+                    }
+                    else
+                        count = step;
+                }
+
+                return first;
+            }
+
+        public:
+            typedef std::pair<size_t, size_t> range;
+
+            field_index() : header(NULL), entries(NULL) { }
+
+            bool open(const std::string& path)
+            {
+                header = NULL;
+                entries = NULL;
+
+                if (!file.open(path) || (file.get_size() < sizeof(index_header)))
+                    return false;
+
+                const index_header* candidate =
+                    reinterpret_cast<const index_header*>(file.get_bytes());
+                const unsigned long long size = file.get_size();
+                const index_entry* candidate_entries =
+                    reinterpret_cast<const index_entry*>(file.get_bytes() + sizeof(index_header));
+
+                if ((std::memcmp(candidate->magic, index_magic, sizeof(index_magic)) != 0)
+                    || ((candidate->type != int32_node) && (candidate->type != int64_node)
+                        && (candidate->type != double_node) && (candidate->type != string_node))
+                    || (candidate->count < 0)
+                    || (static_cast<unsigned long long>(candidate->count) > (size - sizeof(index_header)) / sizeof(index_entry)))
+                    return false;
+
+                // Entries, then the strings they point into
+                if (candidate->type != string_node)
+                {
+                    if (candidate->strings_offset != 0)
+                        return false;
+                }
+                else
+                {
+                    const unsigned long long start = candidate->strings_offset;
+                    unsigned long long length;
+
+                    if ((candidate->strings_offset < 0)
+                        || (start < sizeof(index_header) + candidate->count * sizeof(index_entry))
+                        || (start > size))
+                        return false;
+
+                    length = size - start;
+
+                    for (long long i = 0; i < candidate->count; i++)
+                    {
+                        const long long key = candidate_entries[i].key;
+                        int characters;
+
+                        if ((key < 0)
+                            || (static_cast<unsigned long long>(key) > length)
+                            || (length - key < sizeof(int)))
+                            return false;
+
+                        characters = *reinterpret_cast<const int*>(file.get_bytes() + start + key);
+
+                        if ((characters < 0)
+                            || (static_cast<unsigned long long>(characters) > length - key - sizeof(int)))
+                            return false;
+                    }
+                }
+
+                header = candidate;
+                entries = candidate_entries;
+
+                return true;
+            }
+
+            node_type get_type() const { return static_cast<node_type>(header->type); }
+
+            size_t get_count() const { return static_cast<size_t>(header->count); }
+
+            // Offset within the dump of the document at the given position
+            size_t get_offset(size_t position) const
+            {
+                return static_cast<size_t>(entries[position].offset);
+            }
+
+            // Entries whose value lies in [low, high]
+            range lookup(long long low, long long high) const
+            {
+                if (get_type() == double_node)
+                    return lookup(static_cast<double>(low), static_cast<double>(high));
+
+                if (get_type() == string_node)
+                    return range(0U, 0U);
+
+                return range(bound(low, NULL, false), bound(high, NULL, true));
+            }
+
+            range lookup(int low, int high) const
+            {
+                return lookup(static_cast<long long>(low), static_cast<long long>(high));
+            }
+
+            range lookup(double low, double high) const
+            {
+                if (get_type() != double_node)
+                    return range(0U, 0U);
+
+                return range(
+                    bound(detail::double_key(low), NULL, false),
+                    bound(detail::double_key(high), NULL, true)
+                );
+            }
+
+            range lookup(const std::string& low, const std::string& high) const
+            {
+                if (get_type() != string_node)
+                    return range(0U, 0U);
+
+                return range(bound(0, &low, false), bound(0, &high, true));
+            }
+
+            template<typename T>
+            range lookup(const T& value) const
+            {
+                return lookup(value, value);
+            }
+
+            range lookup(const char* value) const
+            {
+                return lookup(std::string(value), std::string(value));
+            }
+
+            // Appends views of the documents in the given range.
+            void select(
+                const document_sequence& sequence,
+                const range& positions,
+                std::vector<document>& result
+            ) const
+            {
+                for (size_t i = positions.first; i < positions.second; i++)
+                    result.push_back(sequence.at(get_offset(i)));
+            }
+    };
+}
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <cstddef>
+#include <cstring>
+#include <string>
+
+#if __cplusplus >= 201103L
+#define MICROBSON_CONSTEXPR constexpr
+#else
+#define MICROBSON_CONSTEXPR
+#endif
+
+namespace microbson
+{
+    // Element name for lookups in either flavour. Built from a string
+    // literal, its length comes from the array type and its hash (32-bit
+    // FNV-1a) is worked out by the compiler in C++11 and later, once per
+    // construction before that; key objects can be made static to pay for
+    // the hash once. Lookups through a key never build a std::string.
+    // Only the pointer is kept, so the text must outlive the key, and the
+    // literal constructor takes the whole array: use the (text, length)
+    // one for character buffers.
+    class key
+    {
+        private:
+            const char* text;
+            size_t length;
+            unsigned int hash;
+
+        public:
+            // Iterative, for any length
+            static unsigned int get_hash(
+                const char* text,
+                size_t length,
+                unsigned int seed = 2166136261U
+            )
+            {
+                for (size_t i = 0; i < length; i++)
+                    seed = (seed ^ static_cast<unsigned char>(text[i])) * 16777619U;
+
+                return seed;
+            }
+
+#if __cplusplus >= 201103L
+            // Recursive, so that the compiler can work it out for literals
+            static constexpr unsigned int get_literal_hash(
+                const char* text,
+                size_t length,
+                unsigned int seed = 2166136261U
+            )
+            {
+                return (length == 0U)
+                    ? seed
+                    : get_literal_hash(
+                        text + 1,
+                        length - 1U,
+                        (seed ^ static_cast<unsigned char>(*text)) * 16777619U
+                    )
+                ;
+            }
+
+            template<size_t N>
+            explicit constexpr key(const char (&text)[N])
+                : text(text), length(N - 1U), hash(get_literal_hash(text, N - 1U))
+            {
+            }
+#else
+            template<size_t N>
+            explicit key(const char (&text)[N])
+                : text(text), length(N - 1U), hash(get_hash(text, N - 1U))
+            {
+            }
+#endif
+
+            key(const char* text, size_t length)
+                : text(text), length(length), hash(get_hash(text, length))
+            {
+            }
+
+            explicit key(const std::string& text)
+                : text(text.c_str()),
+                length(text.length()),
+                hash(get_hash(text.c_str(), text.length()))
+            {
+            }
+
+            MICROBSON_CONSTEXPR const char* get_text() const { return text; }
+
+            MICROBSON_CONSTEXPR size_t get_length() const { return length; }
+
+            MICROBSON_CONSTEXPR unsigned int get_hash() const { return hash; }
+
+            // Whether a terminated name is this key, rejecting on the first
+            // character before comparing the rest
+            bool matches(const char* name) const
+            {
+                if (length == 0U)
+                    return name[0] == '\0';
+
+                return (name[0] == text[0])
+                    && (strncmp(name + 1, text + 1, length - 1U) == 0)
+                    && (name[length] == '\0');
+            }
+
+            bool operator==(const key& other) const
+            {
+                return (hash == other.hash)
+                    && (length == other.length)
+                    && (memcmp(text, other.text, length) == 0);
+            }
+
+            bool operator!=(const key& other) const { return !(*this == other); }
+    };
+}
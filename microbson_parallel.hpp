@@ -0,0 +1,114 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <pthread.h>
+#include <unistd.h>
+#define MICROBSON_THREADS
+#endif
+
+namespace microbson
+{
+    // Threads
+
+    inline size_t hardware_threads()
+    {
+#if defined(MICROBSON_THREADS) && defined(_SC_NPROCESSORS_ONLN)
+        long count = sysconf(_SC_NPROCESSORS_ONLN);
+
+        return (count > 0) ? static_cast<size_t>(count) : 1U;
+#else
+        return 1U;
+#endif
+    }
+
+    namespace detail
+    {
+        template<typename T>
+        struct parallel_state
+        {
+            T* task;
+            size_t count;
+            size_t next;
+#if defined(MICROBSON_THREADS)
+            pthread_mutex_t mutex;
+#endif
+
+            bool take(size_t& index)
+            {
+                bool result;
+
+#if defined(MICROBSON_THREADS)
+                pthread_mutex_lock(&mutex);
+#endif
+                result = (next < count);
+                index = next++;
+#if defined(MICROBSON_THREADS)
+                pthread_mutex_unlock(&mutex);
+#endif
+
+                return result;
+            }
+
+            static void* run(void* argument)
+            {
+                parallel_state<T>* state = static_cast<parallel_state<T>*>(
+                    argument
+                );
+                size_t index;
+
+                while (state->take(index))
+                    (*state->task)(index);
+
+                return NULL;
+            }
+        };
+    }
+
+    // Calls task(i) for every i in [0, count), spreading the calls over up
+    // to the given number of threads (all the cores when 0). Indexes are
+    // handed out one at a time, so tasks should be coarse. Runs everything
+    // on the calling thread where threads are not available.
+    template<typename T>
+    void parallel_for(size_t count, T& task, size_t threads = 0U)
+    {
+        detail::parallel_state<T> state;
+
+        state.task = &task;
+        state.count = count;
+        state.next = 0U;
+
+        if (threads == 0U)
+            threads = hardware_threads();
+
+        if (threads > count)
+            threads = count;
+
+#if defined(MICROBSON_THREADS)
+        std::vector<pthread_t> workers;
+
+        pthread_mutex_init(&state.mutex, NULL);
+
+        for (size_t i = 1; i < threads; i++)
+        {
+            pthread_t worker;
+
+            if (pthread_create(
+                    &worker, NULL, detail::parallel_state<T>::run, &state
+                ) == 0)
+                workers.push_back(worker);
+        }
+
+        detail::parallel_state<T>::run(&state);
+
+        for (size_t i = 0; i < workers.size(); i++)
+            pthread_join(workers[i], NULL);
+
+        pthread_mutex_destroy(&state.mutex);
+#else
+        detail::parallel_state<T>::run(&state);
+#endif
+    }
+}
@@ -0,0 +1,231 @@
+#pragma once
+
+#include "microbson.hpp"
+
+#include <cstddef>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace microbson
+{
+    // Schema decoding
+
+    // Document decoded by a schema. The fields of the schema are read by
+    // their position in it, with get_field(); the document getters still
+    // work by name.
+    class schema_record : public document
+    {
+        private:
+            std::vector<node> fields;
+
+            friend class schema;
+
+            const node* field(size_t index, node_type type) const
+            {
+                return (index < fields.size())
+                    && (fields[index].bytes != NULL)
+                    && (fields[index].get_type() == type)
+                    ? &fields[index]
+                    : NULL
+                ;
+            }
+
+            template<typename T, typename W>
+                T get_value(size_t index, T _default) const
+                {
+                    const node* _node = field(
+                        index,
+                        static_cast<node_type>(type_converter<T>::node_type_code)
+                    );
+
+                    return (_node != NULL)
+                        ? document::get<T, W>(*_node)
+                        : _default
+                    ;
+                }
+
+        public:
+            // Number of fields in the schema that decoded this record
+            size_t get_field_count() const { return fields.size(); }
+
+            // Whether the field was found with the expected type
+            bool has_field(size_t index) const
+            {
+                return (index < fields.size()) && (fields[index].bytes != NULL);
+            }
+
+            double get_field(size_t index, double _default) const
+            {
+                return get_value<double, double>(index, _default);
+            }
+
+            std::string get_field(size_t index, const std::string& _default) const
+            {
+                const node* _node = field(index, string_node);
+
+                return (_node != NULL) ? get_string(*_node) : _default;
+            }
+
+            std::string get_field(size_t index, const char* _default) const
+            {
+                return get_field(index, std::string(_default));
+            }
+
+            document get_field(size_t index, const document& _default) const
+            {
+                const node* _node = field(index, document_node);
+
+                return (_node != NULL)
+                    ? document(
+                        _node->get_data(),
+                        *reinterpret_cast<int*>(_node->get_data())
+                    )
+                    : _default
+                ;
+            }
+
+            array get_field(size_t index, const array& _default) const
+            {
+                const node* _node = field(index, array_node);
+
+                return (_node != NULL)
+                    ? array(
+                        _node->get_data(),
+                        *reinterpret_cast<int*>(_node->get_data())
+                    )
+                    : _default
+                ;
+            }
+
+            bool get_field(size_t index, bool _default) const
+            {
+                return get_value<bool, byte>(index, _default);
+            }
+
+            int get_field(size_t index, int _default) const
+            {
+                return get_value<int, int>(index, _default);
+            }
+
+            long long get_field(size_t index, long long _default) const
+            {
+                return get_value<long long, long long>(index, _default);
+            }
+
+            object_id get_field(size_t index, const object_id& _default) const
+            {
+                return get_value<object_id, object_id>(index, _default);
+            }
+
+            utc_datetime get_field(size_t index, const utc_datetime& _default) const
+            {
+                return get_value<utc_datetime, utc_datetime>(index, _default);
+            }
+    };
+
+    // Expected (name, type) pairs of documents whose producer always writes
+    // the same fields in the same order. The element headers (type byte and
+    // name) are precompiled into one byte sequence, so decode() checks that
+    // the next element is the expected one with a single memcmp. When it
+    // isn't, the field is looked up by name and decoding carries on after
+    // the element found there. Hits and misses are counted across calls;
+    // a schema is meant to be used by one thread at a time.
+    class schema
+    {
+        private:
+            std::vector<byte> headers;
+            std::vector<size_t> offsets;
+            size_t hits;
+            size_t misses;
+
+            bool lookup(
+                const document& source,
+                size_t index,
+                document::const_iterator& position
+            ) const
+            {
+                const char* name = reinterpret_cast<const char*>(
+                    &headers[offsets[index] + 1U]
+                );
+
+                for (position = source.begin(); position != source.end(); ++position)
+                    if (strcmp(position->get_name(), name) == 0)
+                        return position->get_type() == headers[offsets[index]];
+
+                return false;
+            }
+
+        public:
+            schema() : hits(0U), misses(0U)
+            {
+                offsets.push_back(0U);
+            }
+
+            schema& add(const std::string& name, node_type type)
+            {
+                headers.push_back(static_cast<byte>(type));
+                headers.insert(headers.end(), name.begin(), name.end());
+                headers.push_back(0);
+                offsets.push_back(headers.size());
+
+                return (*this);
+            }
+
+            size_t size() const { return offsets.size() - 1U; }
+
+            // Fills result with the fields of source, in one pass when they
+            // come in the expected order. Returns how many were found with
+            // the expected type.
+            size_t decode(const document& source, schema_record& result)
+            {
+                document::const_iterator next = source.begin();
+                size_t found = 0U;
+
+                static_cast<document&>(result) = source;
+                result.fields.assign(size(), node());
+
+                for (size_t i = 0; i < size(); i++)
+                {
+                    const byte* header = &headers[offsets[i]];
+
+                    // Type, then name: the element may be shorter than the
+                    // expected header
+                    if ((next != source.end())
+                        && (next->bytes[0] == header[0])
+                        && (strcmp(next->get_name(), reinterpret_cast<const char*>(header + 1)) == 0))
+                    {
+                        result.fields[i] = *next;
+                        ++next;
+                        hits++;
+                        found++;
+                    }
+                    else
+                    {
+                        document::const_iterator position;
+
+                        misses++;
+
+                        if (lookup(source, i, position))
+                        {
+                            result.fields[i] = *position;
+                            next = ++position;
+                            found++;
+                        }
+                    }
+                }
+
+                return found;
+            }
+
+            size_t get_hits() const { return hits; }
+
+            size_t get_misses() const { return misses; }
+
+            void reset_counts()
+            {
+                hits = 0U;
+                misses = 0U;
+            }
+    };
+}
@@ -0,0 +1,442 @@
+#pragma once
+
+#include "microbson.hpp"
+#include "microbson_parallel.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace microbson
+{
+    // Frozen documents
+
+    // Immutable copy of a serialized document. The top-level names can be
+    // indexed once up front, in which case the name based getters below
+    // binary search instead of scanning. Nothing is written after
+    // construction, so any number of threads may read one at the same time.
+    class frozen_document : public document
+    {
+        private:
+            struct entry
+            {
+                const char* name;
+                byte* element;
+            };
+
+            struct entry_order
+            {
+                bool operator()(const entry& a, const entry& b) const
+                {
+                    return strcmp(a.name, b.name) < 0;
+                }
+            };
+
+            std::vector<byte> storage;
+            std::vector<entry> entries;
+            bool indexed;
+
+            frozen_document(const frozen_document&);
+            frozen_document& operator=(const frozen_document&);
+
+            void freeze(bool index)
+            {
+                bytes = storage.empty() ? NULL : &storage[0];
+                size = storage.size();
+                indexed = index;
+
+                if (!index)
+                    return;
+
+                for (const_iterator i = begin(); i != end(); ++i)
+                {
+                    entry _entry;
+
+                    _entry.name = i->get_name();
+                    _entry.element = i->bytes;
+                    entries.push_back(_entry);
+                }
+
+                // Stable, so repeated names resolve to the first one as a
+                // scan would
+                std::stable_sort(entries.begin(), entries.end(), entry_order());
+            }
+
+            bool lookup(const char* name, node& result) const
+            {
+                if (!indexed)
+                    return document::lookup(name, result);
+
+                entry key;
+
+                key.name = name;
+                key.element = NULL;
+
+                std::vector<entry>::const_iterator i = std::lower_bound(
+                    entries.begin(), entries.end(), key, entry_order()
+                );
+
+                if ((i == entries.end()) || (strcmp(i->name, name) != 0))
+                    return false;
+
+                result = node(i->element);
+                return true;
+            }
+
+            template<typename T, typename W>
+                T get_indexed(const std::string& name, T _default) const
+                {
+                    node _node;
+
+                    return lookup(name.c_str(), _node)
+                        ? document::get<T, W>(_node)
+                        : _default
+                    ;
+                }
+
+        public:
+            frozen_document(
+                const void* bytes,
+                size_t count,
+                bool index = true
+            )
+                : storage(
+                    static_cast<const byte*>(bytes),
+                    static_cast<const byte*>(bytes) + count
+                )
+            {
+                freeze(index);
+            }
+
+            // Serializes anything with get_serialized_size() and
+            // serialize(), such as a minibson::document, and indexes it.
+            template<typename T>
+            explicit frozen_document(const T& source)
+                : storage(source.get_serialized_size())
+            {
+                if (!storage.empty())
+                    source.serialize(&storage[0], storage.size());
+
+                freeze(true);
+            }
+
+            bool is_indexed() const { return indexed; }
+
+            double get(const std::string& name, double _default) const
+            {
+                return get_indexed<double, double>(name, _default);
+            }
+
+            std::string get(
+                const std::string& name,
+                const std::string& _default
+            ) const
+            {
+                node _node;
+
+                return lookup(name.c_str(), _node)
+                    ? get_string(_node)
+                    : _default
+                ;
+            }
+
+            document get(
+                const std::string& name,
+                const document& _default
+            ) const
+            {
+                node _node;
+
+                return lookup(name.c_str(), _node)
+                    ? document(
+                        _node.get_data(),
+                        *reinterpret_cast<int*>(_node.get_data())
+                    )
+                    : _default
+                ;
+            }
+
+            array get(const std::string& name, const array& _default) const
+            {
+                node _node;
+
+                return lookup(name.c_str(), _node)
+                    ? array(
+                        _node.get_data(),
+                        *reinterpret_cast<int*>(_node.get_data())
+                    )
+                    : _default
+                ;
+            }
+
+            std::pair<void*, size_t> get(const std::string& name) const
+            {
+                node _node;
+                std::pair<void*, size_t> result(NULL, 0U);
+
+                if (lookup(name.c_str(), _node))
+                {
+                    result.second = *reinterpret_cast<int*>(_node.get_data());
+                    result.first = reinterpret_cast<byte*>(_node.get_data()) + 5U;
+                }
+
+                return result;
+            }
+
+            bool get(const std::string& name, bool _default) const
+            {
+                return get_indexed<bool, byte>(name, _default);
+            }
+
+            int get(const std::string& name, int _default) const
+            {
+                return get_indexed<int, int>(name, _default);
+            }
+
+            long long get(const std::string& name, long long _default) const
+            {
+                return get_indexed<long long, long long>(name, _default);
+            }
+
+            object_id get(const std::string& name, const object_id& _default) const
+            {
+                return get_indexed<object_id, object_id>(name, _default);
+            }
+
+            utc_datetime get(
+                const std::string& name,
+                const utc_datetime& _default
+            ) const
+            {
+                return get_indexed<utc_datetime, utc_datetime>(name, _default);
+            }
+
+            bool contains(const std::string& name) const
+            {
+                node _node;
+
+                return lookup(name.c_str(), _node);
+            }
+
+            template<typename T>
+            bool contains(const std::string& name) const
+            {
+                node _node;
+
+                return lookup(name.c_str(), _node)
+                    && (_node.get_type() == static_cast<node_type>(
+                        type_converter<T>::node_type_code
+                    ));
+            }
+    };
+
+    // Sharing
+
+    namespace detail
+    {
+#if defined(MICROBSON_THREADS)
+        inline unsigned long atomic_load(const unsigned long& value)
+        {
+            return __atomic_load_n(&value, __ATOMIC_ACQUIRE);
+        }
+
+        inline void atomic_store(unsigned long& value, unsigned long update)
+        {
+            __atomic_store_n(&value, update, __ATOMIC_RELEASE);
+        }
+
+        inline unsigned long atomic_add(unsigned long& value, long delta)
+        {
+            return __atomic_add_fetch(&value, delta, __ATOMIC_ACQ_REL);
+        }
+#else
+        inline unsigned long atomic_load(const unsigned long& value)
+        {
+            return value;
+        }
+
+        inline void atomic_store(unsigned long& value, unsigned long update)
+        {
+            value = update;
+        }
+
+        inline unsigned long atomic_add(unsigned long& value, long delta)
+        {
+            return value += delta;
+        }
+#endif
+    }
+
+    // Reference counted handle to a published frozen_document. Copying and
+    // destroying handles only touches an atomic counter; the document is
+    // deleted with its last handle.
+    class snapshot
+    {
+        private:
+            struct shared
+            {
+                const frozen_document* document;
+                unsigned long version;
+                unsigned long references;
+            };
+
+            shared* state;
+
+            void release()
+            {
+                if ((state != NULL) && (detail::atomic_add(state->references, -1) == 0U))
+                {
+                    delete state->document;
+                    delete state;
+                }
+            }
+
+            friend class snapshot_publisher;
+
+        public:
+            snapshot() : state(NULL) { }
+
+            snapshot(const snapshot& other) : state(other.state)
+            {
+                if (state != NULL)
+                    detail::atomic_add(state->references, 1);
+            }
+
+            snapshot& operator=(const snapshot& other)
+            {
+                if (other.state != NULL)
+                    detail::atomic_add(other.state->references, 1);
+
+                release();
+                state = other.state;
+                return (*this);
+            }
+
+            ~snapshot() { release(); }
+
+            bool valid() const { return state != NULL; }
+
+            // 0 for an empty handle, otherwise the number given by publish()
+            unsigned long get_version() const
+            {
+                return (state != NULL) ? state->version : 0U;
+            }
+
+            const frozen_document& operator*() const { return *state->document; }
+
+            const frozen_document* operator->() const { return state->document; }
+    };
+
+    // Holds the current snapshot. publish() swaps in a new document under a
+    // mutex and bumps an atomic version number; get() takes the mutex to
+    // copy the current handle. Threads that read on every request should go
+    // through a snapshot_reader instead.
+    class snapshot_publisher
+    {
+        private:
+            snapshot current;
+            unsigned long version;
+#if defined(MICROBSON_THREADS)
+            mutable pthread_mutex_t mutex;
+#endif
+
+            snapshot_publisher(const snapshot_publisher&);
+            snapshot_publisher& operator=(const snapshot_publisher&);
+
+            void lock() const
+            {
+#if defined(MICROBSON_THREADS)
+                pthread_mutex_lock(&mutex);
+#endif
+            }
+
+            void unlock() const
+            {
+#if defined(MICROBSON_THREADS)
+                pthread_mutex_unlock(&mutex);
+#endif
+            }
+
+        public:
+            snapshot_publisher() : version(0U)
+            {
+#if defined(MICROBSON_THREADS)
+                pthread_mutex_init(&mutex, NULL);
+#endif
+            }
+
+            ~snapshot_publisher()
+            {
+#if defined(MICROBSON_THREADS)
+                pthread_mutex_destroy(&mutex);
+#endif
+            }
+
+            // Takes ownership of the document. Readers holding the previous
+            // snapshot keep it until they let go of their handles. Returns
+            // the new version.
+            unsigned long publish(const frozen_document* document)
+            {
+                snapshot next;
+                unsigned long result;
+
+                next.state = new snapshot::shared;
+                next.state->document = document;
+                next.state->references = 1U;
+
+                lock();
+                result = next.state->version = version + 1U;
+                std::swap(current.state, next.state);
+                detail::atomic_store(version, result);
+                unlock();
+
+                return result;
+            }
+
+            snapshot get() const
+            {
+                snapshot result;
+
+                lock();
+                result = current;
+                unlock();
+
+                return result;
+            }
+
+            unsigned long get_version() const
+            {
+                return detail::atomic_load(version);
+            }
+    };
+
+    // Per-thread view of a publisher. get() checks the published version
+    // with a single atomic load and only goes to the publisher, once, after
+    // a new snapshot was published; in between, reads neither lock nor
+    // allocate. Not to be shared between threads.
+    class snapshot_reader
+    {
+        private:
+            const snapshot_publisher* publisher;
+            snapshot current;
+
+        public:
+            explicit snapshot_reader(const snapshot_publisher& publisher)
+                : publisher(&publisher)
+            {
+            }
+
+            // The handle stays valid, and keeps its document alive, until
+            // the next call.
+            const snapshot& get()
+            {
+                if (publisher->get_version() != current.get_version())
+                    current = publisher->get();
+
+                return current;
+            }
+    };
+}
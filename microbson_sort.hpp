@@ -0,0 +1,574 @@
+#pragma once
+
+#include "microbson.hpp"
+#include "microbson_dump.hpp"
+#include "microbson_parallel.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace microbson
+{
+    // Value ordering
+
+    namespace detail
+    {
+        enum { max_key_rank = 512 };
+
+        // Position of a type in MongoDB's cross-type ordering; missing
+        // fields sort as null. Types MongoDB doesn't order this way
+        // (undefined, DBPointer, JavaScript, decimal128) come after regular
+        // expressions, by type code.
+        inline int type_rank(const node& _node)
+        {
+            if (_node.bytes == NULL)
+                return 1;
+
+            switch (_node.get_type())
+            {
+                case min_key_node: return 0;
+                case null_node: return 1;
+                case int32_node:
+                case int64_node:
+                case double_node: return 2;
+                case string_node:
+                case symbol_node: return 3;
+                case document_node: return 4;
+                case array_node: return 5;
+                case binary_node: return 6;
+                case objectid_node: return 7;
+                case boolean_node: return 8;
+                case datetime_node: return 9;
+                case timestamp_node: return 10;
+                case regex_node: return 11;
+                case max_key_node: return max_key_rank;
+                default: return 16 + _node.get_type();
+            }
+        }
+
+        inline bool integer_value(const node& _node, long long& value)
+        {
+            if (_node.get_type() == int32_node)
+                value = *reinterpret_cast<int*>(_node.get_data());
+            else if (_node.get_type() == int64_node)
+                value = *reinterpret_cast<long long*>(_node.get_data());
+            else
+                return false;
+
+            return true;
+        }
+
+        inline double double_value(const node& _node)
+        {
+            long long value;
+
+            return integer_value(_node, value)
+                ? static_cast<double>(value)
+                : *reinterpret_cast<double*>(_node.get_data())
+            ;
+        }
+    }
+
+    // Orders two field values (a default-constructed node stands for a
+    // missing field): by type class first, then numerically across int32,
+    // int64 and double with NaN before every other number, by time for
+    // datetimes and timestamps, bytewise for strings and by raw bytes
+    // otherwise.
+    inline int compare_values(const node& a, const node& b)
+    {
+        int left = detail::type_rank(a);
+        int right = detail::type_rank(b);
+
+        if (left != right)
+            return (left < right) ? -1 : 1;
+
+        switch (left)
+        {
+            case 0:
+            case 1:
+            case detail::max_key_rank:
+                return 0;
+            case 2:
+                {
+                    long long x;
+                    long long y;
+
+                    if (detail::integer_value(a, x) && detail::integer_value(b, y))
+                        return (x < y) ? -1 : ((x > y) ? 1 : 0);
+
+                    double u = detail::double_value(a);
+                    double v = detail::double_value(b);
+
+                    // NaN first, as MongoDB does, so the order stays
+                    // strict and weak
+                    if ((u != u) || (v != v))
+                        return (v != v) - (u != u);
+
+                    return (u < v) ? -1 : ((u > v) ? 1 : 0);
+                }
+            case 9:
+                {
+                    long long x = *reinterpret_cast<long long*>(a.get_data());
+                    long long y = *reinterpret_cast<long long*>(b.get_data());
+
+                    return (x < y) ? -1 : ((x > y) ? 1 : 0);
+                }
+            case 10:
+                {
+                    unsigned long long x = *reinterpret_cast<unsigned long long*>(a.get_data());
+                    unsigned long long y = *reinterpret_cast<unsigned long long*>(b.get_data());
+
+                    return (x < y) ? -1 : ((x > y) ? 1 : 0);
+                }
+            default:
+                {
+                    const byte* x = static_cast<const byte*>(a.get_data());
+                    const byte* y = static_cast<const byte*>(b.get_data());
+                    size_t m = a.get_size() - (x - a.bytes);
+                    size_t n = b.get_size() - (y - b.bytes);
+
+                    if (left == 3)
+                    {
+                        // Skip the length prefixes and terminators
+                        x += sizeof(int);
+                        y += sizeof(int);
+                        m -= sizeof(int) + 1U;
+                        n -= sizeof(int) + 1U;
+                    }
+
+                    int result = std::memcmp(x, y, std::min(m, n));
+
+                    if (result == 0)
+                        result = (m < n) ? -1 : ((m > n) ? 1 : 0);
+
+                    return result;
+                }
+        }
+    }
+
+    // Sorting
+
+    // Sorts dump files that don't fit in memory by one or more field paths.
+    // The input is cut into runs of at most memory_budget / threads bytes;
+    // runs are sorted on parallel threads and written next to the output,
+    // then merged through a loser tree, at most max_fan_in runs at a time.
+    // Documents are copied byte for byte and equal keys keep their input
+    // order.
+    class external_sort
+    {
+        private:
+            struct key
+            {
+                std::string path;
+                bool ascending;
+            };
+
+            struct entry
+            {
+                byte* bytes;
+                size_t length;
+                size_t keys;
+            };
+
+            struct chunk
+            {
+                size_t begin;
+                size_t end;
+            };
+
+            std::vector<key> keys;
+            size_t memory_budget;
+            size_t threads;
+            size_t max_fan_in;
+
+            struct entry_order
+            {
+                const external_sort* owner;
+                const std::vector<node>* nodes;
+
+                bool operator()(const entry& a, const entry& b) const
+                {
+                    return owner->compare(
+                        &(*nodes)[a.keys], &(*nodes)[b.keys]
+                    ) < 0;
+                }
+            };
+
+            // Sorts one chunk of the input into a file
+            struct run_task
+            {
+                const external_sort* owner;
+                const document_sequence* input;
+                const std::vector<chunk>* chunks;
+                const std::vector<std::string>* paths;
+                std::vector<char> results;
+
+                void operator()(size_t index)
+                {
+                    const chunk& _chunk = (*chunks)[index];
+                    document_sequence::const_iterator i = input->seek(_chunk.begin);
+                    std::vector<entry> entries;
+                    std::vector<node> nodes;
+                    entry_order order;
+                    FILE* file;
+                    bool result;
+
+                    for (; i.get_offset() < _chunk.end; ++i)
+                    {
+                        document source = *i;
+                        entry _entry;
+
+                        _entry.bytes = static_cast<byte*>(source.get_bytes());
+                        _entry.length = source.get_size();
+                        _entry.keys = nodes.size();
+                        owner->extract(source, nodes);
+                        entries.push_back(_entry);
+                    }
+
+                    order.owner = owner;
+                    order.nodes = &nodes;
+                    std::stable_sort(entries.begin(), entries.end(), order);
+
+                    if ((file = fopen((*paths)[index].c_str(), "wb")) == NULL)
+                    {
+                        results[index] = 0;
+                        return;
+                    }
+
+                    result = true;
+
+                    for (size_t j = 0; j < entries.size(); j++)
+                        result &= (fwrite(entries[j].bytes, 1, entries[j].length, file) == entries[j].length);
+
+                    results[index] = (fclose(file) == 0) && result;
+                }
+            };
+
+            // Tournament over the heads of the runs. losers[0] holds the
+            // current winner and every other slot the loser of the match
+            // played at that node; count stands for "before everything" and
+            // is only used while building the tree.
+            class loser_tree
+            {
+                private:
+                    const external_sort* owner;
+                    std::vector<document_sequence::const_iterator> heads;
+                    std::vector<document_sequence::const_iterator> ends;
+                    std::vector<node> nodes;
+                    std::vector<size_t> losers;
+                    size_t count;
+
+                    bool done(size_t run) const
+                    {
+                        return heads[run] == ends[run];
+                    }
+
+                    bool before(size_t a, size_t b) const
+                    {
+                        if (a == count)
+                            return true;
+
+                        if ((b == count) || done(a))
+                            return false;
+
+                        if (done(b))
+                            return true;
+
+                        int result = owner->compare(
+                            &nodes[a * owner->get_key_count()],
+                            &nodes[b * owner->get_key_count()]
+                        );
+
+                        return (result < 0) || ((result == 0) && (a < b));
+                    }
+
+                    void load(size_t run)
+                    {
+                        std::vector<node> _nodes;
+
+                        if (done(run))
+                            return;
+
+                        owner->extract(*heads[run], _nodes);
+                        std::copy(
+                            _nodes.begin(),
+                            _nodes.end(),
+                            nodes.begin() + run * owner->get_key_count()
+                        );
+                    }
+
+                    void adjust(size_t run)
+                    {
+                        for (size_t t = (run + count) / 2; t > 0; t /= 2)
+                            if (before(losers[t], run))
+                                std::swap(run, losers[t]);
+
+                        losers[0] = run;
+                    }
+
+                public:
+                    loser_tree(
+                        const external_sort* owner,
+                        const std::vector<document_sequence>& runs
+                    )
+                        : owner(owner),
+                        nodes(runs.size() * owner->get_key_count()),
+                        losers(runs.size(), runs.size()),
+                        count(runs.size())
+                    {
+                        for (size_t i = 0; i < count; i++)
+                        {
+                            heads.push_back(runs[i].begin());
+                            ends.push_back(runs[i].end());
+                            load(i);
+                        }
+
+                        for (size_t i = count; i > 0; i--)
+                            adjust(i - 1);
+                    }
+
+                    bool empty() const
+                    {
+                        return (count == 0U) || done(losers[0]);
+                    }
+
+                    document top() const { return *heads[losers[0]]; }
+
+                    void pop()
+                    {
+                        size_t run = losers[0];
+
+                        ++heads[run];
+                        load(run);
+                        adjust(run);
+                    }
+            };
+
+            static void remove_files(const std::vector<std::string>& paths)
+            {
+                for (size_t i = 0; i < paths.size(); i++)
+                    std::remove(paths[i].c_str());
+            }
+
+            // Merges already sorted dumps into one file in a single pass
+            bool merge_files(
+                const std::vector<std::string>& inputs,
+                const std::string& output_path
+            ) const
+            {
+                std::vector<mapped_file*> files;
+                std::vector<document_sequence> runs;
+                FILE* output;
+                bool result = true;
+
+                for (size_t i = 0; i < inputs.size(); i++)
+                {
+                    files.push_back(new mapped_file());
+                    result &= files.back()->open(inputs[i]);
+                    runs.push_back(document_sequence(*files.back()));
+                }
+
+                if (result && ((output = fopen(output_path.c_str(), "wb")) != NULL))
+                {
+                    loser_tree tree(this, runs);
+
+                    for (; !tree.empty(); tree.pop())
+                    {
+                        document top = tree.top();
+
+                        result &= (fwrite(top.get_bytes(), 1, top.get_size(), output) == top.get_size());
+                    }
+
+                    result &= (fclose(output) == 0);
+                }
+                else
+                    result = false;
+
+                for (size_t i = 0; i < files.size(); i++)
+                    delete files[i];
+
+                return result;
+            }
+
+        public:
+            external_sort(size_t memory_budget = 64U << 20, size_t threads = 0U)
+                : memory_budget(memory_budget),
+                threads((threads == 0U) ? hardware_threads() : threads),
+                max_fan_in(64U)
+            {
+            }
+
+            void add_key(const std::string& path, bool ascending = true)
+            {
+                key _key;
+
+                _key.path = path;
+                _key.ascending = ascending;
+                keys.push_back(_key);
+            }
+
+            size_t get_key_count() const { return keys.size(); }
+
+            size_t get_max_fan_in() const { return max_fan_in; }
+
+            // Limits the files open at once while merging; at least 2
+            void set_max_fan_in(size_t value) { max_fan_in = std::max<size_t>(value, 2U); }
+
+            // Appends the key values of a document, one node per key.
+            void extract(const document& source, std::vector<node>& result) const
+            {
+                for (size_t i = 0; i < keys.size(); i++)
+                {
+                    node _node;
+
+                    if (!source.find(keys[i].path.c_str(), _node))
+                        _node = node();
+
+                    result.push_back(_node);
+                }
+            }
+
+            // Compares two sets of key values as appended by extract().
+            int compare(const node* a, const node* b) const
+            {
+                for (size_t i = 0; i < keys.size(); i++)
+                {
+                    int result = compare_values(a[i], b[i]);
+
+                    if (result != 0)
+                        return keys[i].ascending ? result : -result;
+                }
+
+                return 0;
+            }
+
+            // Sorts the documents of a dump into a new file. Returns false
+            // if any file can't be read or written.
+            bool run(const std::string& input_path, const std::string& output_path) const
+            {
+                mapped_file file;
+                std::vector<chunk> chunks;
+                std::vector<std::string> paths;
+                size_t limit = std::max<size_t>(memory_budget / threads, 1U);
+                bool result = true;
+
+                if (!file.open(input_path))
+                    return false;
+
+                document_sequence input(file);
+
+                for (
+                    document_sequence::const_iterator i = input.begin();
+                    i != input.end();
+                    ++i
+                )
+                {
+                    if (chunks.empty()
+                        || (i.get_offset() - chunks.back().begin >= limit))
+                    {
+                        chunk _chunk;
+
+                        _chunk.begin = i.get_offset();
+                        chunks.push_back(_chunk);
+                    }
+
+                    chunks.back().end = i.get_offset() + (*i).get_size();
+                }
+
+                // A single run is the output itself
+                if (chunks.size() <= 1U)
+                    paths.push_back(output_path);
+                else
+                    for (size_t i = 0; i < chunks.size(); i++)
+                    {
+                        char suffix[32];
+
+                        std::sprintf(suffix, ".run%lu", static_cast<unsigned long>(i));
+                        paths.push_back(output_path + suffix);
+                    }
+
+                if (chunks.empty())
+                {
+                    FILE* output = fopen(output_path.c_str(), "wb");
+
+                    return (output != NULL) && (fclose(output) == 0);
+                }
+
+                run_task task;
+
+                task.owner = this;
+                task.input = &input;
+                task.chunks = &chunks;
+                task.paths = &paths;
+                task.results.assign(chunks.size(), 1);
+                parallel_for(chunks.size(), task, threads);
+
+                for (size_t i = 0; i < chunks.size(); i++)
+                    result &= (task.results[i] != 0);
+
+                if (chunks.size() > 1U)
+                {
+                    if (result)
+                        result = merge(paths, output_path);
+
+                    remove_files(paths);
+                }
+
+                return result;
+            }
+
+            // Merges already sorted dumps into one file, at most max_fan_in
+            // of them at a time: larger sets are merged in several passes
+            // through intermediate files next to the output.
+            bool merge(
+                const std::vector<std::string>& inputs,
+                const std::string& output_path
+            ) const
+            {
+                std::vector<std::string> current(inputs);
+                size_t pass = 0U;
+                bool result = true;
+
+                for (; result && (current.size() > max_fan_in); pass++)
+                {
+                    std::vector<std::string> next;
+
+                    for (size_t i = 0; result && (i < current.size()); i += max_fan_in)
+                    {
+                        const std::vector<std::string> group(
+                            current.begin() + i,
+                            current.begin() + std::min(i + max_fan_in, current.size())
+                        );
+                        char suffix[64];
+
+                        std::sprintf(
+                            suffix,
+                            ".merge%lu.%lu",
+                            static_cast<unsigned long>(pass),
+                            static_cast<unsigned long>(i / max_fan_in)
+                        );
+                        next.push_back(output_path + suffix);
+                        result = merge_files(group, next.back());
+                    }
+
+                    // The inputs of the first pass are the caller's
+                    if (pass > 0U)
+                        remove_files(current);
+
+                    current.swap(next);
+                }
+
+                if (result)
+                    result = merge_files(current, output_path);
+
+                if (pass > 0U)
+                    remove_files(current);
+
+                return result;
+            }
+    };
+}
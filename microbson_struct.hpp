@@ -0,0 +1,390 @@
+#pragma once
+
+#include "microbson.hpp"
+
+#include <cstddef>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// Struct bindings
+//
+// A binding lists the fields of a struct, in the order they are written:
+//
+//     MICROBSON_BINDING(point)
+//         MICROBSON_FIELD(x)
+//         MICROBSON_FIELD(y)
+//         MICROBSON_NAMED_FIELD(label, "_label")
+//     MICROBSON_BINDING_END
+//
+// at global scope. microbson::encode() then writes bound structs straight
+// to BSON, and microbson::decode() reads a document into one, with no tree
+// in between. Fields may be int, long long, double, bool, std::string,
+// object_id, utc_datetime, other bound structs (as embedded documents) and
+// std::vectors of any of these (as arrays).
+
+#define MICROBSON_BINDING(type) \
+    namespace microbson \
+    { \
+        template<> struct binding<type> \
+        { \
+            template<typename V, typename S> \
+            static void fields(V& visitor, S& value) \
+            {
+
+#define MICROBSON_NAMED_FIELD(member, name) visitor(name, value.member);
+
+#define MICROBSON_FIELD(member) MICROBSON_NAMED_FIELD(member, #member)
+
+#define MICROBSON_BINDING_END \
+            } \
+        }; \
+    }
+
+namespace microbson
+{
+    // Specialized by MICROBSON_BINDING
+    template<typename T> struct binding { };
+
+    namespace detail
+    {
+        template<typename T> struct field_codec;
+
+        // Fixed size values, stored as they are
+        template<typename T, node_type N>
+        struct fixed_codec
+        {
+            enum { type = N };
+
+            static size_t size(const T&) { return sizeof(T); }
+
+            static size_t write(const T& value, byte* buffer)
+            {
+                memcpy(buffer, &value, sizeof(T));
+                return sizeof(T);
+            }
+
+            static bool read(const node& element, T& value)
+            {
+                if (element.get_type() != N)
+                    return false;
+
+                memcpy(&value, element.get_data(), sizeof(T));
+                return true;
+            }
+        };
+
+        template<> struct field_codec<int> : fixed_codec<int, int32_node> { };
+
+        template<> struct field_codec<long long>
+            : fixed_codec<long long, int64_node> { };
+
+        template<> struct field_codec<double>
+            : fixed_codec<double, double_node> { };
+
+        template<> struct field_codec<object_id>
+            : fixed_codec<object_id, objectid_node> { };
+
+        template<> struct field_codec<utc_datetime>
+            : fixed_codec<utc_datetime, datetime_node> { };
+
+        template<> struct field_codec<bool>
+        {
+            enum { type = boolean_node };
+
+            static size_t size(const bool&) { return 1U; }
+
+            static size_t write(const bool& value, byte* buffer)
+            {
+                *buffer = value ? 1 : 0;
+                return 1U;
+            }
+
+            static bool read(const node& element, bool& value)
+            {
+                if (element.get_type() != boolean_node)
+                    return false;
+
+                value = *static_cast<byte*>(element.get_data()) != 0;
+                return true;
+            }
+        };
+
+        template<> struct field_codec<std::string>
+        {
+            enum { type = string_node };
+
+            static size_t size(const std::string& value)
+            {
+                return sizeof(int) + value.length() + 1U;
+            }
+
+            static size_t write(const std::string& value, byte* buffer)
+            {
+                const int length = static_cast<int>(value.length() + 1U);
+
+                memcpy(buffer, &length, sizeof(int));
+                memcpy(buffer + sizeof(int), value.c_str(), length);
+                return sizeof(int) + length;
+            }
+
+            static bool read(const node& element, std::string& value)
+            {
+                const byte* data = static_cast<byte*>(element.get_data());
+                int length;
+
+                if (element.get_type() != string_node)
+                    return false;
+
+                memcpy(&length, data, sizeof(int));
+                value.assign(
+                    reinterpret_cast<const char*>(data) + sizeof(int),
+                    length - 1
+                );
+                return true;
+            }
+        };
+
+        struct size_visitor
+        {
+            size_t size;
+
+            size_visitor() : size(sizeof(int) + 1U) { }
+
+            template<size_t N, typename T>
+            void operator()(const char (&)[N], const T& field)
+            {
+                size += 1U + N + field_codec<T>::size(field);
+            }
+        };
+
+        struct write_visitor
+        {
+            byte* position;
+
+            explicit write_visitor(byte* position) : position(position) { }
+
+            template<size_t N, typename T>
+            void operator()(const char (&name)[N], const T& field)
+            {
+                *position++ = static_cast<byte>(field_codec<T>::type);
+                memcpy(position, name, N);
+                position += N;
+                position += field_codec<T>::write(field, position);
+            }
+        };
+
+        inline bool find(const document& source, const char* name, node& result)
+        {
+            for (document::const_iterator i = source.begin(); i != source.end(); ++i)
+                if (strcmp(i->get_name(), name) == 0)
+                {
+                    result = *i;
+                    return true;
+                }
+
+            return false;
+        }
+
+        // Expects the fields in binding order, as encode() writes them, and
+        // only searches the document for those that aren't next.
+        struct read_visitor
+        {
+            const document* source;
+            document::const_iterator next;
+            size_t count;
+
+            explicit read_visitor(const document& source)
+                : source(&source), next(source.begin()), count(0U)
+            {
+            }
+
+            template<size_t N, typename T>
+            void operator()(const char (&name)[N], T& field)
+            {
+                node element;
+
+                if ((next != source->end())
+                    && (strcmp(next->get_name(), name) == 0))
+                {
+                    element = *next;
+                    ++next;
+                }
+                else if (!find(*source, name, element))
+                    return;
+
+                if (field_codec<T>::read(element, field))
+                    count++;
+            }
+        };
+
+        // Writes the elements the visit produces as a document
+        template<typename T>
+        size_t write_document(const T& value, byte* buffer)
+        {
+            write_visitor visitor(buffer + sizeof(int));
+            int length;
+
+            binding<T>::fields(visitor, value);
+            *visitor.position++ = 0;
+            length = static_cast<int>(visitor.position - buffer);
+            memcpy(buffer, &length, sizeof(int));
+
+            return length;
+        }
+
+        // Bound structs
+        template<typename T>
+        struct field_codec
+        {
+            enum { type = document_node };
+
+            static size_t size(const T& value)
+            {
+                size_visitor visitor;
+
+                binding<T>::fields(visitor, value);
+                return visitor.size;
+            }
+
+            static size_t write(const T& value, byte* buffer)
+            {
+                return write_document(value, buffer);
+            }
+
+            static bool read(const node& element, T& value)
+            {
+                if (element.get_type() != document_node)
+                    return false;
+
+                const document source(
+                    element.get_data(),
+                    *static_cast<int*>(element.get_data())
+                );
+                read_visitor visitor(source);
+
+                binding<T>::fields(visitor, value);
+                return true;
+            }
+        };
+
+        inline size_t write_index(size_t index, byte* buffer)
+        {
+            char digits[24];
+            size_t length = 0;
+
+            do
+            {
+                digits[length++] = static_cast<char>('0' + index % 10U);
+                index /= 10U;
+            }
+            while (index > 0U);
+
+            for (size_t i = 0; i < length; i++)
+                buffer[i] = digits[length - 1 - i];
+
+            buffer[length] = 0;
+            return length + 1U;
+        }
+
+        inline size_t index_size(size_t index)
+        {
+            size_t result = 2U;
+
+            for (; index >= 10U; index /= 10U)
+                result++;
+
+            return result;
+        }
+
+        template<typename T>
+        struct field_codec< std::vector<T> >
+        {
+            enum { type = array_node };
+
+            static size_t size(const std::vector<T>& value)
+            {
+                size_t result = sizeof(int) + 1U;
+
+                for (size_t i = 0; i < value.size(); i++)
+                    result += 1U + index_size(i) + field_codec<T>::size(value[i]);
+
+                return result;
+            }
+
+            static size_t write(const std::vector<T>& value, byte* buffer)
+            {
+                byte* position = buffer + sizeof(int);
+                int length;
+
+                for (size_t i = 0; i < value.size(); i++)
+                {
+                    *position++ = static_cast<byte>(field_codec<T>::type);
+                    position += write_index(i, position);
+                    position += field_codec<T>::write(value[i], position);
+                }
+
+                *position++ = 0;
+                length = static_cast<int>(position - buffer);
+                memcpy(buffer, &length, sizeof(int));
+
+                return length;
+            }
+
+            // Elements of other types are left out
+            static bool read(const node& element, std::vector<T>& value)
+            {
+                if (element.get_type() != array_node)
+                    return false;
+
+                const document items(
+                    element.get_data(),
+                    *static_cast<int*>(element.get_data())
+                );
+
+                value.clear();
+
+                // Read into a local: vector<bool>::back() is a proxy
+                for (document::const_iterator i = items.begin(); i != items.end(); ++i)
+                {
+                    T item = T();
+
+                    if (field_codec<T>::read(*i, item))
+                        value.push_back(item);
+                }
+
+                return true;
+            }
+        };
+    }
+
+    // Size of the document encode() writes for a bound struct
+    template<typename T>
+    size_t encoded_size(const T& value)
+    {
+        return detail::field_codec<T>::size(value);
+    }
+
+    // Writes a bound struct as a document, its fields in binding order.
+    // Returns the size written, or 0 if the buffer is too small.
+    template<typename T>
+    size_t encode(const T& value, void* buffer, size_t count)
+    {
+        if (count < encoded_size(value))
+            return 0U;
+
+        return detail::write_document(value, static_cast<byte*>(buffer));
+    }
+
+    // Reads the fields of a bound struct from a document. Fields that are
+    // missing, or of another type, keep their values. Returns the number
+    // of fields read; nested structs count as one.
+    template<typename T>
+    size_t decode(const document& source, T& value)
+    {
+        detail::read_visitor visitor(source);
+
+        binding<T>::fields(visitor, value);
+        return visitor.count;
+    }
+}
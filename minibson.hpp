@@ -1,21 +1,93 @@
 #pragma once
 
+#include <algorithm>
+#include <cstddef>
 #include <cstring>
 #include <cstdio>
+#include <ctime>
 #include <string>
 #include <iostream>
 #include <map>
-
-namespace minibson {
+#include <new>
+#include <set>
+#include <vector>
+
+#include "microbson_key.hpp"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <pthread.h>
+#include <unistd.h>
+#define MINIBSON_THREADS
+#endif
+
+#if defined(__GNUC__)
+#define MINIBSON_THREAD_LOCAL __thread
+#elif defined(_MSC_VER)
+#define MINIBSON_THREAD_LOCAL __declspec(thread)
+#else
+#define MINIBSON_THREAD_LOCAL
+#endif
+
+// MINIBSON_NODE_POOL, MINIBSON_MEMORY_RESOURCE, MINIBSON_NODE_STATS and
+// MINIBSON_INTERNED_KEYS change class layouts and how memory is allocated
+// and freed, so everything is declared in a namespace nested in minibson
+// and named after them, config_ followed by one digit for each. Translation
+// units built with different settings then use distinct types, and calls
+// that pass minibson types between them fail to link instead of sharing
+// mismatched definitions.
+#if defined(MINIBSON_NODE_POOL)
+#define MINIBSON_CONFIG_POOL 1
+#else
+#define MINIBSON_CONFIG_POOL 0
+#endif
+
+#if defined(MINIBSON_MEMORY_RESOURCE)
+#define MINIBSON_CONFIG_RESOURCE 1
+#else
+#define MINIBSON_CONFIG_RESOURCE 0
+#endif
+
+#if defined(MINIBSON_NODE_STATS)
+#define MINIBSON_CONFIG_STATS 1
+#else
+#define MINIBSON_CONFIG_STATS 0
+#endif
+
+#if defined(MINIBSON_INTERNED_KEYS)
+#define MINIBSON_CONFIG_KEYS 1
+#else
+#define MINIBSON_CONFIG_KEYS 0
+#endif
+
+#define MINIBSON_CONFIG_JOIN(pool, resource, stats, keys) config_##pool##resource##stats##keys
+#define MINIBSON_CONFIG_NAME(pool, resource, stats, keys) MINIBSON_CONFIG_JOIN(pool, resource, stats, keys)
+#define MINIBSON_CONFIGURATION MINIBSON_CONFIG_NAME(MINIBSON_CONFIG_POOL, MINIBSON_CONFIG_RESOURCE, MINIBSON_CONFIG_STATS, MINIBSON_CONFIG_KEYS)
+
+// C++03 has no inline namespaces: a using-directive makes the names
+// visible as minibson::name instead
+#if __cplusplus >= 201103L
+#define MINIBSON_BEGIN_NAMESPACE namespace minibson { inline namespace MINIBSON_CONFIGURATION {
+#else
+#define MINIBSON_BEGIN_NAMESPACE namespace minibson { namespace MINIBSON_CONFIGURATION { } using namespace MINIBSON_CONFIGURATION; namespace MINIBSON_CONFIGURATION {
+#endif
+
+#define MINIBSON_END_NAMESPACE } }
+
+MINIBSON_BEGIN_NAMESPACE
 
     // Basic types
 
+    using microbson::key;
+
     enum node_type {
         double_node = 0x01,
         string_node = 0x02,
         document_node = 0x03,
+        array_node = 0x04,
         binary_node = 0x05,
+        objectid_node = 0x07,
         boolean_node = 0x08,
+        datetime_node = 0x09,
         null_node = 0x0A,
         int32_node = 0x10,
         int64_node = 0x12,
@@ -23,26 +95,656 @@ namespace minibson {
     };
     
     template<typename T> struct type_converter { };
+
+    // Memory
+
+    // Free lists of small blocks, one list per 16-byte size class and one
+    // set of lists per thread, refilled a page at a time. Blocks freed on
+    // any thread are reused by that thread. Where threads are available,
+    // the lists of a finished thread go to a shared depot that refills are
+    // served from first; pages are kept for reuse and never handed back.
+    // Larger requests go to operator new.
+    class node_pool {
+        public:
+            enum { granularity = 16, classes = 16, page_size = 4096 };
+
+        private:
+            struct block {
+                block* next;
+            };
+
+            struct lists {
+                block* heads[classes];
+                size_t pages;
+                bool registered;
+            };
+
+#if defined(MINIBSON_THREADS)
+            struct depot {
+                pthread_mutex_t mutex;
+                block* heads[classes];
+            };
+
+            static depot& shared() {
+                static depot value = { PTHREAD_MUTEX_INITIALIZER, { NULL } };
+
+                return value;
+            }
+
+            static pthread_key_t& key() {
+                static pthread_key_t value;
+
+                return value;
+            }
+
+            static void create_key() {
+                pthread_key_create(&key(), release);
+            }
+
+            // Hands the lists of a finishing thread to the depot
+            static void release(void* argument) {
+                lists& _lists = *static_cast<lists*>(argument);
+                depot& _depot = shared();
+
+                pthread_mutex_lock(&_depot.mutex);
+
+                for (size_t i = 0; i < classes; i++)
+                    while (_lists.heads[i] != NULL) {
+                        block* _block = _lists.heads[i];
+
+                        _lists.heads[i] = _block->next;
+                        _block->next = _depot.heads[i];
+                        _depot.heads[i] = _block;
+                    }
+
+                pthread_mutex_unlock(&_depot.mutex);
+            }
+#endif
+
+            static lists& local() {
+                static MINIBSON_THREAD_LOCAL lists value;
+
+#if defined(MINIBSON_THREADS)
+                if (!value.registered) {
+                    static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+                    pthread_once(&once, create_key);
+                    pthread_setspecific(key(), &value);
+                    value.registered = true;
+                }
+#endif
+
+                return value;
+            }
+
+            static void refill(lists& _lists, const size_t size_class) {
+                const size_t size = (size_class + 1) * granularity;
+                char* page;
+
+#if defined(MINIBSON_THREADS)
+                depot& _depot = shared();
+
+                pthread_mutex_lock(&_depot.mutex);
+                _lists.heads[size_class] = _depot.heads[size_class];
+                _depot.heads[size_class] = NULL;
+                pthread_mutex_unlock(&_depot.mutex);
+
+                if (_lists.heads[size_class] != NULL)
+                    return;
+#endif
+
+                page = static_cast<char*>(::operator new(page_size));
+
+                for (size_t offset = 0; offset + size <= page_size; offset += size) {
+                    block* _block = reinterpret_cast<block*>(page + offset);
+
+                    _block->next = _lists.heads[size_class];
+                    _lists.heads[size_class] = _block;
+                }
+
+                _lists.pages++;
+            }
+
+        public:
+            static void* allocate(const size_t size) {
+                const size_t size_class = (size > 0) ? (size - 1) / granularity : 0;
+                lists& _lists = local();
+                block* result;
+
+                if (size_class >= classes)
+                    return ::operator new(size);
+
+                if (_lists.heads[size_class] == NULL)
+                    refill(_lists, size_class);
+
+                result = _lists.heads[size_class];
+                _lists.heads[size_class] = result->next;
+                return result;
+            }
+
+            static void deallocate(void* const pointer, const size_t size) {
+                const size_t size_class = (size > 0) ? (size - 1) / granularity : 0;
+                lists& _lists = local();
+
+                if (pointer == NULL)
+                    return;
+
+                if (size_class >= classes) {
+                    ::operator delete(pointer);
+                    return;
+                }
+
+                block* _block = static_cast<block*>(pointer);
+
+                _block->next = _lists.heads[size_class];
+                _lists.heads[size_class] = _block;
+            }
+
+            // Pages the calling thread's lists have taken from operator new
+            static size_t get_page_count() { return local().pages; }
+    };
+
+    // Standard allocator over node_pool, for containers of small elements
+    template<typename T>
+    class pool_allocator {
+        public:
+            typedef T value_type;
+            typedef T* pointer;
+            typedef const T* const_pointer;
+            typedef T& reference;
+            typedef const T& const_reference;
+            typedef size_t size_type;
+            typedef std::ptrdiff_t difference_type;
+
+            template<typename U> struct rebind { typedef pool_allocator<U> other; };
+
+            pool_allocator() { }
+
+            template<typename U> pool_allocator(const pool_allocator<U>&) { }
+
+            pointer address(reference value) const { return &value; }
+
+            const_pointer address(const_reference value) const { return &value; }
+
+            pointer allocate(const size_type count, const void* = 0) {
+                return static_cast<pointer>(node_pool::allocate(count * sizeof(T)));
+            }
+
+            void deallocate(const pointer value, const size_type count) {
+                node_pool::deallocate(value, count * sizeof(T));
+            }
+
+            size_type max_size() const { return size_type(-1) / sizeof(T); }
+
+            void construct(const pointer value, const T& source) { new (value) T(source); }
+
+            void destroy(const pointer value) { value->~T(); }
+
+            template<typename U> bool operator==(const pool_allocator<U>&) const { return true; }
+
+            template<typename U> bool operator!=(const pool_allocator<U>&) const { return false; }
+    };
+
+    // Source of memory for nodes, element maps, array element vectors,
+    // packed array values and binary buffers when MINIBSON_MEMORY_RESOURCE
+    // is defined before this file is included. Strings are out of scope:
+    // string values and element names are std::strings, so any too long
+    // for their small-string buffer still come from operator new, as do
+    // the nodes deserialize_parallel() builds on its worker threads. An
+    // arena therefore only keeps a document off the global heap when its
+    // names and strings are short. Resources may keep state: each
+    // allocation stays tied to the resource it came from and is given
+    // back to it, whichever resource is current when it is freed.
+    class memory_resource {
+        public:
+            virtual ~memory_resource() { }
+            virtual void* allocate(const size_t size) = 0;
+            virtual void deallocate(void* const pointer, const size_t size) = 0;
+    };
+
+    // operator new and delete, the default
+    class new_delete_resource : public memory_resource {
+        public:
+            void* allocate(const size_t size) { return ::operator new(size); }
+
+            void deallocate(void* const pointer, const size_t size) { ::operator delete(pointer); }
+
+            static memory_resource* instance() {
+                static new_delete_resource value;
+
+                return &value;
+            }
+    };
+
+    // node_pool, from any thread
+    class pool_resource : public memory_resource {
+        public:
+            void* allocate(const size_t size) { return node_pool::allocate(size); }
+
+            void deallocate(void* const pointer, const size_t size) { node_pool::deallocate(pointer, size); }
+
+            static memory_resource* instance() {
+                static pool_resource value;
+
+                return &value;
+            }
+    };
+
+    // Hands out memory from an optional initial buffer, then from chunks
+    // taken from an upstream resource, each twice the size of the last.
+    // Freeing does nothing; release() (or the destructor) frees all the
+    // chunks at once and starts over from the initial buffer, so documents
+    // using it must be gone by then. Not to be shared between threads.
+    class monotonic_resource : public memory_resource {
+        private:
+            enum { alignment = 16 };
+
+            struct chunk {
+                chunk* next;
+                size_t size;
+            };
+
+            memory_resource* upstream;
+            char* initial;
+            size_t initial_size;
+            chunk* chunks;
+            char* position;
+            size_t left;
+            size_t next_size;
+
+            monotonic_resource(const monotonic_resource&);
+            monotonic_resource& operator=(const monotonic_resource&);
+
+            static size_t header_size() { return (sizeof(chunk) + alignment - 1) / alignment * alignment; }
+
+            void grow(const size_t size) {
+                const size_t total = header_size() + std::max(size, next_size);
+                chunk* _chunk = static_cast<chunk*>(upstream->allocate(total));
+
+                _chunk->next = chunks;
+                _chunk->size = total;
+                chunks = _chunk;
+                position = reinterpret_cast<char*>(_chunk) + header_size();
+                left = total - header_size();
+                next_size *= 2;
+            }
+
+        public:
+            explicit monotonic_resource(const size_t chunk_size = 4096, memory_resource* const upstream = new_delete_resource::instance())
+                : upstream(upstream), initial(NULL), initial_size(0), chunks(NULL), position(NULL), left(0), next_size(chunk_size) { }
+
+            monotonic_resource(void* const buffer, const size_t size, memory_resource* const upstream = new_delete_resource::instance())
+                : upstream(upstream), initial(static_cast<char*>(buffer)), initial_size(size), chunks(NULL), next_size(std::max<size_t>(size, 4096)) {
+                release();
+            }
+
+            ~monotonic_resource() { release(); }
+
+            void* allocate(const size_t size) {
+                const size_t padding = (alignment - reinterpret_cast<size_t>(position) % alignment) % alignment;
+                const size_t aligned = (size + alignment - 1) / alignment * alignment;
+                char* result;
+
+                if (padding + aligned > left)
+                    grow(aligned);
+                else {
+                    position += padding;
+                    left -= padding;
+                }
+
+                result = position;
+                position += aligned;
+                left -= aligned;
+                return result;
+            }
+
+            void deallocate(void* const pointer, const size_t size) { }
+
+            void release() {
+                while (chunks != NULL) {
+                    chunk* next = chunks->next;
+
+                    upstream->deallocate(chunks, chunks->size);
+                    chunks = next;
+                }
+
+                position = initial;
+                left = initial_size;
+            }
+    };
+
+    // The resource the calling thread allocates from; new_delete_resource
+    // unless set_memory_resource() was called.
+    inline memory_resource*& current_memory_resource() {
+        static MINIBSON_THREAD_LOCAL memory_resource* value = NULL;
+
+        return value;
+    }
+
+    inline memory_resource* get_memory_resource() {
+        memory_resource* const result = current_memory_resource();
+
+        return (result != NULL) ? result : new_delete_resource::instance();
+    }
+
+    // Returns the previous resource
+    inline memory_resource* set_memory_resource(memory_resource* const resource) {
+        memory_resource* const result = get_memory_resource();
+
+        current_memory_resource() = resource;
+        return result;
+    }
+
+    // Makes a resource current for the calling thread until the end of a
+    // scope.
+    class scoped_memory_resource {
+        private:
+            memory_resource* previous;
+
+            scoped_memory_resource(const scoped_memory_resource&);
+            scoped_memory_resource& operator=(const scoped_memory_resource&);
+
+        public:
+            explicit scoped_memory_resource(memory_resource& resource) : previous(set_memory_resource(&resource)) { }
+
+            ~scoped_memory_resource() { set_memory_resource(previous); }
+    };
+
+    // Standard allocator over the memory resource that was current when it
+    // was constructed; copies share the resource.
+    template<typename T>
+    class resource_allocator {
+        public:
+            typedef T value_type;
+            typedef T* pointer;
+            typedef const T* const_pointer;
+            typedef T& reference;
+            typedef const T& const_reference;
+            typedef size_t size_type;
+            typedef std::ptrdiff_t difference_type;
+
+            template<typename U> struct rebind { typedef resource_allocator<U> other; };
+
+            memory_resource* resource;
+
+            resource_allocator() : resource(get_memory_resource()) { }
+
+            explicit resource_allocator(memory_resource* const resource) : resource(resource) { }
+
+            template<typename U> resource_allocator(const resource_allocator<U>& other) : resource(other.resource) { }
+
+            pointer address(reference value) const { return &value; }
+
+            const_pointer address(const_reference value) const { return &value; }
+
+            pointer allocate(const size_type count, const void* = 0) {
+                return static_cast<pointer>(resource->allocate(count * sizeof(T)));
+            }
+
+            void deallocate(const pointer value, const size_type count) {
+                resource->deallocate(value, count * sizeof(T));
+            }
+
+            size_type max_size() const { return size_type(-1) / sizeof(T); }
+
+            void construct(const pointer value, const T& source) { new (value) T(source); }
+
+            void destroy(const pointer value) { value->~T(); }
+
+            template<typename U> bool operator==(const resource_allocator<U>& other) const { return resource == other.resource; }
+
+            template<typename U> bool operator!=(const resource_allocator<U>& other) const { return resource != other.resource; }
+    };
+
+    namespace detail {
+        enum { resource_header_size = 16 };
+
+        // Allocates from the current resource, recording it in a header in
+        // front of the block
+        inline void* resource_allocate(const size_t size) {
+            memory_resource* const resource = get_memory_resource();
+            char* const block = static_cast<char*>(resource->allocate(resource_header_size + size));
+
+            *reinterpret_cast<memory_resource**>(block) = resource;
+            return block + resource_header_size;
+        }
+
+        inline void resource_deallocate(void* const pointer, const size_t size) {
+            if (pointer == NULL)
+                return;
+
+            char* const block = static_cast<char*>(pointer) - resource_header_size;
+
+            (*reinterpret_cast<memory_resource**>(block))->deallocate(block, resource_header_size + size);
+        }
+
+        inline unsigned char* allocate_bytes(const size_t size) {
+#if defined(MINIBSON_MEMORY_RESOURCE)
+            return static_cast<unsigned char*>(resource_allocate(size));
+#else
+            return new unsigned char[size];
+#endif
+        }
+
+        inline void deallocate_bytes(void* const pointer, const size_t size) {
+#if defined(MINIBSON_MEMORY_RESOURCE)
+            resource_deallocate(pointer, size);
+#else
+            delete[] static_cast<unsigned char*>(pointer);
+#endif
+        }
+    }
+
+    // Live nodes, and the bytes they hold, by node type: the node itself
+    // plus the heap storage of string values and binary data. Element maps
+    // and array vectors aren't included; node::memory_usage() has those.
+    // Nodes are only counted when MINIBSON_NODE_STATS is defined before
+    // this file is included; otherwise every count stays at zero.
+    class node_stats {
+        private:
+            static long* nodes() {
+                static long value[256];
+
+                return value;
+            }
+
+            static long* bytes() {
+                static long value[256];
+
+                return value;
+            }
+
+            static void add(long& counter, const long delta) {
+#if defined(__GNUC__)
+                __sync_fetch_and_add(&counter, delta);
+#else
+                counter += delta;
+#endif
+            }
+
+        public:
+            static void add(const unsigned char type, const long node_delta, const long byte_delta) {
+                if (node_delta != 0)
+                    add(nodes()[type], node_delta);
+
+                if (byte_delta != 0)
+                    add(bytes()[type], byte_delta);
+            }
+
+            static long get_node_count(const node_type type) { return nodes()[type]; }
+
+            static long get_byte_count(const node_type type) { return bytes()[type]; }
+
+            static long get_node_count() {
+                long result = 0;
+
+                for (size_t i = 0; i < 256; i++)
+                    result += nodes()[i];
+
+                return result;
+            }
+
+            static long get_byte_count() {
+                long result = 0;
+
+                for (size_t i = 0; i < 256; i++)
+                    result += bytes()[i];
+
+                return result;
+            }
+    };
+
+    // Heap bytes held by a tree of nodes, as reported by
+    // node::memory_usage(). Sizes are what was requested from the
+    // allocator, which adds its own overhead to every block.
+    struct memory_footprint {
+        size_t nodes;       // node objects
+        size_t map_entries; // element map entries: tree links, key and node pointer
+        size_t keys;        // keys too long to be stored in their map entry
+        size_t strings;     // string values, by capacity
+        size_t binaries;    // binary data
+        size_t vectors;     // array element and packed value vectors, by capacity
+
+        memory_footprint() : nodes(0), map_entries(0), keys(0), strings(0), binaries(0), vectors(0) { }
+
+        size_t get_total() const {
+            return nodes + map_entries + keys + strings + binaries + vectors;
+        }
+    };
+
+    namespace detail {
+        // Bytes a string keeps on the heap: none when it fits in the
+        // string object itself
+        inline size_t heap_bytes(const std::string& value) {
+            const char* const data = value.data();
+            const char* const object = reinterpret_cast<const char*>(&value);
+
+            return ((data >= object) && (data < object + sizeof(value))) ? 0 : value.capacity() + 1;
+        }
+
+#if defined(MINIBSON_THREADS)
+        inline void delete_scratch_string(void* value) {
+            delete static_cast<std::string*>(value);
+        }
+
+        inline pthread_key_t& scratch_string_key() {
+            static pthread_key_t value;
+
+            return value;
+        }
+
+        inline void create_scratch_string_key() {
+            pthread_key_create(&scratch_string_key(), delete_scratch_string);
+        }
+#endif
+
+        // Per-thread string for map lookups by key, so that the name is
+        // copied into storage that is reused rather than into a new string
+        inline std::string& scratch_string() {
+#if defined(MINIBSON_THREADS)
+            static MINIBSON_THREAD_LOCAL std::string* value = NULL;
+
+            if (value == NULL) {
+                static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+                pthread_once(&once, create_scratch_string_key);
+                value = new std::string();
+                pthread_setspecific(scratch_string_key(), value);
+            }
+
+            return *value;
+#else
+            static std::string value;
+
+            return value;
+#endif
+        }
+
+        inline const std::string& key_string(const key& name) {
+            return scratch_string().assign(name.get_text(), name.get_length());
+        }
+    }
+
+    class document;
+    class array;
    
+    // Defining MINIBSON_MEMORY_RESOURCE before including this file
+    // allocates nodes from the current memory_resource; otherwise defining
+    // MINIBSON_NODE_POOL allocates nodes and element map entries from
+    // node_pool.
     class node {
         public:
+#if defined(MINIBSON_MEMORY_RESOURCE)
+            static void* operator new(const size_t size) { return detail::resource_allocate(size); }
+
+            static void operator delete(void* const pointer, const size_t size) { detail::resource_deallocate(pointer, size); }
+#elif defined(MINIBSON_NODE_POOL)
+            static void* operator new(const size_t size) { return node_pool::allocate(size); }
+
+            static void operator delete(void* const pointer, const size_t size) { node_pool::deallocate(pointer, size); }
+#endif
+
+#if defined(MINIBSON_NODE_STATS)
+        private:
+            unsigned char tracked_type;
+            size_t tracked_bytes;
+
+        protected:
+            // Counts the node in node_stats, or updates the bytes it holds
+            void track(const node_type type, const size_t bytes) {
+                node_stats::add(type, (tracked_type == 0) ? 1 : 0, static_cast<long>(bytes) - static_cast<long>(tracked_bytes));
+                tracked_type = type;
+                tracked_bytes = bytes;
+            }
+
+        public:
+            node() : tracked_type(0), tracked_bytes(0) { }
+
+            node(const node& other) : tracked_type(other.tracked_type), tracked_bytes(other.tracked_bytes) {
+                node_stats::add(tracked_type, 1, static_cast<long>(tracked_bytes));
+            }
+
+            node& operator=(const node&) { return (*this); }
+
+            virtual ~node() { node_stats::add(tracked_type, (tracked_type != 0) ? -1 : 0, -static_cast<long>(tracked_bytes)); }
+#else
+        protected:
+            void track(const node_type type, const size_t bytes) { }
+
+        public:
             virtual ~node() { }
+#endif
             virtual void serialize(void* const buffer, const size_t count) const = 0;
             virtual size_t get_serialized_size() const = 0;
             virtual unsigned char get_node_code() const { return 0; }
             virtual node* copy() const = 0;
             virtual void dump(std::ostream&) const = 0;
             virtual void dump(std::ostream& stream, int level) const { dump(stream); }
+            // Reads a new value of the same type from a serialized buffer,
+            // reusing the storage it already has; false if it can't.
+            virtual bool assign(const void* const buffer, const size_t count) { return false; }
             static node* create(node_type type, const void* const buffer, const size_t count);
+
+            // Adds the heap bytes of the node, and of any children, to usage
+            virtual void add_memory_usage(memory_footprint& usage) const { usage.nodes += sizeof(node); }
+
+            memory_footprint memory_usage() const {
+                memory_footprint result;
+
+                add_memory_usage(result);
+                return result;
+            }
     };
 
     // Value types
 
     class null : public node {
         public:
-            null() { }
+            null() { track(null_node, sizeof(*this)); }
 
-            null(const void* const buffer, const size_t count) { }
+            null(const void* const buffer, const size_t count) { track(null_node, sizeof(*this)); }
+
+            bool assign(const void* const buffer, const size_t count) { return true; }
 
             void serialize(void* const buffer, const size_t count) const { }
 
@@ -59,6 +761,8 @@ namespace minibson {
             }
 
             void dump(std::ostream& stream) const { stream << "null"; };
+
+            void add_memory_usage(memory_footprint& usage) const { usage.nodes += sizeof(*this); }
     };
 
     template<typename T, node_type N>
@@ -66,12 +770,18 @@ namespace minibson {
             private:
                 T value;
             public:
-                scalar(const T value) : value(value) { }
+                scalar(const T value) : value(value) { track(N, sizeof(*this)); }
 
                 scalar(const void* const buffer, const size_t count) {
                     value = *reinterpret_cast<const T*>(buffer);
+                    track(N, sizeof(*this));
                 };
 
+                bool assign(const void* const buffer, const size_t count) {
+                    value = *reinterpret_cast<const T*>(buffer);
+                    return true;
+                }
+
                 void serialize(void* const buffer, const size_t count) const {
                     *reinterpret_cast<T*>(buffer) = value;
                 }
@@ -90,6 +800,8 @@ namespace minibson {
 
                 void dump(std::ostream& stream) const { stream << value; };
 
+                void add_memory_usage(memory_footprint& usage) const { usage.nodes += sizeof(*this); }
+
                 const T& get_value() const { return value; }
         };
 
@@ -120,30 +832,204 @@ namespace minibson {
     
     template<> struct type_converter<double> { enum { node_type_code = double_node }; typedef Double node_class; };
 
-    class string : public node {
-        private:
-            std::string value;
-        public:
-            string(const std::string& value) : value(value) { }
+    struct object_id {
+        unsigned char bytes[12];
 
-            string(const void* const buffer, const size_t count) {
-                if ( count >= 5 ) {
-                    const size_t max = count - sizeof(unsigned int);
-                    const size_t actual = *reinterpret_cast<const unsigned int*>(
-                        buffer
-                    );
+        bool operator==(const object_id& other) const { return std::memcmp(bytes, other.bytes, sizeof(bytes)) == 0; }
 
-                    value.assign(
-                        reinterpret_cast<const char*>(buffer) + sizeof(unsigned int),
-                        std::min( actual, max ) - 1
-                    );
-                }
-            };
+        bool operator!=(const object_id& other) const { return !(*this == other); }
+
+        bool operator<(const object_id& other) const { return std::memcmp(bytes, other.bytes, sizeof(bytes)) < 0; }
+
+        // Seconds since the epoch stored in the first four bytes
+        long long int get_time() const {
+            return (static_cast<long long int>(bytes[0]) << 24) | (bytes[1] << 16) | (bytes[2] << 8) | bytes[3];
+        }
+    };
+
+    inline std::ostream& operator<<(std::ostream& stream, const object_id& value) {
+        static const char hex[] = "0123456789abcdef";
+        char text[24];
+
+        for (size_t i = 0; i < sizeof(value.bytes); i++) {
+            text[i * 2] = hex[value.bytes[i] >> 4];
+            text[i * 2 + 1] = hex[value.bytes[i] & 0x0F];
+        }
+
+        return stream.write(text, sizeof(text));
+    }
+
+    class objectid : public scalar<object_id, objectid_node> {
+        public:
+            objectid(const object_id& value) : scalar<object_id, objectid_node>(value) { }
+
+            objectid(const void* const buffer, const size_t count) : scalar<object_id, objectid_node>(buffer, count) { };
+    };
+
+    template<> struct type_converter<object_id> { enum { node_type_code = objectid_node }; typedef objectid node_class; };
+
+    // Milliseconds since the epoch, UTC
+    struct utc_datetime {
+        long long int milliseconds;
+
+        bool operator==(const utc_datetime& other) const { return milliseconds == other.milliseconds; }
+
+        bool operator!=(const utc_datetime& other) const { return milliseconds != other.milliseconds; }
+    };
+
+    inline utc_datetime make_datetime(const long long int milliseconds) {
+        utc_datetime result;
+
+        result.milliseconds = milliseconds;
+        return result;
+    }
+
+    inline std::ostream& operator<<(std::ostream& stream, const utc_datetime& value) {
+        return stream << value.milliseconds;
+    }
+
+    class datetime : public scalar<utc_datetime, datetime_node> {
+        public:
+            datetime(const utc_datetime& value) : scalar<utc_datetime, datetime_node>(value) { }
+
+            datetime(const void* const buffer, const size_t count) : scalar<utc_datetime, datetime_node>(buffer, count) { };
+    };
+
+    template<> struct type_converter<utc_datetime> { enum { node_type_code = datetime_node }; typedef datetime node_class; };
+
+    // Generates ObjectIds: seconds since the epoch, five random bytes and a
+    // counter, all big endian. The random bytes and the counter belong to
+    // each generator, so generators never share state: give every thread
+    // its own and ids stay unique without locking. The time and random
+    // bytes are kept ready in a prefix that is only rebuilt when the second
+    // changes, or when the counter wraps within a second, which draws new
+    // random bytes. While ids come in fast, the clock is only read every
+    // max_interval ids: after a burst, that many ids at most may carry the
+    // second in which it ended.
+    class object_id_generator {
+        private:
+            enum { max_interval = 1024 };
+
+            object_id prefix;
+            time_t seconds;
+            unsigned long long state;
+            unsigned int counter;
+            unsigned int first;
+            unsigned int interval;
+            unsigned int countdown;
+
+            static unsigned long long mix(unsigned long long value) {
+                value += 0x9E3779B97F4A7C15ULL;
+                value = (value ^ (value >> 30)) * 0xBF58476D1CE4E5B9ULL;
+                value = (value ^ (value >> 27)) * 0x94D049BB133111EBULL;
+                return value ^ (value >> 31);
+            }
+
+            void set_time(const time_t now) {
+                const unsigned int value = static_cast<unsigned int>(now);
+
+                seconds = now;
+                first = counter;
+                prefix.bytes[0] = static_cast<unsigned char>(value >> 24);
+                prefix.bytes[1] = static_cast<unsigned char>(value >> 16);
+                prefix.bytes[2] = static_cast<unsigned char>(value >> 8);
+                prefix.bytes[3] = static_cast<unsigned char>(value);
+            }
+
+            void set_random() {
+                state = mix(state);
+
+                for (int i = 0; i < 5; i++)
+                    prefix.bytes[4 + i] = static_cast<unsigned char>(state >> (i * 8));
+
+                first = counter;
+            }
+
+            // Reads the clock less often while it keeps reading the same second
+            void check_time() {
+                const time_t now = std::time(NULL);
+
+                if (now != seconds) {
+                    set_time(now);
+                    interval = 1;
+                }
+                else if (interval < max_interval)
+                    interval *= 2;
+
+                countdown = interval;
+            }
+
+        public:
+            object_id_generator() : interval(1), countdown(1) {
+                state = mix(static_cast<unsigned long long>(std::time(NULL)));
+                state = mix(state ^ static_cast<unsigned long long>(std::clock()));
+                state = mix(state ^ reinterpret_cast<size_t>(this));
+#if defined(__unix__) || defined(__APPLE__)
+                state = mix(state ^ static_cast<unsigned long long>(getpid()));
+#endif
+
+                counter = static_cast<unsigned int>(state >> 40);
+                set_random();
+                set_time(std::time(NULL));
+            }
+
+            object_id next() {
+                object_id result;
+
+                if (--countdown == 0)
+                    check_time();
+
+                counter = (counter + 1) & 0xFFFFFF;
+
+                // Every counter value has been used with this prefix
+                if (counter == first) {
+                    const time_t now = std::time(NULL);
+
+                    if (now != seconds)
+                        set_time(now);
+                    else
+                        set_random();
+                }
+
+                result = prefix;
+                result.bytes[9] = static_cast<unsigned char>(counter >> 16);
+                result.bytes[10] = static_cast<unsigned char>(counter >> 8);
+                result.bytes[11] = static_cast<unsigned char>(counter);
+                return result;
+            }
+    };
+
+    class string : public node {
+        private:
+            std::string value;
+        public:
+            string(const std::string& value) : value(value) { track(string_node, sizeof(*this) + detail::heap_bytes(value)); }
+
+            string(const void* const buffer, const size_t count) {
+                assign(buffer, count);
+            };
+
+            // Keeps the capacity of the current value
+            bool assign(const void* const buffer, const size_t count) {
+                if ( count >= 5 ) {
+                    const size_t max = count - sizeof(unsigned int);
+                    const size_t actual = *reinterpret_cast<const unsigned int*>(
+                        buffer
+                    );
+
+                    value.assign(
+                        reinterpret_cast<const char*>(buffer) + sizeof(unsigned int),
+                        std::min( actual, max ) - 1
+                    );
+                }
+
+                track(string_node, sizeof(*this) + detail::heap_bytes(value));
+                return true;
+            }
 
             void serialize(void* const buffer, const size_t count) const {
                 *reinterpret_cast<unsigned int*>(buffer) = value.length() + 1;
-                std::memcpy(reinterpret_cast<char*>(buffer) + sizeof(unsigned int), value.c_str(), value.length());
-                *(reinterpret_cast<char*>(buffer) + count - 1) = '\0';
+                std::memcpy(reinterpret_cast<char*>(buffer) + sizeof(unsigned int), value.c_str(), value.length() + 1);
             }
 
             size_t get_serialized_size() const {
@@ -159,6 +1045,11 @@ namespace minibson {
             }
 
             void dump(std::ostream& stream) const { stream << "\"" << value << "\""; };
+
+            void add_memory_usage(memory_footprint& usage) const {
+                usage.nodes += sizeof(*this);
+                usage.strings += detail::heap_bytes(value);
+            }
             
             const std::string& get_value() const { return value; }
     };
@@ -169,14 +1060,21 @@ namespace minibson {
         private:
             bool value;
         public:
-            boolean(const bool value) : value(value) { }
+            boolean(const bool value) : value(value) { track(boolean_node, sizeof(*this)); }
 
             boolean(const void* const buffer, const size_t count) {
+                assign(buffer, count);
+                track(boolean_node, sizeof(*this));
+            };
+
+            bool assign(const void* const buffer, const size_t count) {
                 switch (*reinterpret_cast<const unsigned char*>(buffer)) {
                     case 1: value = true; break;
                     default: value = false; break;
                 }
-            };
+
+                return true;
+            }
 
             void serialize(void* const buffer, const size_t count) const {
                 *reinterpret_cast<unsigned char*>(buffer) = value ? true : false;
@@ -196,6 +1094,8 @@ namespace minibson {
 
             void dump(std::ostream& stream) const { stream << (value ? "true" : "false"); };
 
+            void add_memory_usage(memory_footprint& usage) const { usage.nodes += sizeof(*this); }
+
             const bool& get_value() const { return value; }
     };
     
@@ -206,7 +1106,7 @@ namespace minibson {
             struct buffer {
                 buffer(const buffer& other) : owned(true) { 
                     length = other.length;
-                    data = new unsigned char[length];
+                    data = detail::allocate_bytes(length);
                     std::memcpy(data, other.data, length);
                 }
 
@@ -214,7 +1114,7 @@ namespace minibson {
 
                 ~buffer() {
                     if (owned)
-                        delete[] reinterpret_cast<unsigned char*>(data);
+                        detail::deallocate_bytes(data, length);
                 }
 
                 void dump(std::ostream& stream) const { stream << "<binary: " << length << " bytes>"; };
@@ -228,29 +1128,46 @@ namespace minibson {
             buffer value;
 
         public:
-            binary(const buffer& buffer) : value(buffer) { }
+            binary(const buffer& buffer) : value(buffer) { track(binary_node, sizeof(*this) + value.length); }
 
             binary(const void* const buffer, const size_t count, const bool create = false) : value(NULL, 0) {
                 const unsigned char* byte_buffer = reinterpret_cast<const unsigned char*>(buffer);
 
                 if (create) {
                     value.length = count;
-                    value.data = new unsigned char[value.length];
+                    value.data = detail::allocate_bytes(value.length);
                     std::memcpy(value.data, byte_buffer, value.length);
                 }
                 else {
                     value.length = *reinterpret_cast<const int*>(byte_buffer);
-                    value.data = new unsigned char[value.length];
+                    value.data = detail::allocate_bytes(value.length);
                     std::memcpy(value.data, byte_buffer + 5, value.length);
                 }
                 
                 value.owned = true;
+                track(binary_node, sizeof(*this) + value.length);
             };
 
+            // Keeps the current data buffer if the length is unchanged
+            bool assign(const void* const buffer, const size_t count) {
+                const size_t length = *reinterpret_cast<const int*>(buffer);
+
+                if (length != value.length) {
+                    detail::deallocate_bytes(value.data, value.length);
+                    value.length = length;
+                    value.data = detail::allocate_bytes(value.length);
+                }
+
+                std::memcpy(value.data, reinterpret_cast<const unsigned char*>(buffer) + 5, value.length);
+                track(binary_node, sizeof(*this) + value.length);
+                return true;
+            }
+
             void serialize(void* const buffer, const size_t count) const {
                 unsigned char* byte_buffer = reinterpret_cast<unsigned char*>(buffer);
 
                 *reinterpret_cast<int*>(byte_buffer) = value.length;
+                byte_buffer[4] = 0;
                 std::memcpy(byte_buffer + 5, value.data, value.length);
             }
 
@@ -268,20 +1185,333 @@ namespace minibson {
 
             void dump(std::ostream& stream) const { value.dump(stream); };
 
-            const buffer get_value() const { return value; }
+            void add_memory_usage(memory_footprint& usage) const {
+                usage.nodes += sizeof(*this);
+                usage.binaries += value.owned ? value.length : 0;
+            }
+
+            const buffer& get_value() const { return value; }
     };
     
     template<> struct type_converter< binary::buffer > { enum { node_type_code = binary_node }; typedef binary node_class; };
     
+    // Element names
+
+    // Element names stored once, for documents to share. Tables are safe
+    // to share between threads, and must outlive the documents whose names
+    // they hold.
+    class key_table {
+        private:
+            std::set<std::string> names;
+#if defined(MINIBSON_THREADS)
+            pthread_mutex_t mutex;
+#endif
+
+            key_table(const key_table&);
+            key_table& operator=(const key_table&);
+
+        public:
+            key_table() {
+#if defined(MINIBSON_THREADS)
+                pthread_mutex_init(&mutex, NULL);
+#endif
+            }
+
+            ~key_table() {
+#if defined(MINIBSON_THREADS)
+                pthread_mutex_destroy(&mutex);
+#endif
+            }
+
+            // The table's copy of a name, added if it isn't there yet
+            const std::string* intern(const std::string& name) {
+                const std::string* result;
+
+#if defined(MINIBSON_THREADS)
+                pthread_mutex_lock(&mutex);
+#endif
+                result = &*names.insert(name).first;
+#if defined(MINIBSON_THREADS)
+                pthread_mutex_unlock(&mutex);
+#endif
+
+                return result;
+            }
+
+            size_t size() const { return names.size(); }
+
+            // Used when no other table is current; never freed
+            static key_table& global() {
+                static key_table* value = new key_table();
+
+                return *value;
+            }
+    };
+
+    inline key_table*& current_key_table() {
+        static MINIBSON_THREAD_LOCAL key_table* value = NULL;
+
+        return value;
+    }
+
+    // The table the calling thread interns names in; key_table::global()
+    // unless set_key_table() was called.
+    inline key_table& get_key_table() {
+        key_table* const result = current_key_table();
+
+        return (result != NULL) ? *result : key_table::global();
+    }
+
+    // Returns the previous table
+    inline key_table* set_key_table(key_table* const table) {
+        key_table* const result = &get_key_table();
+
+        current_key_table() = table;
+        return result;
+    }
+
+    // Makes a table current for the calling thread until the end of a
+    // scope, typically while a batch of documents is read.
+    class scoped_key_table {
+        private:
+            key_table* previous;
+
+            scoped_key_table(const scoped_key_table&);
+            scoped_key_table& operator=(const scoped_key_table&);
+
+        public:
+            explicit scoped_key_table(key_table& table) : previous(set_key_table(&table)) { }
+
+            ~scoped_key_table() { set_key_table(previous); }
+    };
+
+    // Handle to a name interned in the current key_table, with the read
+    // only part of the std::string interface. Equal handles from the same
+    // table compare by pointer; others fall back to comparing the text.
+    class interned_name {
+        private:
+            const std::string* value;
+
+            explicit interned_name(const std::string* value) : value(value) { }
+
+        public:
+            interned_name(const std::string& name) : value(get_key_table().intern(name)) { }
+
+            interned_name(const char* name) : value(get_key_table().intern(name)) { }
+
+            // Handle to search maps with, pointing at name itself: nothing
+            // is added to any table, and it compares by text. Only valid
+            // while name is.
+            static interned_name probe(const std::string& name) { return interned_name(&name); }
+
+            operator const std::string&() const { return *value; }
+
+            const std::string& str() const { return *value; }
+
+            const char* c_str() const { return value->c_str(); }
+
+            const char* data() const { return value->data(); }
+
+            size_t length() const { return value->length(); }
+
+            size_t size() const { return value->size(); }
+
+            bool empty() const { return value->empty(); }
+
+            bool operator<(const interned_name& other) const {
+                return (value != other.value) && (*value < *other.value);
+            }
+
+            bool operator==(const interned_name& other) const {
+                return (value == other.value) || (*value == *other.value);
+            }
+
+            bool operator!=(const interned_name& other) const { return !(*this == other); }
+    };
+
+    inline std::ostream& operator<<(std::ostream& stream, const interned_name& name) {
+        return stream << name.str();
+    }
+
+    namespace detail {
+        // Interned names belong to their table
+        inline size_t heap_bytes(const interned_name&) { return 0; }
+    }
+
     // Composite types
 
-    class element_list : protected std::map<std::string, node*>, public node {
+    // Defining MINIBSON_INTERNED_KEYS before including this file keys
+    // element maps by interned_name instead of std::string, so documents
+    // read from the same table share one copy of each name. Only names
+    // stored in documents are interned; names looked up are not.
+#if defined(MINIBSON_INTERNED_KEYS)
+    typedef interned_name node_name;
+#else
+    typedef std::string node_name;
+#endif
+
+#if defined(MINIBSON_MEMORY_RESOURCE)
+    typedef std::map<node_name, node*, std::less<node_name>, resource_allocator<std::pair<const node_name, node*> > > node_map;
+    typedef std::vector<node*, resource_allocator<node*> > node_vector;
+#elif defined(MINIBSON_NODE_POOL)
+    typedef std::map<node_name, node*, std::less<node_name>, pool_allocator<std::pair<const node_name, node*> > > node_map;
+#else
+    typedef std::map<node_name, node*> node_map;
+#endif
+
+#if !defined(MINIBSON_MEMORY_RESOURCE)
+    typedef std::vector<node*> node_vector;
+#endif
+
+    // Storage of the values of packed arrays
+    template<typename T>
+    struct value_vector {
+#if defined(MINIBSON_MEMORY_RESOURCE)
+        typedef std::vector<T, resource_allocator<T> > type;
+#else
+        typedef std::vector<T> type;
+#endif
+    };
+
+    class element_list : protected node_map, public node {
+        protected:
+            // Takes ownership of an already built node
+            void attach(const std::string& key, node* value) {
+                iterator position = node_map::find(key);
+
+                if (position != node_map::end()) {
+                    delete position->second;
+                    position->second = value;
+                }
+                else
+                    insert(std::make_pair(key, value));
+            }
+
+            friend void deserialize_parallel(const void* const buffer, const size_t count, document& result, const size_t threshold, size_t threads);
+
+            // Map searches never add the name searched for to a key table
+#if defined(MINIBSON_INTERNED_KEYS)
+            static node_name probe(const std::string& name) { return interned_name::probe(name); }
+#else
+            static const std::string& probe(const std::string& name) { return name; }
+#endif
+
+            node_map::iterator find(const std::string& name) { return node_map::find(probe(name)); }
+
+            node_map::const_iterator find(const std::string& name) const { return node_map::find(probe(name)); }
+
+            node* at(const std::string& name) const { return find(name)->second; }
+
+            // One map search, with the name in the per-thread scratch string
+            const node* lookup(const key& name) const {
+                const_iterator position = find(detail::key_string(name));
+
+                return (position != node_map::end()) ? position->second : NULL;
+            }
+
+            // Size of a serialized value of a type node::create() reads
+            static size_t value_size(const unsigned char type, const unsigned char* value) {
+                switch (type) {
+                    case int32_node: return 4;
+                    case double_node:
+                    case int64_node:
+                    case datetime_node: return 8;
+                    case boolean_node: return 1;
+                    case objectid_node: return 12;
+                    case string_node: return 4 + *reinterpret_cast<const int*>(value);
+                    case binary_node: return 5 + *reinterpret_cast<const int*>(value);
+                    case document_node:
+                    case array_node: return *reinterpret_cast<const int*>(value);
+                    default: return 0;
+                }
+            }
+
+            // Whether the first count bytes of serialized elements name key
+            static bool has_element(const unsigned char* byte_buffer, const size_t count, const std::string& key) {
+                size_t position = 0;
+
+                while (position < count) {
+                    const unsigned char type = byte_buffer[position++];
+                    const char* name = reinterpret_cast<const char*>(byte_buffer + position);
+
+                    if (key == name)
+                        return true;
+
+                    position += std::strlen(name) + 1;
+                    position += value_size(type, byte_buffer + position);
+                }
+
+                return false;
+            }
+
+            // Updates the list from serialized elements. Values whose name
+            // and type are unchanged are read into the existing nodes, other
+            // elements are created or replaced, and elements the buffer
+            // doesn't have are removed. Like the constructor, stops at the
+            // first element of a type it can't read.
+            void assign_elements(const void* const buffer, const size_t count) {
+                const unsigned char* byte_buffer = reinterpret_cast<const unsigned char*>(buffer);
+                size_t position = 0;
+                size_t elements = 0;
+                bool inserted = false;
+
+                while (position < count) {
+                    node_type type = static_cast<node_type>(byte_buffer[position++]);
+                    const char* name = reinterpret_cast<const char*>(byte_buffer + position);
+                    const size_t length = std::strlen(name);
+                    node_map::iterator existing;
+                    node* node = NULL;
+
+                    // The scratch string is reused by nested documents, so
+                    // it only holds the name for this search
+                    position += length + 1;
+                    existing = find(detail::scratch_string().assign(name, length));
+
+                    if ((existing != node_map::end())
+                        && (existing->second->get_node_code() == type)
+                        && existing->second->assign(byte_buffer + position, count - position))
+                        node = existing->second;
+                    else if ((node = node::create(type, byte_buffer + position, count - position)) != NULL) {
+                        if (existing != node_map::end()) {
+                            delete existing->second;
+                            existing->second = node;
+                        }
+                        else {
+                            insert(std::make_pair(std::string(name, length), node));
+                            inserted = true;
+                        }
+                    }
+                    else {
+                        position -= length + 2;
+                        break;
+                    }
+
+                    position += node->get_serialized_size();
+                    elements++;
+                }
+
+                // With no new names and as many elements as before, every
+                // name was seen again
+                if (!inserted && (size() == elements))
+                    return;
+
+                for (node_map::iterator i = node_map::begin(); i != node_map::end();)
+                    if (!has_element(byte_buffer, std::min(position, count), i->first)) {
+                        delete i->second;
+                        erase(i++);
+                    }
+                    else
+                        ++i;
+            }
+
         public:
-            typedef std::map<std::string, node*>::const_iterator const_iterator;
+            typedef node_map::const_iterator const_iterator;
 
-            element_list() { }
+            element_list() { track(document_node, sizeof(*this)); }
+
+            element_list(const element_list& other) : node_map(), node() {
+                track(document_node, sizeof(*this));
 
-            element_list(const element_list& other) {
                 for (const_iterator i = other.begin(); i != other.end(); i++)
                     (*this)[i->first] = i->second->copy();
             }
@@ -290,6 +1520,8 @@ namespace minibson {
                 const unsigned char* byte_buffer = reinterpret_cast<const unsigned char*>(buffer);
                 size_t position = 0;
 
+                track(document_node, sizeof(*this));
+
                 while (position < count) {
                     node_type type = static_cast<node_type>(byte_buffer[position++]);
                     std::string name(reinterpret_cast<const char*>(byte_buffer + position));
@@ -356,7 +1588,7 @@ namespace minibson {
                 stream << "{ ";
 
                 for (const_iterator i = begin(); i != end(); i++) {
-                    stream << std::endl;
+                    stream << '\n';
 
                     for (int j = 0; j < level + 1; j++)
                         stream << "\t";
@@ -369,7 +1601,7 @@ namespace minibson {
                     --i;
                 }
 
-                stream << std::endl;
+                stream << '\n';
 
                 for (int j = 0; j < level; j++)
                     stream << "\t";
@@ -378,28 +1610,53 @@ namespace minibson {
             }
 
             const_iterator begin() const {
-                return std::map<std::string, node*>::begin();
+                return node_map::begin();
             }
 
             const_iterator end() const {
-                return std::map<std::string, node*>::end();
+                return node_map::end();
             }
 
             bool contains(const std::string& key) const {
-                return (std::map<std::string, node*>::find(key) != end());
+                return (find(key) != end());
             }
             
             template<typename T>
             bool contains(const std::string& key) const {
-                const_iterator position = std::map<std::string, node*>::find(key);
+                const_iterator position = find(key);
                 return (position != end()) && (position->second->get_node_code() == type_converter<T>::node_type_code);
             }
 
+            // Lookups by key: see microbson_key.hpp
+
+            bool contains(const key& name) const {
+                return lookup(name) != NULL;
+            }
+
+            template<typename T>
+            bool contains(const key& name) const {
+                const node* value = lookup(name);
+                return (value != NULL) && (value->get_node_code() == type_converter<T>::node_type_code);
+            }
+
             ~element_list() {
                 for (const_iterator i = begin(); i != end(); i++)
                     delete i->second;
             }
 
+            void add_memory_usage(memory_footprint& usage) const {
+                // Color and parent, left and right links of a red-black tree
+                const size_t links = 4 * sizeof(void*);
+
+                usage.nodes += sizeof(*this);
+
+                for (const_iterator i = begin(); i != end(); i++) {
+                    usage.map_entries += links + sizeof(node_map::value_type);
+                    usage.keys += detail::heap_bytes(i->first);
+                    i->second->add_memory_usage(usage);
+                }
+            }
+
     };
    
     class document : public element_list {
@@ -408,6 +1665,22 @@ namespace minibson {
 
             document(const void* const buffer, const size_t count) : element_list(reinterpret_cast<const unsigned char*>(buffer) + 4, *reinterpret_cast<const int*>(buffer) - 4 - 1) { }
 
+            // Decodes a serialized document into this one, reusing the
+            // nodes (and string storage) of elements whose name and type
+            // are unchanged, so decoding messages of a fixed shape over and
+            // over doesn't allocate.
+            document& assign_from(const void* const buffer, const size_t count) {
+                const size_t length = std::min(static_cast<size_t>(*reinterpret_cast<const int*>(buffer)), count);
+
+                assign_elements(reinterpret_cast<const unsigned char*>(buffer) + 4, length - 4 - 1);
+                return (*this);
+            }
+
+            bool assign(const void* const buffer, const size_t count) {
+                assign_from(buffer, count);
+                return true;
+            }
+
             void serialize(void* const buffer, const size_t count) const {
                 size_t serialized_size = get_serialized_size();
 
@@ -450,6 +1723,8 @@ namespace minibson {
                     return _default;
             }
 
+            const array& get(const std::string& key, const array& _default) const;
+
             const std::string get(const std::string& key, const char* _default) const {
                 if ((find(key) != end()) && (at(key)->get_node_code() == string_node))
                     return reinterpret_cast<const string*>(at(key))->get_value();
@@ -483,6 +1758,8 @@ namespace minibson {
                 (*this)[key] = value.copy();
                 return (*this);
             }
+
+            document& set(const std::string& key, const array& value);
             
             document& set(const std::string& key) {
                 if (find(key) != end())
@@ -491,9 +1768,636 @@ namespace minibson {
                 (*this)[key] = new null();
                 return (*this);
             }
+
+            template<typename result_type>
+            const result_type get(const key& name, const result_type& _default) const {
+                typedef typename type_converter<result_type>::node_class node_class;
+                const node* value = lookup(name);
+
+                if ((value != NULL) && (value->get_node_code() == type_converter<result_type>::node_type_code))
+                    return reinterpret_cast<const node_class*>(value)->get_value();
+                else
+                    return _default;
+            }
+
+            const document& get(const key& name, const document& _default) const {
+                const node* value = lookup(name);
+
+                if ((value != NULL) && (value->get_node_code() == document_node))
+                    return *reinterpret_cast<const document*>(value);
+                else
+                    return _default;
+            }
+
+            const array& get(const key& name, const array& _default) const;
+
+            const std::string get(const key& name, const char* _default) const {
+                const node* value = lookup(name);
+
+                if ((value != NULL) && (value->get_node_code() == string_node))
+                    return reinterpret_cast<const string*>(value)->get_value();
+                else
+                    return std::string(_default);
+            }
+
+            template<typename value_type>
+            document& set(const key& name, const value_type& value) {
+                typedef typename type_converter<value_type>::node_class node_class;
+
+                attach(detail::key_string(name), new node_class(value));
+                return (*this);
+            }
+
+            document& set(const key& name, const char* value) {
+                attach(detail::key_string(name), new string(value));
+                return (*this);
+            }
+
+            document& set(const key& name, const document& value) {
+                attach(detail::key_string(name), value.copy());
+                return (*this);
+            }
+
+            document& set(const key& name, const array& value);
+
+            document& set(const key& name) {
+                attach(detail::key_string(name), new null());
+                return (*this);
+            }
     };
     
     template<> struct type_converter< document > { enum { node_type_code = document_node }; typedef document node_class; };
+
+    // Arrays stored by position. Element keys ("0", "1", ...) are not kept;
+    // they are generated in place while serializing. Arrays whose elements
+    // are all int32, all int64 or all double are kept packed in a single
+    // vector of values and only turned into nodes when a different type is
+    // stored in them, or by unpack() and the non-const at().
+    class array : public node {
+        private:
+            node_vector elements;
+            unsigned char packed;
+            value_vector<int>::type int32_values;
+            value_vector<long long int>::type int64_values;
+            value_vector<double>::type double_values;
+
+            static size_t index_length(size_t index) {
+                size_t result = 1;
+
+                for (; index >= 10; index /= 10)
+                    result++;
+
+                return result;
+            }
+
+            // Total length of the keys "0" to count - 1
+            static size_t index_lengths(const size_t count) {
+                size_t result = 0;
+
+                for (size_t digits = 1, first = 0, next = 10; first < count; digits++, first = next, next *= 10)
+                    result += digits * (std::min(count, next) - first);
+
+                return result;
+            }
+
+            // Writes the decimal key and its terminator, returns its length
+            static size_t write_index(size_t index, char* buffer) {
+                const size_t length = index_length(index);
+
+                buffer[length] = '\0';
+
+                for (size_t i = length; i > 0; i--, index /= 10)
+                    buffer[i - 1] = static_cast<char>('0' + index % 10);
+
+                return length;
+            }
+
+            // Returns the type shared by every element of a serialized
+            // array if it can be packed, 0 otherwise.
+            static unsigned char packed_type(const unsigned char* byte_buffer, const size_t length, size_t& count) {
+                unsigned char type = 0;
+                size_t position = 4;
+
+                for (count = 0; position + 1 < length; count++) {
+                    size_t width;
+
+                    switch (byte_buffer[position]) {
+                        case int32_node: width = sizeof(int); break;
+                        case int64_node: width = sizeof(long long int); break;
+                        case double_node: width = sizeof(double); break;
+                        default: return 0;
+                    }
+
+                    if ((type != 0) && (byte_buffer[position] != type))
+                        return 0;
+
+                    type = byte_buffer[position++];
+                    position += std::strlen(reinterpret_cast<const char*>(byte_buffer + position)) + 1 + width;
+                }
+
+                return (position + 1 == length) ? type : 0;
+            }
+
+            template<typename T, typename A>
+            static void load(const unsigned char* byte_buffer, const size_t count, std::vector<T, A>& values) {
+                size_t position = 4;
+
+                values.resize(count);
+
+                for (size_t i = 0; i < count; i++) {
+                    position += 1 + std::strlen(reinterpret_cast<const char*>(byte_buffer + position + 1)) + 1;
+                    std::memcpy(&values[i], byte_buffer + position, sizeof(T));
+                    position += sizeof(T);
+                }
+            }
+
+            template<typename T, typename A>
+            static size_t store(const std::vector<T, A>& values, const unsigned char type, char* byte_buffer) {
+                size_t position = 0;
+
+                for (size_t i = 0; i < values.size(); i++) {
+                    byte_buffer[position++] = type;
+                    position += write_index(i, byte_buffer + position) + 1;
+                    std::memcpy(byte_buffer + position, &values[i], sizeof(T));
+                    position += sizeof(T);
+                }
+
+                return position;
+            }
+
+            template<typename T, typename A>
+            static void dump_values(const std::vector<T, A>& values, std::ostream& stream) {
+                for (size_t i = 0; i < values.size(); i++) {
+                    if (i > 0)
+                        stream << ", ";
+
+                    stream << values[i];
+                }
+            }
+
+            // Packed storage for T, or NULL if the array doesn't hold Ts.
+            // The non-const versions start packing an empty array.
+            template<typename T>
+            const typename value_vector<T>::type* values(const T*) const { return NULL; }
+
+            const value_vector<int>::type* values(const int*) const {
+                return (packed == int32_node) ? &int32_values : NULL;
+            }
+
+            const value_vector<long long int>::type* values(const long long int*) const {
+                return (packed == int64_node) ? &int64_values : NULL;
+            }
+
+            const value_vector<double>::type* values(const double*) const {
+                return (packed == double_node) ? &double_values : NULL;
+            }
+
+            template<typename T>
+            typename value_vector<T>::type* values(const T*) { return NULL; }
+
+            value_vector<int>::type* values(const int*) { return start(int32_node, int32_values); }
+
+            value_vector<long long int>::type* values(const long long int*) { return start(int64_node, int64_values); }
+
+            value_vector<double>::type* values(const double*) { return start(double_node, double_values); }
+
+            template<typename T, typename A>
+            std::vector<T, A>* start(const unsigned char type, std::vector<T, A>& _values) {
+                if ((packed != type) && empty()) {
+                    clear();
+                    packed = type;
+                }
+
+                return (packed == type) ? &_values : NULL;
+            }
+
+            template<typename T, typename A>
+            void unpack(std::vector<T, A>& _values) {
+                typedef typename type_converter<T>::node_class node_class;
+
+                elements.reserve(_values.size());
+
+                for (size_t i = 0; i < _values.size(); i++)
+                    elements.push_back(new node_class(_values[i]));
+
+                std::vector<T, A>().swap(_values);
+            }
+
+            const node* element(const size_t index, const node_type type) const {
+                if ((index < elements.size()) && (elements[index]->get_node_code() == type))
+                    return elements[index];
+                else
+                    return NULL;
+            }
+
+            array& replace(const size_t index, node* value) {
+                unpack();
+
+                if (index < elements.size()) {
+                    delete elements[index];
+                    elements[index] = value;
+                }
+                else
+                    delete value;
+
+                return (*this);
+            }
+
+            array& append(node* value) {
+                unpack();
+                elements.push_back(value);
+                return (*this);
+            }
+
+            // Reads the elements of a serialized array into the unpacked
+            // ones, reusing nodes of the same type in the same position
+            void parse(const unsigned char* byte_buffer, const size_t length) {
+                size_t position = 4;
+                size_t index = 0;
+
+                for (; position + 1 < length; index++) {
+                    node_type type = static_cast<node_type>(byte_buffer[position++]);
+                    node* node = NULL;
+
+                    position += std::strlen(reinterpret_cast<const char*>(byte_buffer + position)) + 1;
+
+                    if ((index < elements.size())
+                        && (elements[index]->get_node_code() == type)
+                        && elements[index]->assign(byte_buffer + position, length - 1 - position))
+                        node = elements[index];
+                    else if ((node = node::create(type, byte_buffer + position, length - 1 - position)) == NULL)
+                        break;
+                    else if (index < elements.size()) {
+                        delete elements[index];
+                        elements[index] = node;
+                    }
+                    else
+                        elements.push_back(node);
+
+                    position += node->get_serialized_size();
+                }
+
+                for (size_t i = index; i < elements.size(); i++)
+                    delete elements[i];
+
+                elements.resize(std::min(index, elements.size()));
+            }
+
+        public:
+            array() : packed(0) { track(array_node, sizeof(*this)); }
+
+            array(const array& other)
+                : node(),
+                packed(other.packed),
+                int32_values(other.int32_values.begin(), other.int32_values.end()),
+                int64_values(other.int64_values.begin(), other.int64_values.end()),
+                double_values(other.double_values.begin(), other.double_values.end()) {
+                track(array_node, sizeof(*this));
+                elements.reserve(other.elements.size());
+
+                for (size_t i = 0; i < other.elements.size(); i++)
+                    elements.push_back(other.elements[i]->copy());
+            }
+
+            array(const void* const buffer, const size_t count) : packed(0) {
+                track(array_node, sizeof(*this));
+                assign(buffer, count);
+            }
+
+            ~array() {
+                for (size_t i = 0; i < elements.size(); i++)
+                    delete elements[i];
+            }
+
+            // Packed values are reloaded into the same vector, other
+            // elements into the nodes already in their position.
+            bool assign(const void* const buffer, const size_t count) {
+                const unsigned char* byte_buffer = reinterpret_cast<const unsigned char*>(buffer);
+                const size_t length = std::min(static_cast<size_t>(*reinterpret_cast<const int*>(buffer)), count);
+                size_t packed_count = 0;
+                const unsigned char type = packed_type(byte_buffer, length, packed_count);
+
+                if ((type != 0) && elements.empty()) {
+                    if (type != packed) {
+                        int32_values.clear();
+                        int64_values.clear();
+                        double_values.clear();
+                        packed = type;
+                    }
+
+                    switch (packed) {
+                        case int32_node: load(byte_buffer, packed_count, int32_values); break;
+                        case int64_node: load(byte_buffer, packed_count, int64_values); break;
+                        case double_node: load(byte_buffer, packed_count, double_values); break;
+                    }
+                }
+                else {
+                    if (packed != 0)
+                        clear();
+
+                    parse(byte_buffer, length);
+                }
+
+                return true;
+            }
+
+            void serialize(void* const buffer, const size_t count) const {
+                char* byte_buffer = reinterpret_cast<char*>(buffer);
+                size_t position = 4;
+
+                *reinterpret_cast<int*>(buffer) = get_serialized_size();
+
+                switch (packed) {
+                    case int32_node: position += store(int32_values, int32_node, byte_buffer + position); break;
+                    case int64_node: position += store(int64_values, int64_node, byte_buffer + position); break;
+                    case double_node: position += store(double_values, double_node, byte_buffer + position); break;
+                }
+
+                for (size_t i = 0; i < elements.size(); i++) {
+                    byte_buffer[position++] = elements[i]->get_node_code();
+                    position += write_index(i, byte_buffer + position) + 1;
+                    elements[i]->serialize(byte_buffer + position, count - position);
+                    position += elements[i]->get_serialized_size();
+                }
+
+                byte_buffer[position] = 0;
+            }
+
+            size_t get_serialized_size() const {
+                size_t result = 4 + 1 + 2 * size() + index_lengths(size());
+
+                switch (packed) {
+                    case int32_node: return result + int32_values.size() * sizeof(int);
+                    case int64_node: return result + int64_values.size() * sizeof(long long int);
+                    case double_node: return result + double_values.size() * sizeof(double);
+                }
+
+                for (size_t i = 0; i < elements.size(); i++)
+                    result += elements[i]->get_serialized_size();
+
+                return result;
+            }
+
+            unsigned char get_node_code() const {
+                return array_node;
+            }
+
+            node* copy() const {
+                return new array(*this);
+            }
+
+            void dump(std::ostream& stream) const {
+                stream << "[ ";
+
+                switch (packed) {
+                    case int32_node: dump_values(int32_values, stream); break;
+                    case int64_node: dump_values(int64_values, stream); break;
+                    case double_node: dump_values(double_values, stream); break;
+                }
+
+                for (size_t i = 0; i < elements.size(); i++) {
+                    if (i > 0)
+                        stream << ", ";
+
+                    elements[i]->dump(stream);
+                }
+
+                stream << " ]";
+            }
+
+            void add_memory_usage(memory_footprint& usage) const {
+                usage.nodes += sizeof(*this);
+                usage.vectors += elements.capacity() * sizeof(node*);
+                usage.vectors += int32_values.capacity() * sizeof(int);
+                usage.vectors += int64_values.capacity() * sizeof(long long int);
+                usage.vectors += double_values.capacity() * sizeof(double);
+
+                for (size_t i = 0; i < elements.size(); i++)
+                    elements[i]->add_memory_usage(usage);
+            }
+
+            size_t size() const {
+                switch (packed) {
+                    case int32_node: return int32_values.size();
+                    case int64_node: return int64_values.size();
+                    case double_node: return double_values.size();
+                    default: return elements.size();
+                }
+            }
+
+            bool empty() const { return size() == 0; }
+
+            // The packed values of an int32, int64 or double array, NULL if
+            // the array isn't packed with that type.
+            template<typename T>
+            const typename value_vector<T>::type* get_values() const {
+                return values(static_cast<const T*>(NULL));
+            }
+
+            // Turns packed values into nodes
+            void unpack() {
+                switch (packed) {
+                    case int32_node: unpack(int32_values); break;
+                    case int64_node: unpack(int64_values); break;
+                    case double_node: unpack(double_values); break;
+                }
+
+                packed = 0;
+            }
+
+            // Unpacks packed arrays.
+            node* at(const size_t index) {
+                unpack();
+                return (index < elements.size()) ? elements[index] : NULL;
+            }
+
+            // NULL for packed arrays, which this leaves alone so that const
+            // arrays can be read from several threads: read those through
+            // get() or get_values(), or unpack() them first.
+            const node* at(const size_t index) const {
+                return (index < elements.size()) ? elements[index] : NULL;
+            }
+
+            bool contains(const size_t index) const {
+                return index < size();
+            }
+
+            template<typename T>
+            bool contains(const size_t index) const {
+                if (packed != 0)
+                    return (index < size()) && (packed == type_converter<T>::node_type_code);
+                else
+                    return element(index, static_cast<node_type>(type_converter<T>::node_type_code)) != NULL;
+            }
+
+            template<typename result_type>
+            const result_type get(const size_t index, const result_type& _default) const {
+                const node_type node_type_code = static_cast<node_type>(type_converter<result_type>::node_type_code);
+                typedef typename type_converter<result_type>::node_class node_class;
+                const typename value_vector<result_type>::type* _values = values(static_cast<const result_type*>(NULL));
+                const node* _element = element(index, node_type_code);
+
+                if (_values != NULL)
+                    return (index < _values->size()) ? (*_values)[index] : _default;
+                else if (_element != NULL)
+                    return reinterpret_cast<const node_class*>(_element)->get_value();
+                else
+                    return _default;
+            }
+
+            const document& get(const size_t index, const document& _default) const {
+                const node* _element = element(index, document_node);
+
+                return (_element != NULL) ? *reinterpret_cast<const document*>(_element) : _default;
+            }
+
+            const array& get(const size_t index, const array& _default) const {
+                const node* _element = element(index, array_node);
+
+                return (_element != NULL) ? *reinterpret_cast<const array*>(_element) : _default;
+            }
+
+            const std::string get(const size_t index, const char* _default) const {
+                const node* _element = element(index, string_node);
+
+                if (_element != NULL)
+                    return reinterpret_cast<const string*>(_element)->get_value();
+                else
+                    return std::string(_default);
+            }
+
+            // Replaces the contents with a copy of a vector; int, long long
+            // and double vectors are stored packed.
+            template<typename value_type>
+            array& assign(const std::vector<value_type>& source) {
+                typename value_vector<value_type>::type* _values;
+
+                clear();
+
+                if ((_values = values(static_cast<const value_type*>(NULL))) != NULL)
+                    _values->assign(source.begin(), source.end());
+                else
+                    for (size_t i = 0; i < source.size(); i++)
+                        push_back(source[i]);
+
+                return (*this);
+            }
+
+            template<typename value_type>
+            array& push_back(const value_type& value) {
+                typedef typename type_converter<value_type>::node_class node_class;
+                typename value_vector<value_type>::type* _values = values(&value);
+
+                if (_values != NULL) {
+                    _values->push_back(value);
+                    return (*this);
+                }
+                else
+                    return append(new node_class(value));
+            }
+
+            array& push_back(const char* value) {
+                return append(new string(value));
+            }
+
+            array& push_back(const document& value) {
+                return append(value.copy());
+            }
+
+            array& push_back(const array& value) {
+                return append(value.copy());
+            }
+
+            array& push_back() {
+                return append(new null());
+            }
+
+            // Replaces an existing element; out of range indexes are ignored.
+            template<typename value_type>
+            array& set(const size_t index, const value_type& value) {
+                typedef typename type_converter<value_type>::node_class node_class;
+                typename value_vector<value_type>::type* _values = values(&value);
+
+                if ((_values != NULL) && (index < _values->size())) {
+                    (*_values)[index] = value;
+                    return (*this);
+                }
+                else
+                    return replace(index, new node_class(value));
+            }
+
+            array& set(const size_t index, const char* value) {
+                return replace(index, new string(value));
+            }
+
+            array& set(const size_t index, const document& value) {
+                return replace(index, value.copy());
+            }
+
+            array& set(const size_t index, const array& value) {
+                return replace(index, value.copy());
+            }
+
+            array& set(const size_t index) {
+                return replace(index, new null());
+            }
+
+            void pop_back() {
+                if (empty())
+                    return;
+
+                switch (packed) {
+                    case int32_node: int32_values.pop_back(); return;
+                    case int64_node: int64_values.pop_back(); return;
+                    case double_node: double_values.pop_back(); return;
+                }
+
+                delete elements.back();
+                elements.pop_back();
+            }
+
+            void clear() {
+                for (size_t i = 0; i < elements.size(); i++)
+                    delete elements[i];
+
+                elements.clear();
+                int32_values.clear();
+                int64_values.clear();
+                double_values.clear();
+                packed = 0;
+            }
+    };
+
+    template<> struct type_converter< array > { enum { node_type_code = array_node }; typedef array node_class; };
+
+    inline const array& document::get(const std::string& key, const array& _default) const {
+        if ((find(key) != end()) && (at(key)->get_node_code() == array_node))
+            return *reinterpret_cast<const array*>(at(key));
+        else
+            return _default;
+    }
+
+    inline document& document::set(const std::string& key, const array& value) {
+        if (find(key) != end())
+            delete (*this)[key];
+
+        (*this)[key] = value.copy();
+        return (*this);
+    }
+
+    inline const array& document::get(const key& name, const array& _default) const {
+        const node* value = lookup(name);
+
+        if ((value != NULL) && (value->get_node_code() == array_node))
+            return *reinterpret_cast<const array*>(value);
+        else
+            return _default;
+    }
+
+    inline document& document::set(const key& name, const array& value) {
+        attach(detail::key_string(name), value.copy());
+        return (*this);
+    }
     
     inline node* node::create(node_type type, const void * const buffer, const size_t count) {
         switch (type) {
@@ -501,11 +2405,14 @@ namespace minibson {
             case int32_node: return new int32(buffer, count);
             case int64_node: return new int64(buffer, count);
             case double_node: return new Double(buffer, count);
+            case objectid_node: return new objectid(buffer, count);
+            case datetime_node: return new datetime(buffer, count);
             case document_node: return new document(buffer, count);
+            case array_node: return new array(buffer, count);
             case string_node: return new string(buffer, count);
             case binary_node: return new binary(buffer, count);
             case boolean_node: return new boolean(buffer, count);
             default: return NULL;
         }
     }
-}
+MINIBSON_END_NAMESPACE
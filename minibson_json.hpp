@@ -0,0 +1,1221 @@
+#pragma once
+
+#include "minibson.hpp"
+#include "microbson.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <string>
+#include <vector>
+
+MINIBSON_BEGIN_NAMESPACE
+
+    namespace detail {
+        // Days since 1970-01-01 of a proleptic Gregorian date
+        inline long long days_from_civil(long long year, const unsigned int month, const unsigned int day) {
+            year -= (month <= 2) ? 1 : 0;
+
+            const long long era = ((year >= 0) ? year : year - 399) / 400;
+            const unsigned int year_of_era = static_cast<unsigned int>(year - era * 400);
+            const unsigned int day_of_year = (153 * (month + ((month > 2) ? -3 : 9)) + 2) / 5 + day - 1;
+            const unsigned int day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+
+            return era * 146097 + static_cast<long long>(day_of_era) - 719468;
+        }
+
+        inline unsigned int days_in_month(const long long year, const unsigned int month) {
+            static const unsigned int days[] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+            const bool leap = (year % 4 == 0) && ((year % 100 != 0) || (year % 400 == 0));
+
+            return days[month - 1] + (((month == 2) && leap) ? 1 : 0);
+        }
+
+        inline void civil_from_days(long long days, long long& year, unsigned int& month, unsigned int& day) {
+            days += 719468;
+
+            const long long era = ((days >= 0) ? days : days - 146096) / 146097;
+            const unsigned int day_of_era = static_cast<unsigned int>(days - era * 146097);
+            const unsigned int year_of_era = (day_of_era - day_of_era / 1460 + day_of_era / 36524 - day_of_era / 146096) / 365;
+            const unsigned int day_of_year = day_of_era - (365 * year_of_era + year_of_era / 4 - year_of_era / 100);
+            const unsigned int shifted_month = (5 * day_of_year + 2) / 153;
+
+            day = day_of_year - (153 * shifted_month + 2) / 5 + 1;
+            month = (shifted_month < 10) ? shifted_month + 3 : shifted_month - 9;
+            year = static_cast<long long>(year_of_era) + era * 400 + ((month <= 2) ? 1 : 0);
+        }
+    }
+
+    // JSON output
+
+    // relaxed: plain JSON numbers, wrappers only where JSON has no
+    // equivalent (binary, non-finite doubles). canonical: MongoDB Extended
+    // JSON v2 canonical mode, every number wrapped with its BSON type.
+    enum json_format {
+        relaxed_json,
+        canonical_json
+    };
+
+    // Writes documents of either flavour as JSON into a buffer owned by the
+    // writer. The buffer is only cleared by clear(), so a writer can be
+    // reused across documents without reallocating, or used to concatenate
+    // them.
+    class json_writer {
+        private:
+            std::vector<char> buffer;
+            size_t position;
+            json_format format;
+
+            char* reserve(const size_t count) {
+                if (position + count >= buffer.size())
+                    buffer.resize(std::max(buffer.size() * 2, position + count + 64));
+
+                return &buffer[position];
+            }
+
+            void put(const char value) {
+                *reserve(1) = value;
+                position++;
+            }
+
+            void put(const char* value, const size_t count) {
+                std::memcpy(reserve(count), value, count);
+                position += count;
+            }
+
+            void put(const char* value) {
+                put(value, std::strlen(value));
+            }
+
+            void put_unsigned(unsigned long long value) {
+                static const char digits[] =
+                    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+                    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+                    "8081828384858687888990919293949596979899";
+                char text[20];
+                char* end = text + sizeof(text);
+                char* begin = end;
+
+                while (value >= 100) {
+                    const unsigned int pair = static_cast<unsigned int>(value % 100) * 2;
+
+                    value /= 100;
+                    *--begin = digits[pair + 1];
+                    *--begin = digits[pair];
+                }
+
+                if (value >= 10) {
+                    *--begin = digits[value * 2 + 1];
+                    *--begin = digits[value * 2];
+                }
+                else
+                    *--begin = static_cast<char>('0' + value);
+
+                put(begin, end - begin);
+            }
+
+            void put_integer(const long long value) {
+                if (value < 0) {
+                    put('-');
+                    put_unsigned(0ULL - static_cast<unsigned long long>(value));
+                }
+                else
+                    put_unsigned(static_cast<unsigned long long>(value));
+            }
+
+            // Shortest of %.15g and %.17g that reads back exactly; integral
+            // values below 2^53 skip printf altogether.
+            void put_double(const double value) {
+                char text[32];
+                int count;
+
+                if ((value == std::floor(value)) && (std::fabs(value) < 9007199254740992.0)) {
+                    if ((value == 0.0) && (1.0 / value < 0.0))
+                        put('-');
+
+                    put_integer(static_cast<long long>(value));
+                    put(".0", 2);
+                    return;
+                }
+
+                count = std::sprintf(text, "%.15g", value);
+
+                if (std::strtod(text, NULL) != value)
+                    count = std::sprintf(text, "%.17g", value);
+
+                put(text, count);
+            }
+
+            void put_number(const double value) {
+                const bool finite = (value == value) && (value - value == 0.0);
+
+                if (finite && (format == relaxed_json)) {
+                    put_double(value);
+                    return;
+                }
+
+                put("{\"$numberDouble\":\"");
+
+                if (value != value)
+                    put("NaN");
+                else if (!finite)
+                    put((value > 0) ? "Infinity" : "-Infinity");
+                else
+                    put_double(value);
+
+                put("\"}");
+            }
+
+            void put_number(const int value) {
+                if (format == canonical_json) {
+                    put("{\"$numberInt\":\"");
+                    put_integer(value);
+                    put("\"}");
+                }
+                else
+                    put_integer(value);
+            }
+
+            void put_number(const long long value) {
+                if (format == canonical_json) {
+                    put("{\"$numberLong\":\"");
+                    put_integer(value);
+                    put("\"}");
+                }
+                else
+                    put_integer(value);
+            }
+
+            // Copies runs of plain characters in one go and escapes the rest.
+            void put_string(const char* value, const size_t count) {
+                static const char hex[] = "0123456789abcdef";
+                size_t start = 0;
+
+                put('"');
+
+                for (size_t i = 0; i < count; i++) {
+                    const unsigned char c = static_cast<unsigned char>(value[i]);
+
+                    if ((c >= 0x20) && (c != '"') && (c != '\\'))
+                        continue;
+
+                    put(value + start, i - start);
+                    start = i + 1;
+
+                    switch (c) {
+                        case '"': put("\\\"", 2); break;
+                        case '\\': put("\\\\", 2); break;
+                        case '\b': put("\\b", 2); break;
+                        case '\f': put("\\f", 2); break;
+                        case '\n': put("\\n", 2); break;
+                        case '\r': put("\\r", 2); break;
+                        case '\t': put("\\t", 2); break;
+                        default: {
+                            char escape[6] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 0x0F] };
+
+                            put(escape, sizeof(escape));
+                            break;
+                        }
+                    }
+                }
+
+                put(value + start, count - start);
+                put('"');
+            }
+
+            void put_binary(const void* data, const size_t length, const unsigned char subtype) {
+                static const char alphabet[] =
+                    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+                static const char hex[] = "0123456789abcdef";
+                const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data);
+                const size_t full = length / 3 * 3;
+                char* output;
+                char type[2] = { hex[subtype >> 4], hex[subtype & 0x0F] };
+
+                put("{\"$binary\":{\"base64\":\"");
+                output = reserve((length + 2) / 3 * 4);
+
+                for (size_t i = 0; i < full; i += 3) {
+                    const unsigned int group = (bytes[i] << 16) | (bytes[i + 1] << 8) | bytes[i + 2];
+
+                    *output++ = alphabet[(group >> 18) & 0x3F];
+                    *output++ = alphabet[(group >> 12) & 0x3F];
+                    *output++ = alphabet[(group >> 6) & 0x3F];
+                    *output++ = alphabet[group & 0x3F];
+                }
+
+                if (length > full) {
+                    const unsigned int group = (bytes[full] << 16)
+                        | ((length - full > 1) ? (bytes[full + 1] << 8) : 0);
+
+                    *output++ = alphabet[(group >> 18) & 0x3F];
+                    *output++ = alphabet[(group >> 12) & 0x3F];
+                    *output++ = (length - full > 1) ? alphabet[(group >> 6) & 0x3F] : '=';
+                    *output++ = '=';
+                }
+
+                position += (length + 2) / 3 * 4;
+                put("\",\"subType\":\"");
+                put(type, 2);
+                put("\"}}");
+            }
+
+            // Elements of an array packed with T, false if it isn't one
+            template<typename T, typename A>
+            bool put_numbers(const std::vector<T, A>* values) {
+                if (values == NULL)
+                    return false;
+
+                for (size_t i = 0; i < values->size(); i++) {
+                    if (i > 0)
+                        put(',');
+
+                    put_number((*values)[i]);
+                }
+
+                return true;
+            }
+
+            void put_object_id(const unsigned char* bytes) {
+                static const char hex[] = "0123456789abcdef";
+                char* output;
+
+                put("{\"$oid\":\"");
+                output = reserve(24);
+
+                for (size_t i = 0; i < 12; i++) {
+                    *output++ = hex[bytes[i] >> 4];
+                    *output++ = hex[bytes[i] & 0x0F];
+                }
+
+                position += 24;
+                put("\"}");
+            }
+
+            // Relaxed mode writes ISO-8601 for years 1970 to 9999, as
+            // Extended JSON asks; everything else is milliseconds.
+            void put_datetime(const long long milliseconds) {
+                if ((format == relaxed_json) && (milliseconds >= 0) && (milliseconds < 253402300800000LL)) {
+                    const long long seconds = milliseconds / 1000;
+                    const unsigned int second_of_day = static_cast<unsigned int>(seconds % 86400);
+                    long long year;
+                    unsigned int month;
+                    unsigned int day;
+                    char text[32];
+
+                    detail::civil_from_days(seconds / 86400, year, month, day);
+                    put("{\"$date\":\"");
+                    put(text, std::sprintf(
+                        text,
+                        "%04d-%02u-%02uT%02u:%02u:%02u",
+                        static_cast<int>(year), month, day,
+                        second_of_day / 3600, second_of_day / 60 % 60, second_of_day % 60
+                    ));
+
+                    if (milliseconds % 1000 != 0)
+                        put(text, std::sprintf(text, ".%03d", static_cast<int>(milliseconds % 1000)));
+
+                    put("Z\"}");
+                    return;
+                }
+
+                put("{\"$date\":{\"$numberLong\":\"");
+                put_integer(milliseconds);
+                put("\"}}");
+            }
+
+            void write_value(const node& value) {
+                switch (value.get_node_code()) {
+                    case null_node:
+                        put("null", 4);
+                        break;
+                    case boolean_node:
+                        if (static_cast<const boolean&>(value).get_value())
+                            put("true", 4);
+                        else
+                            put("false", 5);
+                        break;
+                    case int32_node:
+                        put_number(static_cast<const int32&>(value).get_value());
+                        break;
+                    case int64_node:
+                        put_number(static_cast<const int64&>(value).get_value());
+                        break;
+                    case double_node:
+                        put_number(static_cast<const Double&>(value).get_value());
+                        break;
+                    case objectid_node:
+                        put_object_id(static_cast<const objectid&>(value).get_value().bytes);
+                        break;
+                    case datetime_node:
+                        put_datetime(static_cast<const datetime&>(value).get_value().milliseconds);
+                        break;
+                    case string_node: {
+                        const std::string& text = static_cast<const string&>(value).get_value();
+
+                        put_string(text.data(), text.length());
+                        break;
+                    }
+                    case binary_node: {
+                        const binary::buffer& data = static_cast<const binary&>(value).get_value();
+
+                        put_binary(data.data, data.length, 0);
+                        break;
+                    }
+                    case document_node:
+                        write(static_cast<const document&>(value));
+                        break;
+                    case array_node: {
+                        const array& elements = static_cast<const array&>(value);
+
+                        put('[');
+
+                        if (put_numbers(elements.get_values<int>())
+                            || put_numbers(elements.get_values<long long int>())
+                            || put_numbers(elements.get_values<double>())) {
+                            put(']');
+                            break;
+                        }
+
+                        for (size_t i = 0; i < elements.size(); i++) {
+                            if (i > 0)
+                                put(',');
+
+                            write_value(*elements.at(i));
+                        }
+
+                        put(']');
+                        break;
+                    }
+                    default:
+                        put("null", 4);
+                        break;
+                }
+            }
+
+            void write_value(const microbson::node& value) {
+                const char* data = reinterpret_cast<const char*>(value.get_data());
+
+                switch (value.get_type()) {
+                    case microbson::null_node:
+                        put("null", 4);
+                        break;
+                    case microbson::boolean_node:
+                        if (*data)
+                            put("true", 4);
+                        else
+                            put("false", 5);
+                        break;
+                    case microbson::int32_node:
+                        put_number(*reinterpret_cast<const int*>(data));
+                        break;
+                    case microbson::int64_node:
+                        put_number(*reinterpret_cast<const long long*>(data));
+                        break;
+                    case microbson::double_node:
+                        put_number(*reinterpret_cast<const double*>(data));
+                        break;
+                    case microbson::objectid_node:
+                        put_object_id(reinterpret_cast<const unsigned char*>(data));
+                        break;
+                    case microbson::datetime_node:
+                        put_datetime(*reinterpret_cast<const long long*>(data));
+                        break;
+                    case microbson::string_node:
+                        put_string(data + 4, *reinterpret_cast<const int*>(data) - 1);
+                        break;
+                    case microbson::binary_node:
+                        put_binary(data + 5, *reinterpret_cast<const int*>(data), data[4]);
+                        break;
+                    case microbson::document_node:
+                        write(microbson::document(
+                            const_cast<char*>(data),
+                            *reinterpret_cast<const int*>(data)
+                        ));
+                        break;
+                    case microbson::array_node: {
+                        const microbson::document elements(
+                            const_cast<char*>(data),
+                            *reinterpret_cast<const int*>(data)
+                        );
+
+                        put('[');
+
+                        for (microbson::document::const_iterator i = elements.begin(); i != elements.end(); ++i) {
+                            if (i != elements.begin())
+                                put(',');
+
+                            write_value(*i);
+                        }
+
+                        put(']');
+                        break;
+                    }
+                    default:
+                        put("null", 4);
+                        break;
+                }
+            }
+
+        public:
+            explicit json_writer(const json_format format = relaxed_json) : position(0), format(format) { }
+
+            json_writer& write(const element_list& value) {
+                bool first = true;
+
+                put('{');
+
+                for (element_list::const_iterator i = value.begin(); i != value.end(); i++) {
+                    if (!first)
+                        put(',');
+
+                    first = false;
+                    put_string(i->first.data(), i->first.length());
+                    put(':');
+                    write_value(*i->second);
+                }
+
+                put('}');
+                return (*this);
+            }
+
+            json_writer& write(const microbson::document& value) {
+                bool first = true;
+
+                put('{');
+
+                for (microbson::document::const_iterator i = value.begin(); i != value.end(); ++i) {
+                    if (!first)
+                        put(',');
+
+                    first = false;
+                    put_string(i->get_name(), std::strlen(i->get_name()));
+                    put(':');
+                    write_value(*i);
+                }
+
+                put('}');
+                return (*this);
+            }
+
+            // Separator between concatenated documents (e.g. '\n' for JSON lines)
+            json_writer& write(const char separator) {
+                put(separator);
+                return (*this);
+            }
+
+            void clear() { position = 0; }
+
+            const char* data() const { return buffer.empty() ? "" : &buffer[0]; }
+
+            size_t size() const { return position; }
+
+            std::string str() const { return std::string(data(), position); }
+    };
+
+    // JSON input
+
+    // Parses JSON text straight into a BSON datastream, with no intermediate
+    // tree: values are appended as they are read and document lengths are
+    // patched once their closing brace is reached. Integers become int32
+    // when they fit, int64 otherwise, and double when they don't fit either
+    // (as type_converter would pick for int, long long and double); numbers
+    // with a fraction or exponent become double. Arrays are written as BSON
+    // arrays. The Extended JSON wrappers produced by json_writer
+    // ($numberInt, $numberLong, $numberDouble, $binary, $oid, $date) are
+    // read back into their BSON types.
+    class json_reader {
+        private:
+            std::vector<char> buffer;
+            size_t position;
+            const char* begin;
+            const char* cursor;
+            const char* end;
+            const char* error;
+            size_t depth;
+            size_t max_depth;
+
+            char* reserve(const size_t count) {
+                if (position + count >= buffer.size())
+                    buffer.resize(std::max(buffer.size() * 2, position + count + 64));
+
+                return &buffer[position];
+            }
+
+            void put(const char value) {
+                *reserve(1) = value;
+                position++;
+            }
+
+            void put(const void* value, const size_t count) {
+                std::memcpy(reserve(count), value, count);
+                position += count;
+            }
+
+            template<typename T>
+            void put_value(const T value) {
+                put(&value, sizeof(T));
+            }
+
+            void patch(const size_t at, const int value) {
+                std::memcpy(&buffer[at], &value, sizeof(int));
+            }
+
+            bool fail() {
+                if (error == NULL)
+                    error = cursor;
+
+                return false;
+            }
+
+            void skip_space() {
+                while ((cursor < end) && ((*cursor == ' ') || (*cursor == '\t') || (*cursor == '\n') || (*cursor == '\r')))
+                    cursor++;
+            }
+
+            bool expect(const char value) {
+                skip_space();
+
+                if ((cursor >= end) || (*cursor != value))
+                    return fail();
+
+                cursor++;
+                return true;
+            }
+
+            bool parse_literal(const char* text, const size_t count) {
+                if ((static_cast<size_t>(end - cursor) < count) || (std::memcmp(cursor, text, count) != 0))
+                    return fail();
+
+                cursor += count;
+                return true;
+            }
+
+            bool parse_hex(unsigned long& code) {
+                code = 0;
+
+                if (end - cursor < 4)
+                    return fail();
+
+                for (int i = 0; i < 4; i++, cursor++) {
+                    const char c = *cursor;
+
+                    code <<= 4;
+
+                    if ((c >= '0') && (c <= '9'))
+                        code |= c - '0';
+                    else if ((c >= 'a') && (c <= 'f'))
+                        code |= c - 'a' + 10;
+                    else if ((c >= 'A') && (c <= 'F'))
+                        code |= c - 'A' + 10;
+                    else
+                        return fail();
+                }
+
+                return true;
+            }
+
+            void put_utf8(const unsigned long code) {
+                if (code < 0x80)
+                    put(static_cast<char>(code));
+                else if (code < 0x800) {
+                    put(static_cast<char>(0xC0 | (code >> 6)));
+                    put(static_cast<char>(0x80 | (code & 0x3F)));
+                }
+                else if (code < 0x10000) {
+                    put(static_cast<char>(0xE0 | (code >> 12)));
+                    put(static_cast<char>(0x80 | ((code >> 6) & 0x3F)));
+                    put(static_cast<char>(0x80 | (code & 0x3F)));
+                }
+                else {
+                    put(static_cast<char>(0xF0 | (code >> 18)));
+                    put(static_cast<char>(0x80 | ((code >> 12) & 0x3F)));
+                    put(static_cast<char>(0x80 | ((code >> 6) & 0x3F)));
+                    put(static_cast<char>(0x80 | (code & 0x3F)));
+                }
+            }
+
+            // Appends the UTF-8 contents of a JSON string (cursor on the
+            // opening quote), copying unescaped runs in one go.
+            bool parse_string() {
+                cursor++;
+
+                while (true) {
+                    const char* start = cursor;
+
+                    while ((cursor < end) && (*cursor != '"') && (*cursor != '\\') && (static_cast<unsigned char>(*cursor) >= 0x20))
+                        cursor++;
+
+                    put(start, cursor - start);
+
+                    if ((cursor >= end) || ((*cursor != '"') && (*cursor != '\\')))
+                        return fail();
+
+                    if (*cursor++ == '"')
+                        return true;
+
+                    if (cursor >= end)
+                        return fail();
+
+                    switch (*cursor++) {
+                        case '"': put('"'); break;
+                        case '\\': put('\\'); break;
+                        case '/': put('/'); break;
+                        case 'b': put('\b'); break;
+                        case 'f': put('\f'); break;
+                        case 'n': put('\n'); break;
+                        case 'r': put('\r'); break;
+                        case 't': put('\t'); break;
+                        case 'u': {
+                            unsigned long code;
+
+                            if (!parse_hex(code))
+                                return false;
+
+                            if ((code >= 0xD800) && (code < 0xDC00)) {
+                                unsigned long low;
+
+                                if (!parse_literal("\\u", 2) || !parse_hex(low) || (low < 0xDC00) || (low >= 0xE000))
+                                    return fail();
+
+                                code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+                            }
+                            else if ((code >= 0xDC00) && (code < 0xE000))
+                                return fail();
+
+                            put_utf8(code);
+                            break;
+                        }
+                        default:
+                            cursor--;
+                            return fail();
+                    }
+                }
+            }
+
+            // Reads a JSON string into text (for Extended JSON wrappers).
+            bool parse_string(std::string& text) {
+                const size_t start = position;
+
+                skip_space();
+
+                if ((cursor >= end) || (*cursor != '"') || !parse_string())
+                    return fail();
+
+                text.assign(&buffer[start], position - start);
+                position = start;
+                return true;
+            }
+
+            // Element name; cursor on the opening quote
+            bool parse_name() {
+                const size_t start = position;
+
+                if (!parse_string())
+                    return false;
+
+                if (std::memchr(&buffer[start], 0, position - start) != NULL)
+                    return fail();
+
+                put('\0');
+                return true;
+            }
+
+            bool parse_number(const size_t type) {
+                const char* start = cursor;
+                bool integer = true;
+                bool negative = false;
+                unsigned long long magnitude = 0;
+                bool overflow = false;
+
+                if ((cursor < end) && (*cursor == '-')) {
+                    negative = true;
+                    cursor++;
+                }
+
+                if ((cursor >= end) || (*cursor < '0') || (*cursor > '9'))
+                    return fail();
+
+                for (; (cursor < end) && (*cursor >= '0') && (*cursor <= '9'); cursor++) {
+                    const unsigned int digit = *cursor - '0';
+
+                    if (magnitude > (~0ULL - digit) / 10)
+                        overflow = true;
+                    else
+                        magnitude = magnitude * 10 + digit;
+                }
+
+                if ((cursor < end) && (*cursor == '.')) {
+                    integer = false;
+                    cursor++;
+
+                    if ((cursor >= end) || (*cursor < '0') || (*cursor > '9'))
+                        return fail();
+
+                    while ((cursor < end) && (*cursor >= '0') && (*cursor <= '9'))
+                        cursor++;
+                }
+
+                if ((cursor < end) && ((*cursor == 'e') || (*cursor == 'E'))) {
+                    integer = false;
+                    cursor++;
+
+                    if ((cursor < end) && ((*cursor == '+') || (*cursor == '-')))
+                        cursor++;
+
+                    if ((cursor >= end) || (*cursor < '0') || (*cursor > '9'))
+                        return fail();
+
+                    while ((cursor < end) && (*cursor >= '0') && (*cursor <= '9'))
+                        cursor++;
+                }
+
+                if (integer && !overflow) {
+                    if (negative ? (magnitude <= 0x80000000ULL) : (magnitude <= 0x7FFFFFFFULL)) {
+                        buffer[type] = int32_node;
+                        put_value(static_cast<int>(negative ? -static_cast<long long>(magnitude) : static_cast<long long>(magnitude)));
+                        return true;
+                    }
+
+                    if (negative ? (magnitude <= 0x8000000000000000ULL) : (magnitude <= 0x7FFFFFFFFFFFFFFFULL)) {
+                        buffer[type] = int64_node;
+                        put_value(negative ? static_cast<long long>(0ULL - magnitude) : static_cast<long long>(magnitude));
+                        return true;
+                    }
+                }
+
+                // strtod needs a terminated copy of the token
+                const std::string text(start, cursor);
+
+                buffer[type] = double_node;
+                put_value(std::strtod(text.c_str(), NULL));
+                return true;
+            }
+
+            bool parse_base64(const std::string& text, const char subtype) {
+                const size_t start = position;
+                unsigned long group = 0;
+                int bits = 0;
+
+                put_value(0);
+                put(subtype);
+
+                for (size_t i = 0; i < text.length(); i++) {
+                    const char c = text[i];
+                    int value;
+
+                    if ((c >= 'A') && (c <= 'Z')) value = c - 'A';
+                    else if ((c >= 'a') && (c <= 'z')) value = c - 'a' + 26;
+                    else if ((c >= '0') && (c <= '9')) value = c - '0' + 52;
+                    else if (c == '+') value = 62;
+                    else if (c == '/') value = 63;
+                    else if (c == '=') break;
+                    else return fail();
+
+                    group = (group << 6) | value;
+                    bits += 6;
+
+                    if (bits >= 8) {
+                        bits -= 8;
+                        put(static_cast<char>((group >> bits) & 0xFF));
+                    }
+                }
+
+                patch(start, static_cast<int>(position - start - sizeof(int) - 1));
+                return true;
+            }
+
+            // Decimal digits of a $numberInt or $numberLong, with an optional
+            // minus sign. Fails on anything else and on values out of
+            // [-max - 1, max].
+            static bool parse_integer(const std::string& text, const unsigned long long max, long long& value) {
+                const bool negative = !text.empty() && (text[0] == '-');
+                const unsigned long long limit = negative ? max + 1 : max;
+                unsigned long long magnitude = 0;
+                size_t i = negative ? 1 : 0;
+
+                if (i == text.length())
+                    return false;
+
+                for (; i < text.length(); i++) {
+                    const unsigned int digit = text[i] - '0';
+
+                    if ((text[i] < '0') || (text[i] > '9') || (magnitude > (limit - digit) / 10))
+                        return false;
+
+                    magnitude = magnitude * 10 + digit;
+                }
+
+                value = negative ? static_cast<long long>(0ULL - magnitude) : static_cast<long long>(magnitude);
+                return true;
+            }
+
+            // Decimal "$numberDouble" text, read whole: strtod alone would
+            // also skip whitespace, read hex and inf, and stop at the first
+            // character it can't use
+            static bool parse_double(const std::string& text, double& value) {
+                char* used;
+
+                if (text.empty() || (text.find_first_not_of("0123456789+-.eE") != std::string::npos))
+                    return false;
+
+                value = std::strtod(text.c_str(), &used);
+                return used == text.c_str() + text.length();
+            }
+
+            // ISO-8601 "YYYY-MM-DDTHH:MM:SS[.fff]Z" or with a +HH:MM / -HH:MM
+            // offset instead of Z
+            static bool parse_datetime(const std::string& text, long long& milliseconds) {
+                int year, month, day, hour, minute, second;
+                int used = 0;
+                const char* rest;
+                long long fraction = 0;
+                long long scale = 1000;
+
+                if ((std::sscanf(text.c_str(), "%4d-%2d-%2dT%2d:%2d:%2d%n", &year, &month, &day, &hour, &minute, &second, &used) != 6) || (used != 19))
+                    return false;
+
+                if ((month < 1) || (month > 12) || (day < 1) || (day > static_cast<int>(detail::days_in_month(year, month)))
+                    || (hour < 0) || (hour > 23) || (minute < 0) || (minute > 59) || (second < 0) || (second > 59))
+                    return false;
+
+                rest = text.c_str() + used;
+
+                if (*rest == '.')
+                    for (rest++; (*rest >= '0') && (*rest <= '9'); rest++)
+                        if (scale > 1) {
+                            scale /= 10;
+                            fraction += (*rest - '0') * scale;
+                        }
+
+                milliseconds = (
+                    detail::days_from_civil(year, month, day) * 86400LL
+                        + hour * 3600 + minute * 60 + second
+                ) * 1000 + fraction;
+
+                if ((rest[0] == 'Z') && (rest[1] == '\0'))
+                    return true;
+
+                if (((rest[0] == '+') || (rest[0] == '-')) && (std::strlen(rest) == 6) && (rest[3] == ':')) {
+                    for (int i = 1; i < 6; i++)
+                        if ((i != 3) && ((rest[i] < '0') || (rest[i] > '9')))
+                            return false;
+
+                    if ((rest[1] - '0') * 10 + (rest[2] - '0') > 23 || (rest[4] > '5'))
+                        return false;
+
+                    const long long offset = ((rest[1] - '0') * 600 + (rest[2] - '0') * 60 + (rest[4] - '0') * 10 + (rest[5] - '0')) * 60000LL;
+
+                    milliseconds += (rest[0] == '+') ? -offset : offset;
+                    return true;
+                }
+
+                return false;
+            }
+
+            // Extended JSON wrapper whose key has already been read; cursor
+            // after the key.
+            bool parse_wrapper(const size_t type, const std::string& key) {
+                std::string text;
+
+                if (!expect(':'))
+                    return false;
+
+                if (key == "$binary") {
+                    std::string field;
+                    std::string data;
+                    std::string subtype("00");
+
+                    if (!expect('{'))
+                        return false;
+
+                    while (true) {
+                        if (!parse_string(field) || !expect(':') || !parse_string(text))
+                            return false;
+
+                        if (field == "base64")
+                            data = text;
+                        else if (field == "subType")
+                            subtype = text;
+                        else
+                            return fail();
+
+                        skip_space();
+
+                        if ((cursor >= end) || (*cursor != ','))
+                            break;
+
+                        cursor++;
+                    }
+
+                    if (!expect('}'))
+                        return false;
+
+                    buffer[type] = binary_node;
+
+                    return parse_base64(
+                        data,
+                        static_cast<char>(std::strtol(subtype.c_str(), NULL, 16))
+                    );
+                }
+
+                if (key == "$date") {
+                    std::string field;
+                    long long milliseconds;
+
+                    skip_space();
+                    buffer[type] = datetime_node;
+
+                    if ((cursor < end) && (*cursor == '{')) {
+                        cursor++;
+
+                        if (!parse_string(field) || (field != "$numberLong") || !expect(':') || !parse_string(text)
+                            || !parse_integer(text, std::numeric_limits<long long>::max(), milliseconds) || !expect('}'))
+                            return fail();
+
+                        put_value(milliseconds);
+                        return true;
+                    }
+
+                    if (!parse_string(text) || !parse_datetime(text, milliseconds))
+                        return fail();
+
+                    put_value(milliseconds);
+                    return true;
+                }
+
+                if (!parse_string(text))
+                    return false;
+
+                if (key == "$oid") {
+                    char* output;
+
+                    if (text.length() != 24)
+                        return fail();
+
+                    buffer[type] = objectid_node;
+                    output = reserve(12);
+
+                    for (size_t i = 0; i < 24; i++) {
+                        const char c = text[i];
+                        int value;
+
+                        if ((c >= '0') && (c <= '9')) value = c - '0';
+                        else if ((c >= 'a') && (c <= 'f')) value = c - 'a' + 10;
+                        else if ((c >= 'A') && (c <= 'F')) value = c - 'A' + 10;
+                        else return fail();
+
+                        output[i / 2] = static_cast<char>((i % 2) ? (output[i / 2] | value) : (value << 4));
+                    }
+
+                    position += 12;
+                }
+                else if (key == "$numberInt") {
+                    long long value;
+
+                    if (!parse_integer(text, std::numeric_limits<int>::max(), value))
+                        return fail();
+
+                    buffer[type] = int32_node;
+                    put_value(static_cast<int>(value));
+                }
+                else if (key == "$numberLong") {
+                    long long value;
+
+                    if (!parse_integer(text, std::numeric_limits<long long>::max(), value))
+                        return fail();
+
+                    buffer[type] = int64_node;
+                    put_value(value);
+                }
+                else {
+                    double value;
+
+                    if (text == "NaN")
+                        value = std::numeric_limits<double>::quiet_NaN();
+                    else if (text == "Infinity")
+                        value = std::numeric_limits<double>::infinity();
+                    else if (text == "-Infinity")
+                        value = -std::numeric_limits<double>::infinity();
+                    else if (!parse_double(text, value))
+                        return fail();
+
+                    buffer[type] = double_node;
+                    put_value(value);
+                }
+
+                return true;
+            }
+
+            // Document body; cursor on the opening brace. With array set,
+            // element names are the decimal indexes instead.
+            bool parse_document(const bool array) {
+                const size_t start = position;
+                const char close = array ? ']' : '}';
+                unsigned long index = 0;
+
+                if (++depth > max_depth)
+                    return fail();
+
+                put_value(0);
+                cursor++;
+                skip_space();
+
+                if ((cursor < end) && (*cursor == close))
+                    cursor++;
+                else
+                    while (true) {
+                        const size_t type = position;
+
+                        skip_space();
+                        put('\0');
+
+                        if (array) {
+                            char name[24];
+
+                            put(name, std::sprintf(name, "%lu", index++) + 1);
+                        }
+                        else if ((cursor >= end) || (*cursor != '"') || !parse_name() || !expect(':'))
+                            return fail();
+
+                        if (!parse_value(type))
+                            return false;
+
+                        skip_space();
+
+                        if ((cursor < end) && (*cursor == ',')) {
+                            cursor++;
+                            continue;
+                        }
+
+                        if ((cursor < end) && (*cursor == close)) {
+                            cursor++;
+                            break;
+                        }
+
+                        return fail();
+                    }
+
+                put('\0');
+                patch(start, static_cast<int>(position - start));
+                depth--;
+                return true;
+            }
+
+            // Value of the element whose type byte is at the given position
+            bool parse_value(const size_t type) {
+                skip_space();
+
+                if (cursor >= end)
+                    return fail();
+
+                switch (*cursor) {
+                    case '{': {
+                        const char* object = cursor;
+                        std::string key;
+
+                        cursor++;
+                        skip_space();
+
+                        if ((end - cursor > 1) && (cursor[0] == '"') && (cursor[1] == '$')) {
+                            if (!parse_string(key))
+                                return false;
+
+                            if ((key == "$numberInt") || (key == "$numberLong") || (key == "$numberDouble") || (key == "$binary")
+                                || (key == "$oid") || (key == "$date"))
+                                return parse_wrapper(type, key) && expect('}');
+                        }
+
+                        cursor = object;
+                        buffer[type] = document_node;
+                        return parse_document(false);
+                    }
+                    case '[':
+                        buffer[type] = array_node;
+                        return parse_document(true);
+                    case '"': {
+                        const size_t start = position;
+
+                        buffer[type] = string_node;
+                        put_value(0);
+
+                        if (!parse_string())
+                            return false;
+
+                        put('\0');
+                        patch(start, static_cast<int>(position - start - sizeof(int)));
+                        return true;
+                    }
+                    case 't':
+                        buffer[type] = boolean_node;
+                        put('\1');
+                        return parse_literal("true", 4);
+                    case 'f':
+                        buffer[type] = boolean_node;
+                        put('\0');
+                        return parse_literal("false", 5);
+                    case 'n':
+                        buffer[type] = null_node;
+                        return parse_literal("null", 4);
+                    default:
+                        return parse_number(type);
+                }
+            }
+
+        public:
+            json_reader() : position(0), begin(NULL), cursor(NULL), end(NULL), error(NULL), depth(0), max_depth(100) { }
+
+            // Nesting of documents and arrays beyond which parse() fails,
+            // rather than run out of stack; 100 by default
+            void set_max_depth(const size_t value) { max_depth = value; }
+
+            // Parses one JSON object. Returns false on malformed input, in
+            // which case get_error_position() tells where parsing stopped.
+            bool parse(const char* text, const size_t length) {
+                position = 0;
+                begin = cursor = text;
+                end = text + length;
+                error = NULL;
+                depth = 0;
+
+                skip_space();
+
+                if ((cursor >= end) || (*cursor != '{') || !parse_document(false)) {
+                    fail();
+                    position = 0;
+                    return false;
+                }
+
+                skip_space();
+
+                if (cursor != end) {
+                    fail();
+                    position = 0;
+                    return false;
+                }
+
+                return true;
+            }
+
+            bool parse(const std::string& text) {
+                return parse(text.data(), text.length());
+            }
+
+            size_t get_error_position() const {
+                return (error != NULL) ? error - begin : 0;
+            }
+
+            // BSON datastream of the last successful parse
+            const char* data() const { return buffer.empty() ? NULL : &buffer[0]; }
+
+            size_t size() const { return position; }
+
+            document get_document() const {
+                return (position > 0) ? document(data(), size()) : document();
+            }
+    };
+MINIBSON_END_NAMESPACE
@@ -0,0 +1,264 @@
+#pragma once
+
+#include "minibson.hpp"
+#include "microbson.hpp"
+#include "microbson_parallel.hpp"
+
+#include <cstddef>
+#include <cstring>
+#include <set>
+#include <string>
+#include <vector>
+
+MINIBSON_BEGIN_NAMESPACE
+
+    namespace detail {
+        // Part of a document serialized on its own: a whole element, or the
+        // head (type, name and length) or terminator of a document element
+        // whose children were split into pieces of their own.
+        struct piece {
+            enum kind_type { element_piece, head_piece, tail_piece };
+
+            kind_type kind;
+            const std::string* name;
+            const node* value;
+            size_t value_size;
+            size_t offset;
+
+            size_t get_size() const {
+                switch (kind) {
+                    case head_piece: return 1 + name->length() + 1 + 4;
+                    case tail_piece: return 1;
+                    default: return 1 + name->length() + 1 + value_size;
+                }
+            }
+        };
+
+        struct size_task {
+            std::vector<piece>* pieces;
+            size_t first;
+
+            void operator()(const size_t index) {
+                piece& _piece = (*pieces)[first + index];
+
+                _piece.value_size = _piece.value->get_serialized_size();
+            }
+        };
+
+        struct write_task {
+            const std::vector<piece>* pieces;
+            unsigned char* buffer;
+
+            void operator()(const size_t index) {
+                const piece& _piece = (*pieces)[index];
+                unsigned char* position = buffer + _piece.offset;
+
+                if (_piece.kind == piece::tail_piece) {
+                    *position = 0;
+                    return;
+                }
+
+                *position++ = _piece.value->get_node_code();
+                std::memcpy(position, _piece.name->c_str(), _piece.name->length() + 1);
+                position += _piece.name->length() + 1;
+
+                if (_piece.kind == piece::head_piece)
+                    *reinterpret_cast<int*>(position) = static_cast<int>(_piece.value_size);
+                else
+                    _piece.value->serialize(position, _piece.value_size);
+            }
+        };
+
+        // Appends the elements of a list as pieces and sizes them.
+        inline void add_pieces(const element_list& list, std::vector<piece>& pieces, const size_t at, const size_t threads) {
+            std::vector<piece> added;
+            size_task task;
+
+            for (element_list::const_iterator i = list.begin(); i != list.end(); i++) {
+                piece _piece;
+
+                _piece.kind = piece::element_piece;
+                _piece.name = &static_cast<const std::string&>(i->first);
+                _piece.value = i->second;
+                _piece.value_size = 0;
+                _piece.offset = 0;
+                added.push_back(_piece);
+            }
+
+            pieces.insert(pieces.begin() + at, added.begin(), added.end());
+            task.pieces = &pieces;
+            task.first = at;
+            microbson::parallel_for(added.size(), task, threads);
+        }
+    }
+
+    // Serializes a document exactly as document::serialize() does, with the
+    // work spread over threads (all the cores when 0). The top-level
+    // elements are sized and written concurrently; while there are fewer
+    // than four of them per thread, the largest sub-document is split into
+    // its own elements, so one huge section doesn't end up on one thread.
+    // Writes nothing if the buffer is too small.
+    inline void serialize_parallel(const document& value, void* const buffer, const size_t count, size_t threads = 0) {
+        std::vector<detail::piece> pieces;
+        detail::write_task task;
+        size_t elements;
+        size_t position = 4;
+
+        if (threads == 0)
+            threads = microbson::hardware_threads();
+
+        detail::add_pieces(value, pieces, 0, threads);
+        elements = pieces.size();
+
+        while (elements < 4 * threads) {
+            size_t largest = pieces.size();
+
+            for (size_t i = 0; i < pieces.size(); i++)
+                if ((pieces[i].kind == detail::piece::element_piece)
+                    && (pieces[i].value->get_node_code() == document_node)
+                    && ((largest == pieces.size()) || (pieces[i].value_size > pieces[largest].value_size)))
+                    largest = i;
+
+            if (largest == pieces.size())
+                break;
+
+            const element_list& list = *static_cast<const document*>(pieces[largest].value);
+            detail::piece tail = pieces[largest];
+            const size_t before = pieces.size();
+
+            pieces[largest].kind = detail::piece::head_piece;
+            tail.kind = detail::piece::tail_piece;
+            pieces.insert(pieces.begin() + largest + 1, tail);
+            detail::add_pieces(list, pieces, largest + 1, threads);
+            elements = elements + (pieces.size() - before - 1) - 1;
+        }
+
+        for (size_t i = 0; i < pieces.size(); i++) {
+            pieces[i].offset = position;
+            position += pieces[i].get_size();
+        }
+
+        if (count < position + 1)
+            return;
+
+        *reinterpret_cast<int*>(buffer) = static_cast<int>(position + 1);
+        reinterpret_cast<unsigned char*>(buffer)[position] = 0;
+        task.pieces = &pieces;
+        task.buffer = reinterpret_cast<unsigned char*>(buffer);
+        microbson::parallel_for(pieces.size(), task, threads);
+    }
+
+    namespace detail {
+        // Element found by the skip pass, parsed on its own. Expanded
+        // document elements are created up front and their children become
+        // items of their own.
+        struct parse_item {
+            element_list* parent;
+            const char* name;
+            node_type type;
+            const void* data;
+            size_t size;
+            bool expanded;
+            node* result;
+        };
+
+        struct parse_task {
+            std::vector<parse_item>* items;
+            key_table* table;
+
+            // Names are interned in the caller's table, not the workers'
+            void operator()(const size_t index) {
+                parse_item& item = (*items)[index];
+                scoped_key_table scope(*table);
+
+                if (!item.expanded)
+                    item.result = node::create(item.type, item.data, item.size);
+            }
+        };
+
+        // Lists the elements of a serialized document, skipping over their
+        // values without parsing them.
+        inline void add_items(element_list* parent, const void* bytes, std::vector<parse_item>& items, const size_t at) {
+            const microbson::document source(const_cast<void*>(bytes), *reinterpret_cast<const int*>(bytes));
+            std::vector<parse_item> added;
+
+            for (microbson::document::const_iterator i = source.begin(); i != source.end(); ++i) {
+                parse_item item;
+
+                item.parent = parent;
+                item.name = i->get_name();
+                item.type = static_cast<node_type>(i->get_type());
+                item.data = i->get_data();
+                item.size = i->get_data_size();
+                item.expanded = false;
+                item.result = NULL;
+                added.push_back(item);
+            }
+
+            items.insert(items.begin() + at, added.begin(), added.end());
+        }
+    }
+
+    // Parses a serialized document into result, as document's constructor
+    // would, on several threads (all the cores when 0). A skip pass finds
+    // the top-level elements, which are then parsed concurrently; while
+    // there are fewer than four per thread, the largest sub-document is
+    // split into its own elements as well. Documents smaller than threshold
+    // bytes are parsed on the calling thread. Elements are added to result,
+    // replacing those of the same name. Under MINIBSON_MEMORY_RESOURCE the
+    // workers allocate from their own current resource, as the caller's
+    // need not be thread safe.
+    inline void deserialize_parallel(const void* const buffer, const size_t count, document& result, const size_t threshold = 1 << 20, size_t threads = 0) {
+        std::vector<detail::parse_item> items;
+        std::set<const element_list*> stopped;
+        detail::parse_task task;
+
+        if ((count < 5) || (static_cast<size_t>(*reinterpret_cast<const int*>(buffer)) > count))
+            return;
+
+        if (count < threshold)
+            threads = 1;
+        else if (threads == 0)
+            threads = microbson::hardware_threads();
+
+        detail::add_items(&result, buffer, items, 0);
+
+        while (items.size() < 4 * threads) {
+            size_t largest = items.size();
+
+            for (size_t i = 0; i < items.size(); i++)
+                if (!items[i].expanded
+                    && (items[i].type == document_node)
+                    && ((largest == items.size()) || (items[i].size > items[largest].size)))
+                    largest = i;
+
+            if ((threads == 1) || (largest == items.size()))
+                break;
+
+            items[largest].expanded = true;
+            items[largest].result = new document();
+            detail::add_items(static_cast<document*>(items[largest].result), items[largest].data, items, largest + 1);
+        }
+
+        task.items = &items;
+        task.table = &get_key_table();
+        microbson::parallel_for(items.size(), task, threads);
+
+        // Sequential parsing stops at the first element of a type it can't
+        // read; so does every parent here.
+        for (size_t i = 0; i < items.size(); i++) {
+            detail::parse_item& item = items[i];
+
+            if (stopped.count(item.parent) > 0) {
+                if (item.expanded)
+                    stopped.insert(static_cast<document*>(item.result));
+
+                delete item.result;
+            }
+            else if (item.result == NULL)
+                stopped.insert(item.parent);
+            else
+                item.parent->attach(item.name, item.result);
+        }
+    }
+MINIBSON_END_NAMESPACE
@@ -1,14 +1,76 @@
 #include "minibson.hpp"
 #include "microbson.hpp"
+#include "microbson_aggregate.hpp"
+#include "microbson_blocks.hpp"
+#include "microbson_columns.hpp"
+#include "microbson_columnar.hpp"
+#include "microbson_dictionary.hpp"
+#include "microbson_index.hpp"
+#include "microbson_schema.hpp"
+#include "microbson_snapshot.hpp"
+#include "microbson_sort.hpp"
+#include "microbson_struct.hpp"
+#include "minibson_json.hpp"
+#include "minibson_parallel.hpp"
 #include <cassert>
 
 void test_minibson();
 void test_microbson();
+void test_projection();
+void test_aggregate();
+void test_columns();
+void test_columnar();
+void test_index();
+void test_sort();
+void test_json_writer();
+void test_json_reader();
+void test_array();
+void test_skip_table();
+void test_packed_array();
+void test_object_id();
+void test_snapshot();
+void test_serialize_parallel();
+void test_deserialize_parallel();
+void test_node_pool();
+void test_assign_from();
+void test_memory_resource();
+void test_memory_usage();
+void test_struct_binding();
+void test_schema();
+void test_keys();
+void test_key_table();
+void test_key_dictionary();
+void test_block_compression();
 
 int main()
 {
     test_minibson();
     test_microbson();
+    test_projection();
+    test_aggregate();
+    test_columns();
+    test_columnar();
+    test_index();
+    test_sort();
+    test_json_writer();
+    test_json_reader();
+    test_array();
+    test_skip_table();
+    test_packed_array();
+    test_object_id();
+    test_snapshot();
+    test_serialize_parallel();
+    test_deserialize_parallel();
+    test_node_pool();
+    test_assign_from();
+    test_memory_resource();
+    test_memory_usage();
+    test_struct_binding();
+    test_schema();
+    test_keys();
+    test_key_table();
+    test_key_dictionary();
+    test_block_compression();
     return 0;
 }
 
@@ -103,3 +165,1814 @@ void test_microbson()
     
     delete[] buffer;
 }
+
+void test_projection()
+{
+    using namespace std;
+
+    minibson::document d;
+
+    d.set("int32", 1);
+    d.set("string", "text");
+    d.set("binary", minibson::binary::buffer(&d, sizeof(d)));
+    d.set("document", minibson::document().set("a", 3).set("b", 4));
+
+    size_t size = d.get_serialized_size();
+    char* buffer = new char[size];
+    char* output = new char[size];
+    d.serialize(buffer, size);
+
+    microbson::document m(buffer, size);
+    vector<string> fields;
+
+    fields.push_back("string");
+    fields.push_back("document.b");
+
+    size_t written = microbson::projection(fields).apply(m, output, size);
+    microbson::document p(output, written);
+
+    assert(written > 0 && p.valid());
+    assert(!p.contains("int32") && !p.contains("binary"));
+    assert(p.get("string", string("")) == "text");
+    assert(!p.get("document", microbson::document()).contains("a"));
+    assert(p.get("document", microbson::document()).get("b", 0) == 4);
+
+    written = microbson::projection(fields, false).apply(m, output, size);
+    p = microbson::document(output, written);
+
+    assert(written > 0 && p.valid());
+    assert(p.get("int32", 0) == 1 && !p.contains("string"));
+    assert(p.get("binary").second == sizeof(d));
+    assert(p.get("document", microbson::document()).get("a", 0) == 3);
+    assert(!p.get("document", microbson::document()).contains("b"));
+
+    minibson::document r(output, written);
+
+    assert(r.get("document", minibson::document()).contains("a"));
+    assert(microbson::projection(fields, false).apply(m, output, 8) == 0);
+
+    delete[] output;
+    delete[] buffer;
+}
+
+void test_aggregate()
+{
+    using namespace std;
+
+    vector<string> buffers;
+    vector<microbson::document> documents;
+
+    for (int i = 0; i < 11; i++)
+    {
+        minibson::document d;
+        minibson::document s;
+
+        if (i % 3 == 0)
+            s.set("value", i);
+        else if (i % 3 == 1)
+            s.set("value", static_cast<long long>(i));
+        else if (i == 5)
+            s.set("value");
+        else
+            s.set("value", i + 0.5);
+
+        d.set("section", s);
+        buffers.push_back(string(d.get_serialized_size(), '\0'));
+        d.serialize(&buffers.back()[0], buffers.back().size());
+    }
+
+    for (size_t i = 0; i < buffers.size(); i++)
+        documents.push_back(
+            microbson::document(&buffers[i][0], buffers[i].size())
+        );
+
+    microbson::aggregator aggregator;
+    microbson::aggregate_result result = aggregator.run(documents, "section.value");
+
+    assert(result.count == 10 && result.null_count == 1);
+    assert(result.int32_count == 4 && result.int64_count == 4);
+    assert(result.double_count == 2 && result.missing_count == 0);
+    assert(result.sum == 0 + 1 + 3 + 4 + 6 + 7 + 9 + 10 + 2.5 + 8.5);
+    assert(result.min == 0.0 && result.max == 10.0);
+    assert(result.mean() == result.sum / 10);
+    assert(aggregator.get_values().size() == 10);
+
+    result = aggregator.run(documents, "section.other");
+
+    assert(result.count == 0 && result.missing_count == 11);
+}
+
+void test_columns()
+{
+    using namespace std;
+
+    vector<string> buffers;
+    vector<microbson::document> documents;
+
+    for (int i = 0; i < 10; i++)
+    {
+        minibson::document d;
+
+        d.set("id", i);
+        d.set("flag", i % 2 == 0);
+
+        if (i != 3)
+            d.set("name", string(i, 'x'));
+
+        d.set("nested", minibson::document().set("value", i * 1.5));
+        buffers.push_back(string(d.get_serialized_size(), '\0'));
+        d.serialize(&buffers.back()[0], buffers.back().size());
+    }
+
+    for (size_t i = 0; i < buffers.size(); i++)
+        documents.push_back(
+            microbson::document(&buffers[i][0], buffers[i].size())
+        );
+
+    microbson::transposer transposer;
+    size_t id = transposer.add("id", microbson::int64_node);
+    size_t flag = transposer.add("flag", microbson::boolean_node);
+    size_t name = transposer.add("name", microbson::string_node);
+    size_t value = transposer.add("nested.value", microbson::double_node);
+    size_t missing = transposer.add("nested.missing", microbson::int32_node);
+
+    assert(transposer.add("id", microbson::int64_node) == id);
+
+    transposer.run(documents);
+
+    assert(transposer.get_rows() == 10);
+    assert(transposer.get_column(id).null_count == 0);
+    assert(transposer.get_column(id).int64_values[7] == 7);
+    assert(transposer.get_column(flag).boolean_values[4] == 1);
+    assert(transposer.get_column(flag).boolean_values[5] == 0);
+    assert(transposer.get_column(name).null_count == 1);
+    assert(!transposer.get_column(name).valid(3));
+    assert(transposer.get_column(name).get_string(3) == "");
+    assert(transposer.get_column(name).get_string(4) == "xxxx");
+    assert(transposer.get_column(value).double_values[9] == 13.5);
+    assert(transposer.get_column(missing).null_count == 10);
+}
+
+void test_columnar()
+{
+    using namespace std;
+
+    string dump;
+
+    for (int i = 0; i < 100; i++)
+    {
+        minibson::document d;
+
+        d.set("id", i);
+        d.set("name", string(1, 'a' + i % 3));
+
+        if (i != 70)
+            d.set("nested", minibson::document().set("value", i * 0.5));
+
+        string buffer(d.get_serialized_size(), '\0');
+        d.serialize(&buffer[0], buffer.size());
+        dump += buffer;
+    }
+
+    microbson::columnar_writer writer("test_columnar.", 64);
+
+    assert(writer.add("id", microbson::int32_node));
+    assert(writer.add("name", microbson::string_node));
+    assert(writer.add("nested.value", microbson::double_node));
+
+    writer.write(microbson::document_sequence(&dump[0], dump.size()));
+    assert(writer.close());
+
+    microbson::column_reader id;
+
+    assert(id.open("test_columnar.id.col"));
+    assert(id.get_rows() == 100 && id.get_block_count() == 2);
+    assert(id.get_int32(99) == 99);
+    assert(id.get_stats(1).min_int == 64 && id.get_stats(1).max_int == 99);
+    assert(static_cast<const int*>(id.get_values(1))[3] == 67);
+
+    microbson::columnar_reader reader;
+
+    assert(reader.add("test_columnar.", "id"));
+    assert(reader.add("test_columnar.", "name"));
+    assert(reader.add("test_columnar.", "nested.value"));
+    assert(!reader.add("test_columnar.", "missing"));
+
+    assert(reader.get_column(1).get_dictionary_size() == 3);
+    assert(reader.get_column(2).get_stats(1).null_count == 1);
+    assert(reader.get_column(2).get_stats(0).max_double == 31.5);
+
+    minibson::document row(reader.get_row(65));
+
+    assert(row.get("id", 0) == 65);
+    assert(row.get("name", "") == "c");
+    assert(row.get("nested", minibson::document()).get("value", 0.0) == 32.5);
+    assert(!reader.get_row(70).contains("nested"));
+
+    // Truncated or inconsistent files are rejected
+    FILE* file = fopen("test_columnar.name.col", "rb");
+    string contents;
+    char chunk[4096];
+    size_t count;
+
+    while ((count = fread(chunk, 1, sizeof(chunk), file)) > 0)
+        contents.append(chunk, count);
+
+    fclose(file);
+
+    for (size_t length = 0; length < contents.size(); length += 7)
+    {
+        microbson::column_reader truncated;
+
+        file = fopen("test_columnar.bad.col", "wb");
+        fwrite(contents.data(), 1, length, file);
+        fclose(file);
+        assert(!truncated.open("test_columnar.bad.col"));
+    }
+
+    microbson::column_header header;
+    microbson::column_reader corrupt;
+
+    memcpy(&header, contents.data(), sizeof(header));
+    header.rows = 1LL << 40;
+    memcpy(&contents[0], &header, sizeof(header));
+    file = fopen("test_columnar.bad.col", "wb");
+    fwrite(contents.data(), 1, contents.size(), file);
+    fclose(file);
+    assert(!corrupt.open("test_columnar.bad.col"));
+
+    remove("test_columnar.bad.col");
+    remove("test_columnar.id.col");
+    remove("test_columnar.name.col");
+    remove("test_columnar.nested.value.col");
+}
+
+void test_index()
+{
+    using namespace std;
+
+    string dump;
+
+    for (int i = 0; i < 50; i++)
+    {
+        minibson::document d;
+
+        d.set("id", (i * 7) % 50);
+        d.set("name", string(1, 'a' + i % 5));
+        d.set("score", (i % 7 == 3) ? numeric_limits<double>::quiet_NaN() : i * 0.25);
+
+        if (i % 10 == 0)
+            d.set("id", static_cast<long long>(1000 + i));
+
+        string buffer(d.get_serialized_size(), '\0');
+        d.serialize(&buffer[0], buffer.size());
+        dump += buffer;
+    }
+
+    microbson::document_sequence sequence(&dump[0], dump.size());
+
+    assert(microbson::build_index(sequence, "id", microbson::int64_node, "test_index.id.idx"));
+    assert(microbson::build_index(sequence, "name", microbson::string_node, "test_index.name.idx"));
+    assert(microbson::build_index(sequence, "score", microbson::double_node, "test_index.score.idx"));
+    assert(!microbson::build_index(sequence, "id", microbson::boolean_node, "test_index.bad.idx"));
+
+    microbson::field_index id;
+    microbson::field_index name;
+    microbson::field_index score;
+    vector<microbson::document> result;
+
+    assert(id.open("test_index.id.idx") && id.get_count() == 50);
+    assert(name.open("test_index.name.idx") && name.get_count() == 50);
+    assert(score.open("test_index.score.idx"));
+
+    id.select(sequence, id.lookup(21), result);
+    assert(result.size() == 1 && result[0].get("id", 0) == 21);
+
+    assert(id.lookup(20).first == id.lookup(20).second);
+    assert(id.lookup(1000LL, 1040LL).second - id.lookup(1000LL, 1040LL).first == 5);
+
+    result.clear();
+    name.select(sequence, name.lookup("c"), result);
+    assert(result.size() == 10);
+
+    for (size_t i = 0; i < result.size(); i++)
+        assert(result[i].get("name", string()) == "c");
+
+    assert(name.lookup("b", "d").second - name.lookup("b", "d").first == 30);
+    assert(name.lookup("z").first == name.lookup("z").second);
+
+    result.clear();
+    score.select(sequence, score.lookup(1.0, 2.0), result);
+    assert(result.size() == 5 && result[0].get("score", 0.0) == 1.0);
+
+    // NaN sorts after every number
+    const double infinity = numeric_limits<double>::infinity();
+    const double nan = numeric_limits<double>::quiet_NaN();
+
+    assert(score.lookup(-infinity, infinity).second - score.lookup(-infinity, infinity).first == 43);
+    assert(score.lookup(nan, nan).first == score.lookup(-infinity, infinity).second);
+    assert(score.lookup(nan, nan).second - score.lookup(nan, nan).first == 7);
+
+    // Truncated or inconsistent files are rejected
+    FILE* file = fopen("test_index.name.idx", "rb");
+    string contents;
+    char chunk[4096];
+    size_t count;
+
+    while ((count = fread(chunk, 1, sizeof(chunk), file)) > 0)
+        contents.append(chunk, count);
+
+    fclose(file);
+
+    for (size_t length = 0; length < contents.size(); length += 5)
+    {
+        microbson::field_index truncated;
+
+        file = fopen("test_index.bad.idx", "wb");
+        fwrite(contents.data(), 1, length, file);
+        fclose(file);
+        assert(!truncated.open("test_index.bad.idx"));
+    }
+
+    microbson::index_header header;
+    microbson::index_entry entry;
+    microbson::field_index corrupt;
+    string modified(contents);
+
+    memcpy(&header, contents.data(), sizeof(header));
+    header.type = microbson::boolean_node;
+    memcpy(&modified[0], &header, sizeof(header));
+    file = fopen("test_index.bad.idx", "wb");
+    fwrite(modified.data(), 1, modified.size(), file);
+    fclose(file);
+    assert(!corrupt.open("test_index.bad.idx"));
+
+    modified = contents;
+    memcpy(&entry, contents.data() + sizeof(header), sizeof(entry));
+    entry.key = contents.size();
+    memcpy(&modified[sizeof(header)], &entry, sizeof(entry));
+    file = fopen("test_index.bad.idx", "wb");
+    fwrite(modified.data(), 1, modified.size(), file);
+    fclose(file);
+    assert(!corrupt.open("test_index.bad.idx"));
+
+    file = fopen("test_index.bad.idx", "wb");
+    fwrite(contents.data(), 1, contents.size(), file);
+    fclose(file);
+    assert(corrupt.open("test_index.bad.idx") && corrupt.get_count() == 50);
+
+    remove("test_index.bad.idx");
+    remove("test_index.id.idx");
+    remove("test_index.name.idx");
+    remove("test_index.score.idx");
+}
+
+void test_sort()
+{
+    using namespace std;
+
+    string dump;
+    FILE* file = fopen("test_sort.bson", "wb");
+
+    for (int i = 0; i < 500; i++)
+    {
+        minibson::document d;
+
+        d.set("group", (i * 7) % 5);
+        d.set("sequence", i);
+
+        if (i % 3 == 0)
+            d.set("time", static_cast<long long>((i * 37) % 101));
+        else
+            d.set("time", ((i * 37) % 101) + 0.5);
+
+        string buffer(d.get_serialized_size(), '\0');
+        d.serialize(&buffer[0], buffer.size());
+        dump += buffer;
+    }
+
+    fwrite(dump.data(), 1, dump.size(), file);
+    fclose(file);
+
+    // Small budget: several runs merged through the loser tree, in one
+    // pass and then in several with a small fan-in
+    microbson::external_sort sorter(3000, 3);
+
+    const size_t fan_ins[] = { 64, 3, 2 };
+
+    sorter.add_key("group", false);
+    sorter.add_key("time");
+
+    for (size_t f = 0; f < sizeof(fan_ins) / sizeof(fan_ins[0]); f++)
+    {
+        sorter.set_max_fan_in(fan_ins[f]);
+        assert(sorter.run("test_sort.bson", "test_sort.sorted.bson"));
+        assert(fopen("test_sort.sorted.bson.merge0.0", "rb") == NULL);
+
+        microbson::mapped_file sorted("test_sort.sorted.bson");
+        microbson::document_sequence sequence(sorted);
+        microbson::document previous;
+        size_t count = 0;
+
+        assert(sorted.get_size() == dump.size());
+
+        for (
+            microbson::document_sequence::const_iterator i = sequence.begin();
+            i != sequence.end();
+            ++i, count++
+        )
+        {
+            microbson::document current = *i;
+
+            if (count > 0)
+            {
+                int a = previous.get("group", 0);
+                int b = current.get("group", 0);
+                microbson::node x;
+                microbson::node y;
+
+                assert(a >= b);
+
+                previous.find("time", x);
+                current.find("time", y);
+
+                if (a == b)
+                {
+                    int order = microbson::compare_values(x, y);
+
+                    assert(order <= 0);
+
+                    if (order == 0)
+                        assert(previous.get("sequence", 0) < current.get("sequence", 0));
+                }
+            }
+
+            previous = current;
+        }
+
+        assert(count == 500);
+    }
+
+    // NaN sorts before every other number
+    const double keys[] = { 5, 3, numeric_limits<double>::quiet_NaN(), 4, 1, 2, 0, -1 };
+    const size_t key_count = sizeof(keys) / sizeof(keys[0]);
+
+    dump.clear();
+
+    for (size_t i = 0; i < key_count; i++)
+    {
+        minibson::document d;
+
+        d.set("value", keys[i]);
+
+        string buffer(d.get_serialized_size(), '\0');
+        d.serialize(&buffer[0], buffer.size());
+        dump += buffer;
+    }
+
+    file = fopen("test_sort.bson", "wb");
+    fwrite(dump.data(), 1, dump.size(), file);
+    fclose(file);
+
+    microbson::external_sort numbers(40, 1);
+
+    numbers.add_key("value");
+    assert(numbers.run("test_sort.bson", "test_sort.sorted.bson"));
+
+    {
+        microbson::mapped_file sorted("test_sort.sorted.bson");
+        microbson::document_sequence sequence(sorted);
+        microbson::document_sequence::const_iterator i = sequence.begin();
+        const double expected[] = { -1, 0, 1, 2, 3, 4, 5 };
+        double value = (*i).get("value", 0.0);
+
+        assert(value != value);
+
+        for (size_t j = 0; j < key_count - 1; j++)
+            assert((*++i).get("value", 0.0) == expected[j]);
+    }
+
+    // MinKey first, arrays between documents and binary data, timestamps
+    // after dates and MaxKey last
+    char min_key[] = { 8, 0, 0, 0, '\xFF', 'a', 0, 0 };
+    char max_key[] = { 8, 0, 0, 0, 0x7F, 'a', 0, 0 };
+    char timestamp[] = { 16, 0, 0, 0, 0x11, 'a', 0, 0, 0, 0, 0, 0, 0, 0, '\x80', 0 };
+    minibson::document values;
+    vector<char> buffer;
+    microbson::node ranked[7];
+
+    values.set("a", minibson::make_datetime(1));
+    values.set("b", minibson::array().push_back(1));
+    values.set("c", minibson::document());
+    values.set("d", minibson::binary::buffer(min_key, 1));
+    buffer.resize(values.get_serialized_size());
+    values.serialize(&buffer[0], buffer.size());
+
+    microbson::document parsed(&buffer[0], buffer.size());
+
+    microbson::document(min_key, sizeof(min_key)).find("a", ranked[0]);
+    parsed.find("c", ranked[1]);
+    parsed.find("b", ranked[2]);
+    parsed.find("d", ranked[3]);
+    parsed.find("a", ranked[4]);
+    microbson::document(timestamp, sizeof(timestamp)).find("a", ranked[5]);
+    microbson::document(max_key, sizeof(max_key)).find("a", ranked[6]);
+
+    for (size_t j = 0; j + 1 < 7; j++)
+    {
+        assert(microbson::compare_values(ranked[j], ranked[j + 1]) < 0);
+        assert(microbson::compare_values(ranked[j + 1], ranked[j]) > 0);
+    }
+
+    assert(microbson::compare_values(ranked[0], microbson::node()) < 0);
+
+    remove("test_sort.bson");
+    remove("test_sort.sorted.bson");
+}
+
+void test_json_writer()
+{
+    using namespace std;
+
+    minibson::document d;
+    unsigned char bytes[] = { 'M', 'a', 'n', 'y' };
+
+    d.set("int32", -42);
+    d.set("int64", 140737488355328LL);
+    d.set("float", 0.1);
+    d.set("whole", 3.0);
+    d.set("string", "a \"quoted\"\n\x01 line");
+    d.set("binary", minibson::binary::buffer(bytes, sizeof(bytes)));
+    d.set("boolean", true);
+    d.set("document", minibson::document().set("a", 3));
+    d.set("null");
+
+    const string expected =
+        "{\"binary\":{\"$binary\":{\"base64\":\"TWFueQ==\",\"subType\":\"00\"}},"
+        "\"boolean\":true,"
+        "\"document\":{\"a\":3},"
+        "\"float\":0.1,"
+        "\"int32\":-42,"
+        "\"int64\":140737488355328,"
+        "\"null\":null,"
+        "\"string\":\"a \\\"quoted\\\"\\n\\u0001 line\","
+        "\"whole\":3.0}";
+
+    minibson::json_writer writer;
+
+    assert(writer.write(d).str() == expected);
+
+    size_t size = d.get_serialized_size();
+    char* buffer = new char[size];
+    d.serialize(buffer, size);
+
+    writer.clear();
+    assert(writer.write(microbson::document(buffer, size)).str() == expected);
+
+    minibson::json_writer canonical(minibson::canonical_json);
+
+    canonical.write(minibson::document().set("a", 1).set("b", 2LL).set("c", 1.5));
+    assert(canonical.str() ==
+        "{\"a\":{\"$numberInt\":\"1\"},"
+        "\"b\":{\"$numberLong\":\"2\"},"
+        "\"c\":{\"$numberDouble\":\"1.5\"}}"
+    );
+
+    delete[] buffer;
+}
+
+void test_json_reader()
+{
+    using namespace std;
+
+    minibson::json_reader reader;
+    const string text =
+        " { \"int32\" : -42, \"int64\": 140737488355328, \"big\": 1e400,"
+        " \"float\": 0.25, \"string\": \"a \\\"b\\\"\\n\\u00e9\\ud83d\\ude00\","
+        " \"boolean\": false, \"null\": null,"
+        " \"binary\": {\"$binary\": {\"base64\": \"TWFueQ==\", \"subType\": \"80\"}},"
+        " \"long\": {\"$numberLong\": \"7\"},"
+        " \"document\": {\"a\": {\"b\": 3}, \"$c\": true} } ";
+
+    assert(reader.parse(text));
+
+    minibson::document d(reader.get_document());
+
+    assert(d.get("int32", 0) == -42);
+    assert(d.get("int64", 0LL) == 140737488355328LL);
+    assert(d.contains<double>("big") && d.get("float", 0.0) == 0.25);
+    assert(d.get("string", "") == "a \"b\"\n\xc3\xa9\xf0\x9f\x98\x80");
+    assert(d.contains<bool>("boolean") && d.contains("null"));
+    assert(d.get("binary", minibson::binary::buffer(NULL, 0)).length == 4);
+    assert(d.get("long", 0LL) == 7);
+    assert(d.get("document", minibson::document()).get("a", minibson::document()).get("b", 0) == 3);
+    assert(d.get("document", minibson::document()).get("$c", false));
+
+    microbson::document m(const_cast<char*>(reader.data()), reader.size());
+
+    assert(m.valid() && m.get("binary").second == 4);
+    assert(static_cast<unsigned char*>(m.get("binary").first)[-1] == 0x80);
+
+    // Writer output reads back to the same bytes
+    minibson::json_writer writer(minibson::canonical_json);
+
+    writer.write(d);
+    assert(reader.parse(writer.str()));
+    assert(reader.size() == d.get_serialized_size());
+
+    assert(reader.parse("{\"a\": [1, \"x\", {\"b\": 2}]}"));
+    assert(reader.data()[4] == minibson::array_node);
+
+    assert(!reader.parse("{\"a\": }"));
+    assert(reader.get_error_position() == 6);
+    assert(!reader.parse("{\"a\": 1} x"));
+    assert(!reader.parse("{\"a\": \"\\q\"}"));
+    assert(!reader.parse("[1]"));
+
+    // Extended JSON integers are checked for digits and range
+    assert(reader.parse("{\"a\": {\"$numberLong\": \"-9223372036854775808\"}}"));
+    assert(minibson::document(reader.data(), reader.size()).get("a", 0LL) == (-9223372036854775807LL - 1));
+    assert(!reader.parse("{\"a\": {\"$numberLong\": \"9223372036854775808\"}}"));
+    assert(!reader.parse("{\"a\": {\"$numberLong\": \"12ab\"}}"));
+    assert(!reader.parse("{\"a\": {\"$numberLong\": \"\"}}"));
+    assert(!reader.parse("{\"a\": {\"$numberLong\": \"-\"}}"));
+    assert(reader.parse("{\"a\": {\"$numberInt\": \"-2147483648\"}}"));
+    assert(!reader.parse("{\"a\": {\"$numberInt\": \"2147483648\"}}"));
+    assert(!reader.parse("{\"a\": {\"$date\": {\"$numberLong\": \"1x\"}}}"));
+
+    // Doubles are read whole
+    assert(reader.parse("{\"a\": {\"$numberDouble\": \"-1.5e3\"}}"));
+    assert(minibson::document(reader.data(), reader.size()).get("a", 0.0) == -1500.0);
+    assert(reader.parse("{\"a\": {\"$numberDouble\": \"-Infinity\"}}"));
+    assert(!reader.parse("{\"a\": {\"$numberDouble\": \"1.5abc\"}}"));
+    assert(!reader.parse("{\"a\": {\"$numberDouble\": \" 1.5\"}}"));
+    assert(!reader.parse("{\"a\": {\"$numberDouble\": \"inf\"}}"));
+    assert(!reader.parse("{\"a\": {\"$numberDouble\": \"0x10\"}}"));
+    assert(!reader.parse("{\"a\": {\"$numberDouble\": \"\"}}"));
+
+    // and dates for their fields' ranges
+    assert(reader.parse("{\"a\": {\"$date\": \"2024-02-29T23:59:59Z\"}}"));
+    assert(!reader.parse("{\"a\": {\"$date\": \"2023-02-29T00:00:00Z\"}}"));
+    assert(!reader.parse("{\"a\": {\"$date\": \"2024-13-01T00:00:00Z\"}}"));
+    assert(!reader.parse("{\"a\": {\"$date\": \"2024-01-01T24:00:00Z\"}}"));
+    assert(!reader.parse("{\"a\": {\"$date\": \"2024-01-01T00:60:00Z\"}}"));
+    assert(!reader.parse("{\"a\": {\"$date\": \"2024-01-01T00:00:00+2x:00\"}}"));
+
+    // Nesting past the limit fails instead of overflowing the stack
+    const string deep = "{\"a\": " + string(100000, '[') + string(100000, ']') + "}";
+    const string shallow = "{\"a\": " + string(99, '[') + string(99, ']') + "}";
+
+    assert(!reader.parse(deep) && reader.parse(shallow));
+    reader.set_max_depth(10);
+    assert(!reader.parse(shallow));
+}
+
+void test_array()
+{
+    using namespace std;
+
+    minibson::array a;
+
+    for (int i = 0; i < 12; i++)
+        a.push_back(i * i);
+
+    a.push_back("text").push_back(minibson::document().set("a", 1)).push_back();
+    a.set(1, 2.5);
+
+    assert(a.size() == 15);
+    assert(a.get(11, 0) == 121 && a.get(1, 0.0) == 2.5);
+    assert(a.contains<std::string>(12) && a.get(12, "") == "text");
+    assert(a.get(13, minibson::document()).get("a", 0) == 1);
+    assert(!a.contains(15) && a.get(15, -1) == -1);
+
+    minibson::document d;
+
+    d.set("before", 1);
+    d.set("list", a);
+    d.set("nested", minibson::array().push_back(minibson::array().push_back(7)));
+    d.set("zafter", 2);
+
+    size_t size = d.get_serialized_size();
+    char* buffer = new char[size];
+    d.serialize(buffer, size);
+
+    // Fields after an array are no longer dropped
+    minibson::document d1(buffer, size);
+
+    assert(d1.get("zafter", 0) == 2);
+    assert(d1.get("list", minibson::array()).size() == 15);
+    assert(d1.get("list", minibson::array()).get(10, 0) == 100);
+    assert(d1.get("nested", minibson::array()).get(0, minibson::array()).get(0, 0) == 7);
+
+    microbson::document m(buffer, size);
+    microbson::array l = m.get("list", microbson::array());
+
+    assert(m.get("zafter", 0) == 2);
+    assert(m.contains<microbson::array>("list"));
+    assert(l.size() == 15 && l.get(11, 0) == 121 && l.get(1, 0.0) == 2.5);
+    assert(l.get(12, string()) == "text" && l.contains<microbson::document>(13));
+    assert(l.get(13, microbson::document()).get("a", 0) == 1);
+    assert(!l.contains(15));
+    assert(m.get("nested", microbson::array()).get(0, microbson::array()).get(0, 0) == 7);
+
+    minibson::json_writer writer;
+
+    writer.write(m);
+    assert(writer.str() ==
+        "{\"before\":1,"
+        "\"list\":[0,2.5,4,9,16,25,36,49,64,81,100,121,\"text\",{\"a\":1},null],"
+        "\"nested\":[[7]],\"zafter\":2}"
+    );
+
+    writer.clear();
+    writer.write(d1);
+    assert(writer.str().find("\"nested\":[[7]]") != string::npos);
+
+    delete[] buffer;
+}
+
+void test_skip_table()
+{
+    using namespace std;
+
+    // Every type microbson doesn't decode, followed by a plain field
+    const char elements[] =
+        "\x06" "undefined\0"
+        "\x07" "oid\0" "0123456789ab"
+        "\x09" "date\0" "\x01\x02\x03\x04\x05\x06\x07\x08"
+        "\x0B" "regex\0" "^a.*\0" "i\0"
+        "\x0C" "pointer\0" "\x02\0\0\0" "c\0" "0123456789ab"
+        "\x0D" "code\0" "\x03\0\0\0" "f(\0"
+        "\x0E" "symbol\0" "\x02\0\0\0" "s\0"
+        "\x0F" "scope\0" "\x0F\0\0\0" "\x02\0\0\0" "x\0" "\x05\0\0\0\0"
+        "\x11" "timestamp\0" "\x01\x02\x03\x04\x05\x06\x07\x08"
+        "\x13" "decimal\0" "0123456789abcdef"
+        "\xFF" "min\0"
+        "\x7F" "max\0"
+        "\x10" "last\0" "\x2A\0\0\0";
+    string buffer(4, '\0');
+
+    buffer.append(elements, sizeof(elements) - 1);
+    buffer.push_back('\0');
+    *reinterpret_cast<int*>(&buffer[0]) = buffer.size();
+
+    microbson::document m(&buffer[0], buffer.size());
+
+    assert(m.valid() && m.get("last", 0) == 42);
+    assert(m.get_raw("oid").second == 12);
+    assert(memcmp(m.get_raw("oid").first, "0123456789ab", 12) == 0);
+    assert(m.get_raw("date").second == 8);
+    assert(m.get_raw("regex").second == 7);
+    assert(m.get_raw("pointer").second == 18);
+    assert(m.get_raw("scope").second == 15);
+    assert(m.get_raw("decimal").second == 16);
+    assert(m.contains("min") && m.get_raw("max").second == 0);
+    assert(m.get_raw("missing").first == NULL);
+
+    size_t count = 0;
+
+    for (
+        microbson::document::const_iterator i = m.begin();
+        i != m.end();
+        ++i
+    )
+        count++;
+
+    assert(count == 13);
+}
+
+void test_packed_array()
+{
+    using namespace std;
+
+    vector<double> samples;
+
+    for (int i = 0; i < 1000; i++)
+        samples.push_back(i * 0.5);
+
+    minibson::document d;
+
+    d.set("samples", minibson::array().assign(samples));
+    d.set("ids", minibson::array().push_back(1LL).push_back(2LL));
+    d.set("mixed", minibson::array().push_back(1).push_back(2.5));
+
+    size_t size = d.get_serialized_size();
+    char* buffer = new char[size];
+    d.serialize(buffer, size);
+
+    // Packed arrays serialize like any other array
+    microbson::document m(buffer, size);
+    microbson::array s = m.get("samples", microbson::array());
+
+    assert(s.size() == 1000 && s.get(999, 0.0) == 499.5);
+    assert(m.get("ids", microbson::array()).get(1, 0LL) == 2LL);
+
+    minibson::document d1(buffer, size);
+    const minibson::array& s1 = d1.get("samples", minibson::array());
+    const minibson::array& mixed = d1.get("mixed", minibson::array());
+
+    assert(s1.get_values<double>() != NULL && s1.get_values<double>()->size() == samples.size());
+    assert(equal(samples.begin(), samples.end(), s1.get_values<double>()->begin()));
+    assert(s1.get_values<int>() == NULL && s1.get(10, 0.0) == 5.0);
+    assert(s1.contains<double>(999) && !s1.contains<int>(0) && !s1.contains(1000));
+    assert(d1.get("ids", minibson::array()).get_values<long long int>()->size() == 2);
+    assert(mixed.get_values<int>() == NULL && mixed.get(1, 0.0) == 2.5);
+
+    // Storing another type unpacks
+    minibson::array a = s1;
+
+    a.push_back("end");
+    assert(a.get_values<double>() == NULL && a.size() == 1001);
+    assert(a.get(999, 0.0) == 499.5 && a.get(1000, "") == "end");
+
+    // Const arrays are never unpacked; at() unpacks the others
+    minibson::array b = s1;
+
+    assert(s1.at(0) == NULL && s1.get_values<double>() != NULL);
+    assert(b.at(1) != NULL && b.get_values<double>() == NULL && b.get(1, 0.0) == 0.5);
+
+    a.clear();
+    a.push_back(3).set(0, 4);
+    assert(a.get_values<int>() != NULL && a.get(0, 0) == 4);
+    a.pop_back();
+    a.pop_back();
+    assert(a.empty());
+
+    minibson::json_writer writer;
+
+    writer.write(minibson::document().set("a", minibson::array().push_back(1).push_back(2)));
+    assert(writer.str() == "{\"a\":[1,2]}");
+
+    delete [] buffer;
+}
+
+void test_object_id()
+{
+    using namespace std;
+
+    minibson::object_id_generator generator;
+    vector<minibson::object_id> ids;
+    const time_t now = time(NULL);
+
+    for (int i = 0; i < 10000; i++)
+        ids.push_back(generator.next());
+
+    assert(ids[0].get_time() >= now - 1 && ids[0].get_time() <= now + 1);
+    assert(memcmp(ids[0].bytes + 4, ids[1].bytes + 4, 5) == 0);
+    sort(ids.begin(), ids.end());
+    assert(adjacent_find(ids.begin(), ids.end()) == ids.end());
+
+    // Another generator draws other random bytes
+    minibson::object_id_generator other;
+    minibson::object_id id = other.next();
+
+    assert(memcmp(id.bytes + 4, ids[0].bytes + 4, 5) != 0);
+
+    // A counter that wraps within a second doesn't repeat ids
+    const minibson::object_id start = generator.next();
+
+    for (int i = 0; i < (1 << 24); i++)
+        assert(!(generator.next() == start));
+
+    minibson::document d;
+
+    d.set("_id", id);
+    d.set("time", minibson::make_datetime(1700000000123LL));
+    d.set("list", minibson::array().push_back(id).push_back(minibson::make_datetime(-1)));
+
+    assert(d.contains<minibson::object_id>("_id") && d.get("_id", minibson::object_id()) == id);
+
+    size_t size = d.get_serialized_size();
+    char* buffer = new char[size];
+    d.serialize(buffer, size);
+
+    minibson::document d1(buffer, size);
+
+    assert(d1.get("_id", minibson::object_id()) == id);
+    assert(d1.get("time", minibson::utc_datetime()).milliseconds == 1700000000123LL);
+    assert(d1.get("list", minibson::array()).get(1, minibson::utc_datetime()).milliseconds == -1);
+
+    microbson::document m(buffer, size);
+    microbson::object_id m_id = m.get("_id", microbson::object_id());
+
+    assert(m.contains<microbson::object_id>("_id") && memcmp(m_id.bytes, id.bytes, 12) == 0);
+    assert(m.get("time", microbson::utc_datetime()).milliseconds == 1700000000123LL);
+    assert(m.get("list", microbson::array()).get(1, microbson::utc_datetime()).milliseconds == -1);
+
+    minibson::json_writer writer;
+    minibson::json_reader reader;
+
+    writer.write(minibson::document().set("t", minibson::make_datetime(1700000000123LL)).set("u", minibson::make_datetime(0)));
+    assert(writer.str() == "{\"t\":{\"$date\":\"2023-11-14T22:13:20.123Z\"},\"u\":{\"$date\":\"1970-01-01T00:00:00Z\"}}");
+
+    writer.clear();
+    writer.write(m);
+    assert(reader.parse(writer.str()));
+    assert(reader.size() == size && memcmp(reader.data(), buffer, size) == 0);
+
+    assert(reader.parse("{\"t\": {\"$date\": \"2023-11-15T00:13:20.5+02:00\"}, \"o\": {\"$oid\": \"0123456789ABCDEF01234567\"}}"));
+    assert(reader.get_document().get("t", minibson::utc_datetime()).milliseconds == 1700000000500LL);
+    assert(reader.get_document().get("o", minibson::object_id()).bytes[1] == 0x23);
+    assert(!reader.parse("{\"o\": {\"$oid\": \"0123\"}}"));
+
+    delete [] buffer;
+}
+
+// Publishes new versions on index 0 while the other indexes read them
+struct snapshot_task
+{
+    microbson::snapshot_publisher* publisher;
+    int versions;
+    std::vector<char> results;
+
+    void operator()(size_t index)
+    {
+        if (index == 0)
+        {
+            for (int i = 1; i <= versions; i++)
+                publisher->publish(new microbson::frozen_document(
+                    minibson::document().set("a", i).set("b", i)
+                ));
+
+            return;
+        }
+
+        microbson::snapshot_reader reader(*publisher);
+        int last = 0;
+
+        results[index] = 1;
+
+        for (int i = 0; i < 20000; i++)
+        {
+            const microbson::snapshot& current = reader.get();
+
+            if (!current.valid())
+                continue;
+
+            int a = current->get("a", 0);
+
+            if ((a != current->get("b", -1)) || (a < last))
+                results[index] = 0;
+
+            last = a;
+        }
+    }
+};
+
+void test_snapshot()
+{
+    using namespace std;
+
+    minibson::document d;
+
+    d.set("zeta", 1).set("alpha", 2.5).set("mid", "text");
+    d.set("nested", minibson::document().set("x", 3));
+
+    microbson::frozen_document f(d);
+
+    assert(f.is_indexed() && f.get("alpha", 0.0) == 2.5);
+    assert(f.get("mid", string()) == "text" && f.get("zeta", 0) == 1);
+    assert(f.get("nested", microbson::document()).get("x", 0) == 3);
+    assert(f.contains<std::string>("mid") && !f.contains("missing"));
+    assert(f.get("missing", 7) == 7);
+
+    // Repeated names resolve to the first one, indexed or not
+    const char twice[] = "\x13\0\0\0" "\x10" "a\0" "\1\0\0\0" "\x10" "a\0" "\2\0\0\0" "\0";
+    microbson::frozen_document f1(twice, sizeof(twice) - 1);
+    microbson::frozen_document f2(twice, sizeof(twice) - 1, false);
+
+    assert(f1.get("a", 0) == 1 && f2.get("a", 0) == 1 && !f2.is_indexed());
+
+    microbson::snapshot_publisher publisher;
+    microbson::snapshot_reader reader(publisher);
+
+    assert(!reader.get().valid());
+    assert(publisher.publish(new microbson::frozen_document(d)) == 1U);
+
+    microbson::snapshot held = reader.get();
+
+    assert(held.valid() && held.get_version() == 1U && held->get("zeta", 0) == 1);
+
+    publisher.publish(new microbson::frozen_document(minibson::document().set("zeta", 2)));
+    assert(reader.get()->get("zeta", 0) == 2 && publisher.get().get_version() == 2U);
+
+    // The first version lives on while it is held
+    assert(held->get("zeta", 0) == 1);
+
+    microbson::snapshot_publisher shared;
+    snapshot_task task;
+
+    task.publisher = &shared;
+    task.versions = 200;
+    task.results.assign(4, 1);
+    microbson::parallel_for(4, task, 4);
+
+    for (size_t i = 0; i < task.results.size(); i++)
+        assert(task.results[i]);
+
+    assert(shared.get()->get("a", 0) == 200);
+}
+
+void test_serialize_parallel()
+{
+    using namespace std;
+
+    minibson::document d;
+    minibson::document section;
+    minibson::document inner;
+
+    for (int i = 0; i < 50; i++)
+    {
+        char name[16];
+
+        sprintf(name, "k%d", i);
+        inner.set(name, string(i, 'x'));
+        section.set(name, inner);
+    }
+
+    // One large section plus a few small fields: the section gets split
+    d.set("a", 1).set("section", section).set("z", "last");
+    d.set("empty", minibson::document());
+    d.set("list", minibson::array().push_back(1.5).push_back(2.5));
+
+    size_t size = d.get_serialized_size();
+    vector<char> expected(size, '\x7F');
+    vector<char> actual(size + 8, '\x55');
+
+    d.serialize(&expected[0], size);
+
+    for (size_t threads = 1; threads <= 8; threads *= 2)
+    {
+        minibson::serialize_parallel(d, &actual[0], actual.size(), threads);
+        assert(memcmp(&expected[0], &actual[0], size) == 0);
+    }
+
+    // Too small a buffer is left alone
+    vector<char> small(size - 1, '\x55');
+
+    minibson::serialize_parallel(d, &small[0], small.size(), 4);
+    assert(small[0] == '\x55');
+
+    minibson::serialize_parallel(minibson::document(), &actual[0], actual.size(), 4);
+    assert(actual[0] == 5 && actual[4] == 0);
+}
+
+void test_deserialize_parallel()
+{
+    using namespace std;
+
+    minibson::document d;
+    minibson::document section;
+
+    for (int i = 0; i < 40; i++)
+    {
+        char name[16];
+
+        sprintf(name, "k%d", i);
+        section.set(name, minibson::document().set("i", i).set("s", string(i, 'y')));
+    }
+
+    d.set("a", 1).set("section", section).set("z", "last");
+    d.set("list", minibson::array().push_back(1.5).push_back("two"));
+
+    size_t size = d.get_serialized_size();
+    vector<char> buffer(size);
+    vector<char> expected(size);
+    vector<char> actual(size);
+
+    d.serialize(&buffer[0], size);
+    d.serialize(&expected[0], size);
+
+    for (size_t threads = 1; threads <= 8; threads *= 2)
+    {
+        minibson::document result;
+
+        minibson::deserialize_parallel(&buffer[0], size, result, 0, threads);
+        assert(result.get_serialized_size() == size);
+        result.serialize(&actual[0], size);
+        assert(actual == expected);
+    }
+
+    // Parsing stops at a type minibson can't read, in that document only
+    const char regex[] =
+        "\x28\0\0\0"
+        "\x03" "d\0" "\x19\0\0\0" "\x10" "a\0" "\1\0\0\0" "\x0B" "r\0" "x\0\0" "\x10" "b\0" "\2\0\0\0" "\0"
+        "\x10" "c\0" "\3\0\0\0"
+        "\0";
+    minibson::document partial;
+
+    minibson::deserialize_parallel(regex, sizeof(regex) - 1, partial, 0, 4);
+    assert(partial.get("c", 0) == 3);
+    assert(partial.get("d", minibson::document()).get("a", 0) == 1);
+    assert(!partial.get("d", minibson::document()).contains("b"));
+}
+
+void test_node_pool()
+{
+    using namespace std;
+
+    const size_t pages = minibson::node_pool::get_page_count();
+    void* a = minibson::node_pool::allocate(24);
+    void* b = minibson::node_pool::allocate(20);
+
+    assert(a != b && minibson::node_pool::get_page_count() >= pages);
+
+    // Freed blocks come back first, for any size in the same class
+    minibson::node_pool::deallocate(a, 24);
+    assert(minibson::node_pool::allocate(32) == a);
+
+    // Beyond the largest class blocks go to operator new
+    void* large = minibson::node_pool::allocate(1000);
+
+    minibson::node_pool::deallocate(large, 1000);
+    minibson::node_pool::deallocate(a, 32);
+    minibson::node_pool::deallocate(b, 20);
+
+    map<int, string, less<int>, minibson::pool_allocator<pair<const int, string> > > m;
+
+    for (int i = 0; i < 1000; i++)
+        m[i] = "value";
+
+    assert(m.size() == 1000 && m[999] == "value");
+
+    const size_t used = minibson::node_pool::get_page_count();
+
+    // Clearing and refilling reuses the same blocks
+    m.clear();
+
+    for (int i = 0; i < 1000; i++)
+        m[i] = "value";
+
+    assert(minibson::node_pool::get_page_count() == used);
+}
+
+void test_assign_from()
+{
+    using namespace std;
+
+    minibson::document first, second, result;
+    minibson::array values, names;
+
+    values.push_back(1).push_back(2).push_back(3);
+    names.push_back(string("a")).push_back(string("b"));
+    first.set("id", 1).set("name", "first").set("sub", minibson::document().set("x", 1.5)).set("values", values).set("names", names).set("gone", true);
+
+    values.clear();
+    values.push_back(4).push_back(5);
+    names.clear();
+    names.push_back(string("c")).push_back(7).push_back(string("d"));
+    second.set("id", 2LL).set("name", "second and longer").set("sub", minibson::document().set("x", 2.5).set("y", 1)).set("values", values).set("names", names).set("new", "value");
+
+    vector<char> buffer(first.get_serialized_size());
+    vector<char> expected, actual;
+
+    first.serialize(&buffer[0], buffer.size());
+    result.assign_from(&buffer[0], buffer.size());
+    assert(result.get("name", "") == "first" && result.get("gone", false));
+
+    const minibson::document* sub = &result.get("sub", minibson::document());
+    const minibson::array* list = &result.get("names", minibson::array());
+
+    // Same names and types: values change, nodes stay
+    first.set("id", 3).set("name", "third").set("sub", minibson::document().set("x", 3.5));
+    first.serialize(&buffer[0], buffer.size());
+    result.assign_from(&buffer[0], buffer.size());
+    assert(result.get("id", 0) == 3 && result.get("name", "") == "third");
+    assert(&result.get("sub", minibson::document()) == sub && sub->get("x", 0.0) == 3.5);
+    assert(&result.get("names", minibson::array()) == list);
+
+    // Changed types, added and removed names, resized arrays
+    buffer.resize(second.get_serialized_size());
+    second.serialize(&buffer[0], buffer.size());
+    result.assign_from(&buffer[0], buffer.size());
+    assert(&result.get("sub", minibson::document()) == sub);
+    assert(result.get("id", 0LL) == 2 && !result.contains<int>("id"));
+    assert(!result.contains("gone") && result.get("new", "") == "value");
+    assert(result.get("values", minibson::array()).get_values<int>()->size() == 2);
+    assert(result.get("names", minibson::array()).get(1, 0) == 7);
+
+    expected = buffer;
+    actual.resize(result.get_serialized_size());
+    result.serialize(&actual[0], actual.size());
+    assert(actual == expected);
+}
+
+void test_memory_resource()
+{
+    using namespace std;
+
+    struct counting_resource : public minibson::memory_resource
+    {
+        size_t live;
+
+        counting_resource() : live(0) { }
+
+        void* allocate(const size_t size) { live += size; return ::operator new(size); }
+
+        void deallocate(void* const pointer, const size_t size) { live -= size; ::operator delete(pointer); }
+    };
+
+    counting_resource counting;
+    char storage[256];
+    minibson::monotonic_resource arena(storage, sizeof(storage), &counting);
+
+    // Aligned blocks from the buffer first, then from upstream chunks
+    char* first = static_cast<char*>(arena.allocate(3));
+    char* second = static_cast<char*>(arena.allocate(8));
+
+    assert(first >= storage && second + 8 <= storage + sizeof(storage));
+    assert(reinterpret_cast<size_t>(second) % 16 == 0 && second > first);
+    assert(counting.live == 0);
+
+    arena.allocate(1000);
+    assert(counting.live > 1000);
+
+    arena.release();
+    assert(counting.live == 0 && arena.allocate(3) == first);
+
+    // Blocks go back to the resource they came from
+    minibson::memory_resource* const previous = minibson::get_memory_resource();
+    void* block;
+
+    {
+        minibson::scoped_memory_resource scope(counting);
+        map<int, int, less<int>, minibson::resource_allocator<pair<const int, int> > > m;
+
+        assert(minibson::get_memory_resource() == &counting);
+
+        for (int i = 0; i < 100; i++)
+            m[i] = i;
+
+        assert(counting.live >= 100 * sizeof(int));
+        block = minibson::detail::resource_allocate(10);
+    }
+
+    assert(minibson::get_memory_resource() == previous && counting.live > 0);
+    minibson::detail::resource_deallocate(block, 10);
+    assert(counting.live == 0);
+
+#if defined(MINIBSON_MEMORY_RESOURCE)
+    // Packed values too, including those of copies
+    {
+        minibson::scoped_memory_resource scope(counting);
+        minibson::array packed;
+
+        for (int i = 0; i < 1000; i++)
+            packed.push_back(i);
+
+        assert(packed.get_values<int>() != NULL && counting.live >= 1000 * sizeof(int));
+
+        const size_t live = counting.live;
+        const minibson::array copy(packed);
+
+        assert(counting.live >= live + 1000 * sizeof(int));
+    }
+
+    assert(counting.live == 0);
+#endif
+}
+
+void test_memory_usage()
+{
+    using namespace std;
+
+    const string text(100, 'x');
+    const string key(100, 'k');
+    char data[64] = { 0 };
+    minibson::document d;
+
+    d.set("a", 1).set(key, text).set("data", minibson::binary::buffer(data, sizeof(data)));
+    d.set("list", minibson::array().push_back(string("x")).push_back(true));
+
+    const minibson::memory_footprint usage = d.memory_usage();
+
+    assert(usage.strings >= text.length() + 1);
+#if !defined(MINIBSON_INTERNED_KEYS)
+    assert(usage.keys >= key.length() + 1);
+#endif
+    assert(usage.binaries == sizeof(data));
+    assert(usage.map_entries > 4 * sizeof(void*) * 4);
+    assert(usage.vectors >= 2 * sizeof(void*));
+    assert(usage.nodes > sizeof(minibson::document) + sizeof(minibson::array));
+    assert(usage.get_total() > d.get_serialized_size());
+
+    // Short values stay in their string objects
+    minibson::document small;
+
+    small.set("a", "b");
+    assert(small.memory_usage().strings == 0 && small.memory_usage().keys == 0);
+
+    // Every value node counts its own size
+    minibson::document flags;
+
+    flags.set("a", true).set("b", 1).set("c");
+    assert(flags.memory_usage().nodes
+        == sizeof(minibson::document) + sizeof(minibson::boolean) + sizeof(minibson::int32) + sizeof(minibson::null));
+
+#if defined(MINIBSON_NODE_STATS)
+    const long nodes = minibson::node_stats::get_node_count();
+    const long strings = minibson::node_stats::get_byte_count(minibson::string_node);
+
+    {
+        minibson::document copy(d);
+
+        assert(minibson::node_stats::get_node_count() == nodes + 7);
+        assert(minibson::node_stats::get_byte_count(minibson::string_node) >= strings + static_cast<long>(text.length()));
+    }
+
+    assert(minibson::node_stats::get_node_count() == nodes);
+    assert(minibson::node_stats::get_byte_count(minibson::string_node) == strings);
+#else
+    assert(minibson::node_stats::get_node_count() == 0);
+#endif
+}
+
+struct bound_point
+{
+    int x;
+    double y;
+};
+
+struct bound_shape
+{
+    bool closed;
+    long long id;
+    std::string name;
+    bound_point origin;
+    std::vector<bound_point> points;
+    std::vector<int> tags;
+};
+
+MICROBSON_BINDING(bound_point)
+    MICROBSON_FIELD(x)
+    MICROBSON_FIELD(y)
+MICROBSON_BINDING_END
+
+MICROBSON_BINDING(bound_shape)
+    MICROBSON_FIELD(closed)
+    MICROBSON_FIELD(id)
+    MICROBSON_FIELD(name)
+    MICROBSON_FIELD(origin)
+    MICROBSON_FIELD(points)
+    MICROBSON_NAMED_FIELD(tags, "tag_list")
+MICROBSON_BINDING_END
+
+struct bound_flags
+{
+    std::vector<bool> flags;
+    int a_rather_long_field_name;
+};
+
+MICROBSON_BINDING(bound_flags)
+    MICROBSON_FIELD(flags)
+    MICROBSON_FIELD(a_rather_long_field_name)
+MICROBSON_BINDING_END
+
+void test_struct_binding()
+{
+    using namespace std;
+
+    bound_shape shape;
+    bound_point point = { 3, 4.5 };
+
+    shape.closed = true;
+    shape.id = 1LL << 40;
+    shape.name = "triangle";
+    shape.origin.x = 1;
+    shape.origin.y = 2.5;
+    shape.points.push_back(point);
+    shape.points.push_back(point);
+    shape.tags.push_back(7);
+
+    // Same bytes as the equivalent tree, whose keys happen to be in order
+    minibson::document tree;
+    minibson::array points, tags;
+
+    points.push_back(minibson::document().set("x", 3).set("y", 4.5));
+    points.push_back(minibson::document().set("x", 3).set("y", 4.5));
+    tags.push_back(7);
+    tree.set("closed", true).set("id", 1LL << 40).set("name", "triangle");
+    tree.set("origin", minibson::document().set("x", 1).set("y", 2.5));
+    tree.set("points", points).set("tag_list", tags);
+
+    vector<char> expected(tree.get_serialized_size());
+    vector<char> buffer(microbson::encoded_size(shape));
+
+    tree.serialize(&expected[0], expected.size());
+    assert(buffer.size() == expected.size());
+    assert(microbson::encode(shape, &buffer[0], buffer.size() - 1) == 0);
+    assert(microbson::encode(shape, &buffer[0], buffer.size()) == buffer.size());
+    assert(buffer == expected);
+
+    bound_shape copy;
+
+    copy.closed = false;
+    copy.id = 0;
+    copy.origin.x = 0;
+    copy.origin.y = 0;
+    assert(microbson::decode(microbson::document(&buffer[0], buffer.size()), copy) == 6);
+    assert(copy.closed && copy.id == shape.id && copy.name == "triangle");
+    assert(copy.origin.x == 1 && copy.origin.y == 2.5);
+    assert(copy.points.size() == 2 && copy.points[1].x == 3 && copy.points[1].y == 4.5);
+    assert(copy.tags.size() == 1 && copy.tags[0] == 7);
+
+    // Out of order, missing and mistyped fields
+    minibson::document other;
+
+    other.set("y", 1.5).set("x", "not a number");
+
+    vector<char> other_buffer(other.get_serialized_size());
+
+    other.serialize(&other_buffer[0], other_buffer.size());
+    point.x = 9;
+    assert(microbson::decode(microbson::document(&other_buffer[0], other_buffer.size()), point) == 1);
+    assert(point.x == 9 && point.y == 1.5);
+
+    // Vectors of bool, and names shorter than the bound ones
+    bound_flags flags;
+    bound_flags flags_copy;
+
+    flags.flags.push_back(true);
+    flags.flags.push_back(false);
+    flags.a_rather_long_field_name = 5;
+    buffer.resize(microbson::encoded_size(flags));
+    assert(microbson::encode(flags, &buffer[0], buffer.size()) == buffer.size());
+    assert(microbson::decode(microbson::document(&buffer[0], buffer.size()), flags_copy) == 2);
+    assert(flags_copy.flags == flags.flags && flags_copy.a_rather_long_field_name == 5);
+
+    minibson::document short_names;
+
+    short_names.set("flags", minibson::array()).set("a", 1);
+
+    vector<char> exact(short_names.get_serialized_size());
+
+    short_names.serialize(&exact[0], exact.size());
+
+    assert(microbson::decode(microbson::document(&exact[0], exact.size()), flags_copy) == 1);
+    assert(flags_copy.flags.empty() && flags_copy.a_rather_long_field_name == 5);
+}
+
+void test_schema()
+{
+    using namespace std;
+
+    microbson::schema expected;
+    microbson::schema_record record;
+
+    expected.add("id", microbson::int32_node).add("name", microbson::string_node).add("score", microbson::double_node);
+    assert(expected.size() == 3);
+
+    // minibson writes keys sorted, which is the expected order here
+    minibson::document in_order;
+
+    in_order.set("id", 7).set("name", "seven").set("score", 0.5);
+
+    vector<char> buffer(in_order.get_serialized_size());
+
+    in_order.serialize(&buffer[0], buffer.size());
+    assert(expected.decode(microbson::document(&buffer[0], buffer.size()), record) == 3);
+    assert(expected.get_hits() == 3 && expected.get_misses() == 0);
+    assert(record.get_field(0, 0) == 7 && record.get_field(1, "") == "seven" && record.get_field(2, 0.0) == 0.5);
+    assert(record.get("name", string()) == "seven");
+
+    // An extra field costs one miss, then decoding is back in step
+    minibson::document extra;
+
+    extra.set("id", 8).set("label", "x").set("name", "eight").set("score", 1.5);
+    buffer.resize(extra.get_serialized_size());
+    extra.serialize(&buffer[0], buffer.size());
+    expected.reset_counts();
+    assert(expected.decode(microbson::document(&buffer[0], buffer.size()), record) == 3);
+    assert(expected.get_hits() == 2 && expected.get_misses() == 1);
+    assert(record.get_field(1, "") == "eight" && record.get_field(2, 0.0) == 1.5);
+
+    // Missing fields and fields of another type are not found
+    minibson::document other;
+
+    other.set("id", 9LL).set("score", 2.5);
+    buffer.resize(other.get_serialized_size());
+    other.serialize(&buffer[0], buffer.size());
+    expected.reset_counts();
+    assert(expected.decode(microbson::document(&buffer[0], buffer.size()), record) == 1);
+    assert(expected.get_hits() == 0 && expected.get_misses() == 3);
+    assert(!record.has_field(0) && !record.has_field(1) && record.has_field(2));
+    assert(record.get_field(0, -1) == -1 && record.get_field(2, 0.0) == 2.5);
+
+    // A short last element is never read past
+    minibson::document short_last;
+
+    short_last.set("id", 10).set("n", true);
+
+    vector<char> exact(short_last.get_serialized_size());
+
+    short_last.serialize(&exact[0], exact.size());
+    assert(expected.decode(microbson::document(&exact[0], exact.size()), record) == 1);
+    assert(record.get_field(0, 0) == 10 && !record.has_field(1));
+}
+
+void test_keys()
+{
+    using namespace std;
+
+    const microbson::key id("id");
+    const microbson::key name("a_rather_long_name_for_a_field");
+    const string text("id");
+
+    assert(id.get_length() == 2 && id == microbson::key(text) && id != name);
+    assert(id.get_hash() == microbson::key("id", 2).get_hash());
+    assert(id.matches("id") && !id.matches("i") && !id.matches("idx"));
+    assert(microbson::key("").matches("") && !microbson::key("").matches("a"));
+
+    // Runtime hashes don't recurse, however long the name
+    const string huge(4 << 20, 'k');
+
+    assert(microbson::key(huge).get_hash() == microbson::key(huge.data(), huge.size()).get_hash());
+
+#if __cplusplus >= 201103L
+    constexpr microbson::key literal("id");
+
+    static_assert(literal.get_hash() == microbson::key::get_literal_hash("id", 2), "hashed at compile time");
+    assert(literal.get_hash() == id.get_hash());
+#endif
+
+    minibson::document d;
+
+    d.set(id, 1).set(name, "value").set(minibson::key("sub"), minibson::document().set("x", 2));
+    d.set(minibson::key("list"), minibson::array().push_back(3)).set(minibson::key("nothing"));
+    assert(d.get("id", 0) == 1 && d.get(id, 0) == 1 && d.get(name, "") == "value");
+    assert(d.contains(id) && d.contains<int>(id) && !d.contains<double>(id));
+    assert(!d.contains(minibson::key("i")) && d.contains(minibson::key("nothing")));
+    assert(d.get(minibson::key("sub"), minibson::document()).get("x", 0) == 2);
+    assert(d.get(minibson::key("list"), minibson::array()).get(0, 0) == 3);
+
+    // Setting an existing key replaces its value
+    d.set(id, 5LL);
+    assert(d.get(id, 0LL) == 5 && d.get(id, 0) == 0);
+
+    vector<char> buffer(d.get_serialized_size());
+
+    d.serialize(&buffer[0], buffer.size());
+
+    const microbson::document m(&buffer[0], buffer.size());
+
+    assert(m.get(id, 0LL) == 5 && m.get(name, "") == "value");
+    assert(m.contains(name) && m.contains<long long>(id) && !m.contains(microbson::key("i")));
+    assert(m.get(microbson::key("sub"), microbson::document()).get("x", 0) == 2);
+    assert(m.get(microbson::key("list"), microbson::array()).get(0, 0) == 3);
+}
+
+void test_key_table()
+{
+    using namespace std;
+
+    minibson::key_table table;
+    minibson::key_table* const previous = &minibson::get_key_table();
+
+    assert(table.intern("name") == table.intern(string("name")) && table.size() == 1);
+
+    {
+        minibson::scoped_key_table scope(table);
+        const minibson::interned_name a("a_long_name_that_would_need_its_own_allocation");
+        const minibson::interned_name b(string("a_long_name_that_would_need_its_own_allocation"));
+
+        assert(&minibson::get_key_table() == &table && table.size() == 2);
+        assert(&a.str() == &b.str() && a == b && !(a < b) && !(b < a));
+        assert(minibson::interned_name("a") < minibson::interned_name("b"));
+
+#if defined(MINIBSON_INTERNED_KEYS)
+        // Documents read with the same table share their names
+        minibson::document source;
+
+        source.set("a_long_name_that_would_need_its_own_allocation", 1);
+
+        vector<char> buffer(source.get_serialized_size());
+
+        source.serialize(&buffer[0], buffer.size());
+
+        const minibson::document first(&buffer[0], buffer.size());
+        const minibson::document second(&buffer[0], buffer.size());
+
+        assert(&static_cast<const string&>(first.begin()->first) == &static_cast<const string&>(second.begin()->first));
+        assert(first.memory_usage().keys == 0);
+
+        // Lookups leave the table alone
+        const size_t names = table.size();
+
+        assert(!first.contains("missing") && first.get("also_missing", 0) == 0);
+        assert(!first.contains(minibson::key("missing_key")) && first.get("a_long_name_that_would_need_its_own_allocation", 0) == 1);
+        assert(table.size() == names);
+
+        // Parallel parsing interns into the caller's table
+        minibson::document nested;
+        minibson::document parsed;
+
+        for (int i = 0; i < 8; i++) {
+            char name[32];
+
+            sprintf(name, "worker_name_%d", i);
+            nested.set(string(name), minibson::document().set(string(name) + "_inner", i));
+        }
+
+        buffer.resize(nested.get_serialized_size());
+        nested.serialize(&buffer[0], buffer.size());
+        minibson::deserialize_parallel(&buffer[0], buffer.size(), parsed, 0, 4);
+        assert(table.size() == names + 16);
+        assert(parsed.get("worker_name_3", minibson::document()).get("worker_name_3_inner", 0) == 3);
+#endif
+    }
+
+    assert(&minibson::get_key_table() == previous);
+}
+
+void test_key_dictionary()
+{
+    using namespace std;
+
+    microbson::key_dictionary dictionary(2);
+    minibson::document d;
+
+    assert(dictionary.add("customer_billing_address_line_1") == 0);
+    assert(dictionary.add("customer_billing_address_line_2") == 1);
+    assert(dictionary.add("items") == 2 && dictionary.add("x") == 3);
+    assert(dictionary.add("items") == 2 && dictionary.size() == 4);
+
+    d.set("customer_billing_address_line_1", "1 Main Street");
+    d.set("customer_billing_address_line_2", "Springfield");
+    d.set("not_in_the_dictionary", 3);
+    d.set("x", 4);
+    d.set(
+        "items",
+        minibson::array()
+            .push_back(minibson::document().set("customer_billing_address_line_1", 5))
+            .push_back(6)
+    );
+
+    vector<char> original(d.get_serialized_size());
+    d.serialize(&original[0], original.size());
+
+    const microbson::document source(&original[0], original.size());
+    const size_t size = microbson::get_compressed_size(dictionary, source);
+    vector<char> compressed(size);
+
+    assert(size > 0 && size < original.size());
+    assert(microbson::compress_keys(dictionary, source, &compressed[0], size - 1) == 0);
+    assert(microbson::compress_keys(dictionary, source, &compressed[0], size) == size);
+
+    // Compressed documents are queried through the keys of the dictionary
+    const microbson::document packed(&compressed[0], compressed.size());
+    const microbson::key line = dictionary.get_key("customer_billing_address_line_1");
+    const microbson::array items = packed.get(dictionary.get_key("items"), microbson::array());
+
+    assert(microbson::get_dictionary_version(packed) == 2);
+    assert(microbson::get_dictionary_version(source) == -1);
+    assert(packed.get(line, "") == "1 Main Street");
+    assert(!packed.contains(microbson::key("customer_billing_address_line_1")));
+    assert(packed.get("not_in_the_dictionary", 0) == 3 && packed.get("x", 0) == 4);
+    assert(packed.get(dictionary.get_key("x"), 0) == 4);
+    assert(items.size() == 2 && items.get(0, microbson::document()).get(line, 0) == 5);
+
+    // Expanding restores the original document
+    vector<char> expanded(microbson::get_expanded_size(dictionary, packed));
+
+    assert(expanded.size() == original.size());
+    assert(microbson::expand_keys(dictionary, packed, &expanded[0], expanded.size()) == expanded.size());
+    assert(memcmp(&expanded[0], &original[0], original.size()) == 0);
+
+    // Newer dictionaries read older documents, but not the other way round
+    microbson::key_dictionary newer(dictionary);
+    microbson::key_dictionary older(1);
+
+    newer.set_version(3);
+    newer.add("a_name_added_later");
+    older.add("customer_billing_address_line_1");
+    assert(microbson::get_expanded_size(newer, packed) == original.size());
+    assert(microbson::get_expanded_size(older, packed) == 0);
+    assert(microbson::get_expanded_size(dictionary, source) == 0);
+
+    // Names that would read as codes can't be compressed
+    minibson::document clash;
+
+    clash.set("\x01\x02", 1);
+    vector<char> bytes(clash.get_serialized_size());
+    clash.serialize(&bytes[0], bytes.size());
+    assert(microbson::get_compressed_size(dictionary, microbson::document(&bytes[0], bytes.size())) == 0);
+}
+
+void test_block_compression()
+{
+    using namespace std;
+
+    // Round trips of repetitive, random and tiny inputs
+    vector<unsigned char> inputs[4];
+
+    for (int i = 0; i < 5000; i++)
+        inputs[0].push_back(static_cast<unsigned char>("abcabcabd"[i % 9]));
+
+    for (int i = 0; i < 5000; i++)
+        inputs[1].push_back(static_cast<unsigned char>(rand()));
+
+    inputs[2].assign(3, 'x');
+    inputs[3].assign(1000, 0);
+
+    for (size_t i = 0; i < 4; i++)
+    {
+        const vector<unsigned char>& input = inputs[i];
+        vector<unsigned char> packed(microbson::compress_bound(input.size()));
+        vector<unsigned char> unpacked(input.size());
+        size_t size = microbson::compress_block(&input[0], input.size(), &packed[0], packed.size());
+
+        assert(size > 0);
+        assert(microbson::decompress_block(&packed[0], size, &unpacked[0], unpacked.size()));
+        assert(unpacked == input);
+        assert(!microbson::decompress_block(&packed[0], size, &unpacked[0], unpacked.size() - 1));
+
+        if (i != 1)
+            assert(size < input.size() / 4 || input.size() < 16);
+    }
+
+    // Truncated blocks are rejected
+    vector<unsigned char> packed(microbson::compress_bound(inputs[0].size()));
+    vector<unsigned char> unpacked(inputs[0].size());
+    size_t size = microbson::compress_block(&inputs[0][0], inputs[0].size(), &packed[0], packed.size());
+
+    assert(!microbson::decompress_block(&packed[0], size - 1, &unpacked[0], unpacked.size()));
+    assert(microbson::compress_block(&inputs[0][0], inputs[0].size(), &packed[0], 4) == 0);
+
+    // Documents framed in blocks come back in order, from any number of threads
+    microbson::block_writer writer(4096);
+    vector<vector<char> > originals;
+
+    for (int i = 0; i < 500; i++)
+    {
+        minibson::document d;
+        char user[32];
+
+        sprintf(user, "user-%d", i % 17);
+        d.set("id", i).set("user", string(user)).set("active", i % 2 == 0);
+
+        // One document larger than a block
+        if (i == 250)
+            d.set("padding", string(10000, 'p'));
+
+        originals.push_back(vector<char>(d.get_serialized_size()));
+        d.serialize(&originals.back()[0], originals.back().size());
+        writer.add(&originals.back()[0], originals.back().size());
+    }
+
+    writer.flush();
+    writer.flush();
+
+    const vector<unsigned char>& stream = writer.get_output();
+    size_t total = 0;
+
+    for (size_t i = 0; i < originals.size(); i++)
+        total += originals[i].size();
+
+    assert(writer.get_block_count() > 2 && stream.size() < total / 2);
+
+    microbson::block_stream blocks(&stream[0], stream.size());
+
+    assert(blocks.is_valid() && blocks.get_block_count() == writer.get_block_count());
+    assert(blocks.get_raw_size() == total);
+
+    for (size_t threads = 1; threads <= 4; threads++)
+    {
+        vector<unsigned char> output;
+        vector<microbson::document> documents;
+
+        assert(blocks.decompress(output, documents, threads));
+        assert(documents.size() == originals.size());
+
+        for (size_t i = 0; i < documents.size(); i++)
+        {
+            assert(documents[i].get_size() == originals[i].size());
+            assert(memcmp(documents[i].get_bytes(), &originals[i][0], originals[i].size()) == 0);
+        }
+
+        assert(documents[42].get("id", 0) == 42);
+    }
+
+    // Truncated streams keep the blocks before the cut
+    microbson::block_stream truncated(&stream[0], stream.size() - 1);
+    vector<unsigned char> first(truncated.get_raw_size(0));
+
+    assert(!truncated.is_valid());
+    assert(truncated.get_block_count() == blocks.get_block_count() - 1);
+    assert(truncated.decompress(0, &first[0], first.size()));
+
+    // Blocks that don't decompress to their size are reported
+    vector<unsigned char> corrupt(stream);
+    vector<unsigned char> output;
+    vector<microbson::document> documents;
+
+    assert(corrupt[8] == microbson::lz_block);
+    corrupt[0]++;
+    assert(!microbson::block_stream(&corrupt[0], corrupt.size()).decompress(output, documents, 2));
+
+    // Raw sizes the stored bytes can't expand to are rejected up front
+    const unsigned int huge = 0xFFFFFFF0U;
+
+    corrupt = stream;
+    memcpy(&corrupt[0], &huge, sizeof(huge));
+    assert(!microbson::block_stream(&corrupt[0], corrupt.size()).is_valid());
+}